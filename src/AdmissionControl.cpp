@@ -0,0 +1,182 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+
+#include "AdmissionControl.h"
+#include "Packet.h"
+
+namespace pbote
+{
+namespace packet
+{
+
+AdmissionControl::AdmissionControl ()
+    : m_rejected (0), m_dropped (0)
+{
+  for (auto &counter : m_in_flight)
+    counter = 0;
+
+  m_limits.fill (0);
+  m_limits[type::CommS] = ADMISSION_MAX_STORE;
+  m_limits[type::CommQ] = ADMISSION_MAX_RETRIEVE;
+  m_limits[type::CommY] = ADMISSION_MAX_DELETE;
+  m_limits[(uint8_t)'L'] = ADMISSION_MAX_DELETE;
+  m_limits[type::CommD] = ADMISSION_MAX_DELETE;
+  m_limits[type::CommX] = ADMISSION_MAX_DELETE;
+  m_limits[type::CommF] = ADMISSION_MAX_PEER_LIST;
+  m_limits[type::CommA] = ADMISSION_MAX_PEER_LIST;
+
+  /// Requests which write to disk cost more
+  m_costs.fill (1);
+  m_costs[type::CommS] = 4;
+  m_costs[type::CommD] = 2;
+  m_costs[type::CommX] = 2;
+  m_costs[type::CommQ] = 2;
+
+  for (auto &part : m_shards)
+    part.unknown = { ADMISSION_UNKNOWN_BURST, clock::now (),
+                     clock::time_point () };
+}
+
+Admission
+AdmissionControl::admit (const sp_destination &sender, uint8_t packet_type,
+                         bool solicited)
+{
+  /// Answers to our own requests are never limited
+  if (!sender || (packet_type == type::CommN && solicited))
+    return Admission::accepted;
+
+  /// Sender is checked first, so flooding peer doesn't take slots of others
+  Admission result = take (sender, packet_type);
+
+  /// Reply to unsolicited response would make us a reflector
+  if (packet_type == type::CommN && result == Admission::rejected)
+    return Admission::dropped;
+
+  if (result != Admission::accepted)
+    return result;
+
+  size_t limit = m_limits[packet_type];
+  if (limit == 0)
+    return Admission::accepted;
+
+  if (m_in_flight[packet_type].fetch_add (1) >= limit)
+    {
+      m_in_flight[packet_type].fetch_sub (1);
+      return reject (sender);
+    }
+
+  return Admission::accepted;
+}
+
+void
+AdmissionControl::release (uint8_t packet_type)
+{
+  if (m_limits[packet_type] > 0)
+    m_in_flight[packet_type].fetch_sub (1);
+}
+
+Admission
+AdmissionControl::take (const sp_destination &sender, uint8_t packet_type)
+{
+  auto &part = m_shards[sender->hash.data ()[0] % ADMISSION_SHARDS];
+  auto now = clock::now ();
+
+  std::unique_lock<std::mutex> l (part.mutex);
+
+  auto itr = part.buckets.find (sender->hash);
+  if (itr == part.buckets.end ())
+    {
+      if (part.buckets.size () >= ADMISSION_SHARD_PRUNE)
+        prune (part, now);
+
+      /// Pruning is rate-limited, so flood of new senders could grow
+      /// shard without bound, they are throttled together instead
+      if (part.buckets.size () < ADMISSION_SHARD_MAX)
+        {
+          peer_bucket bucket = { ADMISSION_PEER_BURST, now,
+                                 clock::time_point () };
+          itr = part.buckets.emplace (sender->hash, bucket).first;
+        }
+    }
+
+  bool known = itr != part.buckets.end ();
+  auto &bucket = known ? itr->second : part.unknown;
+  double rate = known ? ADMISSION_PEER_RATE : ADMISSION_UNKNOWN_RATE;
+  double burst = known ? ADMISSION_PEER_BURST : ADMISSION_UNKNOWN_BURST;
+
+  double elapsed
+      = std::chrono::duration<double> (now - bucket.updated).count ();
+  bucket.tokens = std::min (burst, bucket.tokens + elapsed * rate);
+  bucket.updated = now;
+
+  if (bucket.tokens >= m_costs[packet_type])
+    {
+      bucket.tokens -= m_costs[packet_type];
+      return Admission::accepted;
+    }
+
+  l.unlock ();
+  return reject (sender);
+}
+
+Admission
+AdmissionControl::reject (const sp_destination &sender)
+{
+  auto &part = m_shards[sender->hash.data ()[0] % ADMISSION_SHARDS];
+  auto now = clock::now ();
+
+  std::unique_lock<std::mutex> l (part.mutex);
+
+  auto *bucket = bucket_unlocked (part, sender->hash);
+  if (now - bucket->rejected
+      < std::chrono::milliseconds (ADMISSION_REJECT_INTERVAL))
+    {
+      m_dropped++;
+      return Admission::dropped;
+    }
+
+  bucket->rejected = now;
+
+  m_rejected++;
+  return Admission::rejected;
+}
+
+void
+AdmissionControl::prune (shard &part, const clock::time_point &now)
+{
+  /// Shard full of active peers is not scanned on every new one
+  if (now - part.pruned < std::chrono::seconds (ADMISSION_PEER_IDLE / 10))
+    return;
+
+  part.pruned = now;
+
+  for (auto itr = part.buckets.begin (); itr != part.buckets.end ();)
+    {
+      if (now - itr->second.updated
+          > std::chrono::seconds (ADMISSION_PEER_IDLE))
+        itr = part.buckets.erase (itr);
+      else
+        ++itr;
+    }
+}
+
+AdmissionControl::peer_bucket *
+AdmissionControl::bucket_unlocked (shard &part,
+                                   const i2p::data::IdentHash &hash)
+{
+  auto itr = part.buckets.find (hash);
+  if (itr == part.buckets.end ())
+    return &part.unknown;
+
+  return &itr->second;
+}
+
+} // namespace packet
+} // namespace pbote
@@ -0,0 +1,117 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_ADMISSION_CONTROL_H_
+#define PBOTED_SRC_ADMISSION_CONTROL_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+#include "DestinationRegistry.h"
+
+namespace pbote
+{
+namespace packet
+{
+
+/// Average number of request tokens one peer gets per second
+#define ADMISSION_PEER_RATE 10
+/// Number of tokens one peer can spend at once after being silent
+#define ADMISSION_PEER_BURST 40
+/// Min. interval in msec between rejection responses to one peer,
+/// other rejected requests are dropped silently
+#define ADMISSION_REJECT_INTERVAL 1000
+/// Seconds of silence after which peer bucket is forgotten
+#define ADMISSION_PEER_IDLE 300
+/// Number of independently locked parts of peer buckets table
+#define ADMISSION_SHARDS 16
+/// Size of shard after which idle buckets are removed
+#define ADMISSION_SHARD_PRUNE 1024
+/// Max. size of shard, new peers over it share one bucket
+#define ADMISSION_SHARD_MAX 4096
+/// Tokens of bucket shared by new peers of one full shard
+#define ADMISSION_UNKNOWN_RATE 40
+#define ADMISSION_UNKNOWN_BURST 160
+
+/// Max. number of requests of one type handled at the same time
+#define ADMISSION_MAX_STORE 16
+#define ADMISSION_MAX_RETRIEVE 64
+#define ADMISSION_MAX_DELETE 16
+#define ADMISSION_MAX_PEER_LIST 32
+
+enum class Admission
+{
+  accepted,
+  /// Sender should get cheap response with error status
+  rejected,
+  dropped
+};
+
+/**
+ * @brief Admission control for incoming requests
+ *
+ * Every sender has token bucket, request costs depend on type.
+ * Number of requests of every type which are handled at the same time is
+ * limited too. Check is done before packet parsing, so rejected request
+ * costs only a hash table lookup.
+ */
+class AdmissionControl
+{
+ public:
+  AdmissionControl ();
+
+  /// Solicited is set for responses with CID of our own request
+  Admission admit (const sp_destination &sender, uint8_t packet_type,
+                   bool solicited = false);
+  /// Must be called once for every accepted request after it's handled
+  void release (uint8_t packet_type);
+
+  size_t rejected () const { return m_rejected; }
+  size_t dropped () const { return m_dropped; }
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  struct peer_bucket
+  {
+    double tokens;
+    clock::time_point updated;
+    clock::time_point rejected;
+  };
+
+  struct shard
+  {
+    std::mutex mutex;
+    std::unordered_map<i2p::data::IdentHash, peer_bucket> buckets;
+    /// Used by peers which don't fit in full shard
+    peer_bucket unknown;
+    clock::time_point pruned;
+  };
+
+  Admission take (const sp_destination &sender, uint8_t packet_type);
+  Admission reject (const sp_destination &sender);
+  void prune (shard &part, const clock::time_point &now);
+
+  static peer_bucket *bucket_unlocked (shard &part,
+                                       const i2p::data::IdentHash &hash);
+
+  std::array<shard, ADMISSION_SHARDS> m_shards;
+  std::array<std::atomic<size_t>, 256> m_in_flight;
+  std::array<size_t, 256> m_limits;
+  std::array<uint8_t, 256> m_costs;
+  std::atomic<size_t> m_rejected, m_dropped;
+};
+
+} // namespace packet
+} // namespace pbote
+
+#endif // PBOTED_SRC_ADMISSION_CONTROL_H_
@@ -26,8 +26,8 @@ BoteContext::BoteContext()
   start_time_ = ts_now ();
   rbe.seed(time (NULL));
 
-  m_recvQueue = std::make_shared<pbote::util::Queue<sp_queue_pkt>>();
-  m_sendQueue = std::make_shared<pbote::util::Queue<sp_queue_pkt>>();
+  m_recvQueue = std::make_shared<pbote::util::RingQueue<sp_queue_pkt>>();
+  m_sendQueue = std::make_shared<pbote::util::RingQueue<sp_queue_pkt>>();
 
   localDestination = std::make_shared<i2p::data::IdentityEx>();
   local_keys_ = std::make_shared<i2p::data::PrivateKeys>();
@@ -102,11 +102,17 @@ void
 BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch)
 {
   size_t count = 0;
-  runningBatches.push_back(batch);
-  LogPrint(eLogDebug, "Context: send: Running batches: ",
-           runningBatches.size ());
-
   auto packets = batch->getPackets();
+
+  {
+    std::unique_lock<std::mutex> l (m_batch_mutex_);
+    for (const auto& packet: packets)
+      m_pending_requests[packet.first] = batch;
+
+    LogPrint(eLogDebug, "Context: send: Pending requests: ",
+             m_pending_requests.size ());
+  }
+
   for (const auto& packet: packets)
     {
       send(packet.second);
@@ -116,41 +122,73 @@ BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch)
            batch->owner);
 }
 
+void
+BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch,
+                  const cid_key& cid, const PacketForQueue& packet)
+{
+  {
+    std::unique_lock<std::mutex> l (m_batch_mutex_);
+    m_pending_requests[cid] = batch;
+  }
+
+  send(packet);
+}
+
 bool
 BoteContext::receive(const std::shared_ptr<CommunicationPacket>& packet)
 {
-  if (runningBatches.empty ())
+  std::shared_ptr<batch_comm_packet> batch;
+  cid_key cid (packet->cid);
+
+  {
+    std::unique_lock<std::mutex> l (m_batch_mutex_);
+
+    auto request_itr = m_pending_requests.find (cid);
+    if (request_itr == m_pending_requests.end ())
+      {
+        if (m_finished_requests.find (cid) == m_finished_requests.end ())
+          return false;
+
+        LogPrint(eLogDebug, "Context: receive: Late response to finished request");
+        return true;
+      }
+
+    /// Request is answered, batch already finished or not
+    batch = request_itr->second.lock ();
+    m_pending_requests.erase (request_itr);
+    finish_request_unlocked (cid);
+  }
+
+  if (!batch)
     {
-      LogPrint(eLogWarning, "Context: receive: No running batches");
-      return false;
+      LogPrint(eLogDebug, "Context: receive: Batch already finished");
+      return true;
     }
 
-  std::vector<uint8_t> v_cid(packet->cid, packet->cid + 32);
-
-  auto batch_itr = runningBatches.begin ();
-  while (batch_itr != runningBatches.end ())
+  if (!batch->addResponse (packet))
     {
-      if (*batch_itr)
-        {
-          if ((*batch_itr)->contains (v_cid))
-            {
-              (*batch_itr)->addResponse (packet);
-              LogPrint (eLogDebug, "Context: receive: Response for batch ",
-                        (*batch_itr)->owner, ", remain count: ",
-                        (*batch_itr)->remain ());
-              return true;
-            }
-        }
-      else
-        {
-          LogPrint(eLogError, "Context: receive: Batch is null");
-          runningBatches.erase (batch_itr);
-        }
-
-      ++batch_itr;
+      LogPrint(eLogDebug, "Context: receive: Response is not expected by batch ",
+               batch->owner);
+      return true;
     }
 
-  return false;
+  LogPrint (eLogDebug, "Context: receive: Response for batch ", batch->owner,
+            ", remain count: ", batch->remain ());
+  return true;
+}
+
+bool
+BoteContext::expects(const cid_key& cid)
+{
+  std::unique_lock<std::mutex> l (m_batch_mutex_);
+
+  if (m_pending_requests.find (cid) != m_pending_requests.end ())
+    return true;
+
+  auto finished_itr = m_finished_requests.find (cid);
+  return finished_itr != m_finished_requests.end ()
+         && finished_itr->second + std::chrono::seconds (FINISHED_REQUEST_TTL)
+            > std::chrono::steady_clock::now ();
 }
 
 void
@@ -158,47 +196,54 @@ BoteContext::removeBatch(const std::shared_ptr<batch_comm_packet>& r_batch)
 {
   std::unique_lock<std::mutex> l (m_batch_mutex_);
 
-  if (runningBatches.empty ())
+  size_t removed = 0;
+  for (const auto& packet: r_batch->getPackets ())
     {
-      LogPrint(eLogWarning, "Context: No running batches");
-      return;
-    }
+      auto request_itr = m_pending_requests.find (packet.first);
+      if (request_itr == m_pending_requests.end ())
+        continue;
 
-  // For debug only
-  //*
-  for (auto batch : runningBatches)
-    {
-      if (batch)
-        LogPrint(eLogDebug, "Context: Batch: ", batch->owner);
-      else
-        LogPrint(eLogDebug, "Context: Batch is null");
+      auto batch = request_itr->second.lock ();
+      if (batch && batch != r_batch)
+        continue;
+
+      m_pending_requests.erase (request_itr);
+      finish_request_unlocked (packet.first);
+      removed++;
     }
-  //*/
 
-  auto batch_itr = runningBatches.begin ();
-  while (batch_itr != runningBatches.end ())
+  LogPrint(eLogDebug, "Context: removeBatch: Removed ", removed,
+           " pending requests of batch ", r_batch->owner, ", left: ",
+           m_pending_requests.size ());
+}
+
+void
+BoteContext::removeRequest(const cid_key& cid)
+{
+  std::unique_lock<std::mutex> l (m_batch_mutex_);
+  if (m_pending_requests.erase (cid) > 0)
+    finish_request_unlocked (cid);
+}
+
+void
+BoteContext::finish_request_unlocked(const cid_key& cid)
+{
+  auto now = std::chrono::steady_clock::now ();
+
+  /// Oldest go first, so purge stops at the first fresh one
+  while (!m_finished_order.empty ()
+         && m_finished_order.front ().first + std::chrono::seconds (FINISHED_REQUEST_TTL) <= now)
     {
-      if (*batch_itr)
-        {
-          LogPrint(eLogDebug, "Context: Batch: ", (*batch_itr)->owner);
-
-          if (r_batch == *batch_itr)
-            {
-              LogPrint(eLogDebug, "Context: Removing batch ", r_batch->owner);
-              runningBatches.erase (batch_itr);
-              LogPrint(eLogDebug, "Context: Running batches: ",
-                       runningBatches.size ());
-              break;
-            }
-
-          ++batch_itr;
-        }
-      else
-        {
-          LogPrint(eLogError, "Context: Batch is null");
-          batch_itr = runningBatches.erase (batch_itr);
-        }
+      auto finished_itr = m_finished_requests.find (m_finished_order.front ().second);
+      if (finished_itr != m_finished_requests.end ()
+          && finished_itr->second == m_finished_order.front ().first)
+        m_finished_requests.erase (finished_itr);
+
+      m_finished_order.pop_front ();
     }
+
+  m_finished_requests[cid] = now;
+  m_finished_order.emplace_back (now, cid);
 }
 
 std::shared_ptr<BoteIdentityFull>
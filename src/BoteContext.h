@@ -10,7 +10,10 @@
 #define BOTE_CONTEXT_H__
 
 #include <chrono>
+#include <deque>
 #include <random>
+#include <unordered_map>
+#include <utility>
 
 #include "AddressBook.h"
 #include "BoteIdentity.h"
@@ -25,8 +28,10 @@ namespace pbote
 {
 
 #define DEFAULT_KEY_FILE_NAME "destination.key"
+/// Seconds for which late answers to finished requests are dropped quietly
+#define FINISHED_REQUEST_TTL 120
 
-using queue_type = std::shared_ptr<pbote::util::Queue<std::shared_ptr<PacketForQueue>>>;
+using queue_type = std::shared_ptr<pbote::util::RingQueue<std::shared_ptr<PacketForQueue>>>;
 
 class BoteContext
 {
@@ -38,10 +43,16 @@ class BoteContext
 
   void send(const PacketForQueue& packet);
   void send(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch);
+  void send(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch,
+            const cid_key& cid, const PacketForQueue& packet);
 
+  /// True if response belongs to our request, pending or finished
   bool receive(const std::shared_ptr<pbote::CommunicationPacket>& packet);
+  /// True if response with this CID is answer to our request
+  bool expects(const cid_key& cid);
 
   void removeBatch(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch);
+  void removeRequest(const cid_key& cid);
 
   std::string get_nickname() { return nickname; }
 
@@ -83,6 +94,8 @@ class BoteContext
   int readLocalIdentity(const std::string &path);
   void saveLocalIdentity(const std::string &path);
 
+  void finish_request_unlocked(const cid_key& cid);
+
   bool keys_loaded_;
 
   std::string listenHost;
@@ -108,7 +121,12 @@ class BoteContext
 
   mutable std::mutex m_batch_mutex_;
 
-  std::vector<std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>> runningBatches;
+  /// In-flight requests: CID of sent packet -> batch waiting for response
+  std::unordered_map<cid_key, std::weak_ptr<PacketBatch<pbote::CommunicationPacket>>> m_pending_requests;
+  /// Answered, abandoned or cancelled requests, retransmits can still
+  /// be answered for a while
+  std::unordered_map<cid_key, std::chrono::steady_clock::time_point> m_finished_requests;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, cid_key>> m_finished_order;
 
   std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t> rbe;
 };
@@ -11,6 +11,7 @@
 #include "DHTworker.h"
 #include "FileSystem.h"
 #include "Logging.h"
+#include "PacketHandler.h"
 #include "RelayWorker.h"
 
 namespace bote
@@ -256,9 +257,33 @@ BoteControl::daemon (const std::string &cmd_id, std::ostringstream &results)
   insert_param (results, "recived", (int)pbote::context.get_bytes_recv ());
   results << ", ";
   insert_param (results, "sent", (int)pbote::context.get_bytes_sent ());
+  results << "}, ";
+  results << "\"queues\": {";
+  queue (results, "recv", pbote::context.getRecvQueue ());
+  results << ", ";
+  queue (results, "send", pbote::context.getSendQueue ());
+  results << "}, ";
+  const auto &admission = pbote::packet::packet_handler.admission ();
+  results << "\"requests\": {";
+  insert_param (results, "rejected", (int)admission.rejected ());
+  results << ", ";
+  insert_param (results, "dropped", (int)admission.dropped ());
   results << "}}";
 }
 
+void
+BoteControl::queue (std::ostringstream &results, const std::string &name,
+                    const pbote::queue_type &queue)
+{
+  results << "\"" << name << "\": {";
+  insert_param (results, "depth", (int)queue->GetSize ());
+  results << ", ";
+  insert_param (results, "high", (int)queue->GetHighWatermark ());
+  results << ", ";
+  insert_param (results, "capacity", (int)queue->GetCapacity ());
+  results << "}";
+}
+
 void
 BoteControl::identity (const std::string &cmd_id, std::ostringstream &results)
 {
@@ -15,6 +15,7 @@
 #include <sys/un.h>
 #include <thread>
 
+#include "BoteContext.h"
 #include "i2psam.h"
 
 namespace bote
@@ -49,6 +50,8 @@ private:
                      double value) const;
   void insert_param (std::ostringstream &ss, const std::string &name,
                      const std::string &value) const;
+  void queue (std::ostringstream &results, const std::string &name,
+              const pbote::queue_type &queue);
 
   // handlers
   void all (const std::string &cmd_id, std::ostringstream &results);
@@ -6,12 +6,14 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <iostream>
 #include <memory>
 
 #include "BoteContext.h"
 #include "BoteControl.h"
 #include "BoteDaemon.h"
 #include "ConfigParser.h"
+#include "DHTStorage.h"
 #include "DHTworker.h"
 #include "EmailWorker.h"
 #include "FileSystem.h"
@@ -136,6 +138,18 @@ Daemon_Singleton::init(int argc, char *argv[],
   LogPrint(eLogDebug, "FS: Data directory: ", datadir);
   LogPrint(eLogDebug, "FS: Main config file: ", config);
 
+  bool importstorage = false;
+  pbote::config::GetOption("importstorage", importstorage);
+  if (importstorage)
+    {
+      pbote::log::Logger().Start();
+      pbote::kademlia::DHTStorage storage;
+      size_t imported = storage.import_files();
+      std::cout << "Imported DHT packets: " << imported << std::endl;
+      pbote::log::Logger().Stop();
+      return false;
+    }
+
   LogPrint(eLogInfo, "Daemon: Init context");
   pbote::context.init();
 
@@ -0,0 +1,96 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_BUFFER_POOL_H_
+#define PBOTED_SRC_BUFFER_POOL_H_
+
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace pbote
+{
+namespace util
+{
+
+/// 32 KiB datagram and terminating byte
+#define DATAGRAM_BUFFER_SIZE (32768 + 1)
+/// Max. number of spare buffers kept for reuse
+#define DATAGRAM_POOL_SIZE 256
+/// Smaller payloads get buffer of their own size instead of pooled one
+#define DATAGRAM_POOLED_MIN_SIZE 4096
+
+/**
+ * @brief Pool of reusable byte buffers
+ *
+ * Buffers keep their capacity between uses, so taking a buffer from
+ * a non-empty pool doesn't allocate memory. Buffer is given empty and
+ * should be filled with assign or insert, resize would zero it first.
+ */
+class BufferPool
+{
+ public:
+  BufferPool (size_t buffer_size, size_t max_buffers)
+      : m_buffer_size (buffer_size), m_max_buffers (max_buffers)
+  {
+  }
+
+  std::vector<uint8_t>
+  get ()
+  {
+    std::unique_lock<std::mutex> l (m_pool_mutex);
+    if (m_buffers.empty ())
+      {
+        l.unlock ();
+        std::vector<uint8_t> buffer;
+        buffer.reserve (m_buffer_size);
+        return buffer;
+      }
+
+    std::vector<uint8_t> buffer = std::move (m_buffers.back ());
+    m_buffers.pop_back ();
+    l.unlock ();
+
+    buffer.clear ();
+    return buffer;
+  }
+
+  /// Buffers of other sizes are just freed
+  void
+  put (std::vector<uint8_t> &&buffer)
+  {
+    if (buffer.capacity () < m_buffer_size)
+      return;
+
+    std::unique_lock<std::mutex> l (m_pool_mutex);
+    if (m_buffers.size () >= m_max_buffers)
+      return;
+
+    m_buffers.push_back (std::move (buffer));
+  }
+
+ private:
+  size_t m_buffer_size;
+  size_t m_max_buffers;
+  std::mutex m_pool_mutex;
+  std::vector<std::vector<uint8_t> > m_buffers;
+};
+
+/// Buffers of received datagrams, returned when packet is destroyed
+inline BufferPool &
+datagram_pool ()
+{
+  static BufferPool pool (DATAGRAM_BUFFER_SIZE, DATAGRAM_POOL_SIZE);
+  return pool;
+}
+
+} // namespace util
+} // namespace pbote
+
+#endif // PBOTED_SRC_BUFFER_POOL_H_
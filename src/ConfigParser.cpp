@@ -55,6 +55,13 @@ Init ()
     ("service",bool_switch()->default_value(false),"Service will use system folders like '/var/lib/pboted' (default: disabled)")
     ("storage", value<std::string>()->default_value("50 MiB"), "Limit for local storage usage (default: 50 MiB)")
     ("cleaninterval", value<uint16_t>()->default_value(7), "Duration in days of node/peer unavailability after which it will be deleted (default: 7)")
+    ("threads", value<uint16_t>()->default_value(0), "Number of threads for incoming packets (default: 0 - number of CPU cores)")
+    ("containers", bool_switch()->default_value(false), "Bundle small packets to one destination into one datagram, if peer supports it (default: disabled)")
+    ("sendrate", value<uint16_t>()->default_value(400), "Datagrams per second passed to I2P router (default: 400)")
+    ("sendpeerrate", value<uint16_t>()->default_value(20), "Requests per second to one destination, responses are not limited (default: 20)")
+    ("streams", bool_switch()->default_value(false), "Send large packets through SAM streams, if peer supports it (default: disabled)")
+    ("segments", bool_switch()->default_value(false), "Store DHT packets in append-only segment files instead of file per packet (default: disabled)")
+    ("importstorage", bool_switch()->default_value(false), "Import DHT packets stored as files to segment store and exit")
     ;
   options_description sam("SAM options");
   sam.add_options()
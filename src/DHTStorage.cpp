@@ -12,16 +12,248 @@
 #include <fstream>
 #include <iterator>
 #include <cstdio>
+#include <limits>
 
 #include "BoteContext.h"
 #include "ConfigParser.h"
 #include "DHTStorage.h"
 
+// libi2pd
+#include "I2PEndian.h"
+
 namespace pbote
 {
 namespace kademlia
 {
 
+/// Record kind in segment store by file extension of packet
+static uint8_t
+segment_kind (const char *ext)
+{
+  if (strcmp (ext, DELETED_FILE_EXTENSION) == 0)
+    return SEGMENT_RECORD_DELETION;
+  if (strcmp (ext, ENTRIES_LOG_FILE_EXTENSION) == 0)
+    return SEGMENT_RECORD_ENTRIES_LOG;
+  if (strcmp (ext, DELETED_LOG_FILE_EXTENSION) == 0)
+    return SEGMENT_RECORD_DELETION_LOG;
+  return SEGMENT_RECORD_PACKET;
+}
+
+static const char *
+kind_extension (uint8_t kind)
+{
+  switch (kind)
+    {
+      case SEGMENT_RECORD_DELETION:
+        return DELETED_FILE_EXTENSION;
+      case SEGMENT_RECORD_ENTRIES_LOG:
+        return ENTRIES_LOG_FILE_EXTENSION;
+      case SEGMENT_RECORD_DELETION_LOG:
+        return DELETED_LOG_FILE_EXTENSION;
+      default:
+        return DEFAULT_FILE_EXTENSION;
+    }
+}
+
+/// Extension of stored packet file, nullptr for other files
+static const char *
+packet_extension (const std::string &name)
+{
+  for (uint8_t kind = 0; kind < SEGMENT_RECORD_KINDS; kind++)
+    {
+      const char *ext = kind_extension (kind);
+      size_t len = strlen (ext);
+      if (name.size () > len
+          && name.compare (name.size () - len, len, ext) == 0)
+        return ext;
+    }
+
+  return nullptr;
+}
+
+/// Log of entries appended to packet, nullptr if it can't have one
+static const char *
+log_extension (pbote::type type, const char *ext)
+{
+  uint8_t kind = segment_kind (ext);
+  if (kind == SEGMENT_RECORD_DELETION
+      && (type == type::DataI || type == type::DataE))
+    return DELETED_LOG_FILE_EXTENSION;
+  if (kind == SEGMENT_RECORD_PACKET && type == type::DataI)
+    return ENTRIES_LOG_FILE_EXTENSION;
+  return nullptr;
+}
+
+static void
+add_log_record (std::vector<uint8_t> &records, uint8_t op,
+                const uint8_t *key, const uint8_t *value, int32_t time)
+{
+  records.push_back (op);
+  records.insert (records.end (), key, key + 32);
+  records.insert (records.end (), value, value + 32);
+  records.push_back (static_cast<uint8_t> (time >> 24));
+  records.push_back (static_cast<uint8_t> (time >> 16));
+  records.push_back (static_cast<uint8_t> (time >> 8));
+  records.push_back (static_cast<uint8_t> (time & 0xff));
+}
+
+void
+DHTStorage::init ()
+{
+  pbote::config::GetOption ("segments", m_segments);
+
+  if (m_segments && !open_segments ())
+    {
+      LogPrint (eLogError, "DHTStorage: init: Can't open segment store, ",
+                "packets are stored as files");
+      m_segments = false;
+    }
+
+  load_keys ();
+  update_storage_usage ();
+
+  if (!m_segments)
+    return;
+
+  std::vector<std::string> files;
+  for (const auto &dir : { "DHTindex", "DHTemail", "DHTdirectory" })
+    {
+      if (pbote::fs::ReadDir (pbote::fs::DataDirPath (dir), files) &&
+          !files.empty ())
+        {
+          LogPrint (eLogWarning, "DHTStorage: init: Found packets stored ",
+                    "as files, run with --importstorage to move them");
+          break;
+        }
+    }
+}
+
+bool
+DHTStorage::open_segments ()
+{
+  m_index_store = std::make_unique<SegmentStore> (
+    pbote::fs::DataDirPath ("DHTindex", "segments"));
+  m_email_store = std::make_unique<SegmentStore> (
+    pbote::fs::DataDirPath ("DHTemail", "segments"));
+  m_contact_store = std::make_unique<SegmentStore> (
+    pbote::fs::DataDirPath ("DHTdirectory", "segments"));
+
+  return m_index_store->open () && m_email_store->open () &&
+         m_contact_store->open ();
+}
+
+std::set<std::string>
+DHTStorage::getIndexList ()
+{
+  std::set<std::string> packets;
+  for (const auto &key : m_index_keys[SEGMENT_RECORD_PACKET].keys ())
+    packets.insert (key.ToBase64 ());
+  return packets;
+}
+
+std::set<std::string>
+DHTStorage::getEmailList ()
+{
+  std::set<std::string> packets;
+  for (const auto &key : m_email_keys[SEGMENT_RECORD_PACKET].keys ())
+    packets.insert (key.ToBase64 ());
+  return packets;
+}
+
+std::set<std::string>
+DHTStorage::getContactList ()
+{
+  std::set<std::string> packets;
+  for (const auto &key : m_contact_keys[SEGMENT_RECORD_PACKET].keys ())
+    packets.insert (key.ToBase64 ());
+  return packets;
+}
+
+void
+DHTStorage::load_keys ()
+{
+  const std::vector<pbote::type> types = { type::DataI, type::DataE,
+                                           type::DataC };
+  for (auto type : types)
+    {
+      for (uint8_t kind = 0; kind < SEGMENT_RECORD_KINDS; kind++)
+        key_index (type, kind_extension (kind))->clear ();
+    }
+
+  if (m_segments)
+    {
+      for (auto type : types)
+        {
+          for (uint8_t kind = 0; kind < SEGMENT_RECORD_KINDS; kind++)
+            {
+              auto keys = key_index (type, kind_extension (kind));
+              for (const auto &key : segment_store (type)->keys (kind))
+                keys->insert (key);
+            }
+        }
+    }
+  else
+    {
+      const std::vector<std::pair<pbote::type, std::string> > dirs = {
+        { type::DataI, "DHTindex" },
+        { type::DataE, "DHTemail" },
+        { type::DataC, "DHTdirectory" } };
+
+      for (const auto &dir : dirs)
+        {
+          std::vector<std::string> files;
+          if (!pbote::fs::ReadDir (pbote::fs::DataDirPath (dir.second), files))
+            continue;
+
+          for (const auto &path : files)
+            {
+              std::string name = base_name (path);
+              const char *ext = packet_extension (name);
+              if (!ext)
+                continue;
+
+              i2p::data::Tag<32> key;
+              if (key.FromBase64 (remove_extension (name)) == 32)
+                key_index (dir.first, ext)->insert (key);
+            }
+        }
+    }
+
+  /// Times saved on previous run are used as is, only packets written
+  /// after the save are read by expire to learn their times
+  auto saved = ExpirationIndex::load (
+    pbote::fs::DataDirPath (EXPIRATION_FILE_NAME));
+
+  m_expiration.clear ();
+  size_t unknown = 0;
+  for (auto type : { type::DataI, type::DataE })
+    {
+      for (uint8_t kind : { SEGMENT_RECORD_PACKET, SEGMENT_RECORD_DELETION })
+        {
+          for (const auto &key : key_index (type, kind_extension (kind))->keys ())
+            {
+              ExpirationIndex::item packet = { type, kind, key };
+              auto saved_itr = saved.find (packet);
+              if (saved_itr != saved.end ())
+                m_expiration.schedule (packet, saved_itr->second);
+              else
+                {
+                  m_expiration.schedule (packet, 0);
+                  unknown++;
+                }
+            }
+        }
+    }
+
+  LogPrint (eLogInfo, "DHTStorage: load_keys: Expiration times restored: ",
+            m_expiration.size () - unknown, ", unknown: ", unknown);
+
+  LogPrint (eLogInfo, "DHTStorage: load_keys: index: ",
+            m_index_keys[SEGMENT_RECORD_PACKET].size (), ", emails: ",
+            m_email_keys[SEGMENT_RECORD_PACKET].size (), ", contacts: ",
+            m_contact_keys[SEGMENT_RECORD_PACKET].size ());
+}
+
 void
 DHTStorage::update ()
 {
@@ -30,28 +262,37 @@ DHTStorage::update ()
   {
     update_counter = 0;
 
-    /// Only in case if we have less than 10 MiB of free space
-    if (limit_reached (10485760))
-      {
-        LogPrint (eLogDebug, "DHTStorage: update: Cleanup started");
-
-        remove_old_packets ();
-        remove_old_entries ();
-
-        LogPrint (eLogDebug, "DHTStorage: update: Cleanup finished");
-      }
+    /// Usage is counted on every write, walk is only to fix drift
+    update_storage_usage ();
+    save ();
 
     LogPrint (eLogDebug, "DHTStorage: update: ",
-              " index: ", local_index_packets.size (),
-              ", emails: ", local_email_packets.size (),
-              ", contacts: ", local_contact_packets.size ());
+              " index: ", m_index_keys[SEGMENT_RECORD_PACKET].size (),
+              ", emails: ", m_email_keys[SEGMENT_RECORD_PACKET].size (),
+              ", contacts: ", m_contact_keys[SEGMENT_RECORD_PACKET].size ());
   }
 
-  update_storage_usage ();
+  expire ();
+  compact_logs ();
+
+  if (m_segments)
+    {
+      m_index_store->compact ();
+      m_email_store->compact ();
+      m_contact_store->compact ();
+      used = segments_usage ();
+    }
 
   update_counter++;
 }
 
+void
+DHTStorage::save ()
+{
+  if (!m_expiration.save (pbote::fs::DataDirPath (EXPIRATION_FILE_NAME)))
+    LogPrint (eLogWarning, "DHTStorage: save: Can't save expiration times");
+}
+
 int
 DHTStorage::safe (const std::vector<uint8_t>& data)
 {
@@ -101,32 +342,29 @@ DHTStorage::safe_deleted (pbote::type type, const i2p::data::Tag<32>& key, const
 bool
 DHTStorage::Delete (pbote::type type, const i2p::data::Tag<32>& key, const char *ext)
 {
-  if (!exist (type, key))
+  if (type != type::DataI && type != type::DataE)
     return false;
 
-  std::string packet_path;
+  std::unique_lock<std::recursive_mutex> l (packet_mutex (type));
 
-  switch (type)
-    {
-      case (type::DataI):
-        packet_path = pbote::fs::DataDirPath("DHTindex", key.ToBase64() + ext);
-        break;
-      case (type::DataE):
-        packet_path = pbote::fs::DataDirPath("DHTemail", key.ToBase64() + ext);
-        break;
-      default:
-        return false;
-    }
+  if (!has_packet (type, key, ext))
+    return false;
 
-  if (pbote::fs::Remove(packet_path))
+  if (remove_packet (type, key, ext))
     {
-      LogPrint(eLogInfo, "DHTStorage: remove: File ", packet_path, " removed");
-      update_storage_usage();
+      /// Log without packet has nothing to apply to
+      const char *log_ext = log_extension (type, ext);
+      if (log_ext && has_packet (type, key, log_ext))
+        remove_packet (type, key, log_ext);
+
+      LogPrint(eLogInfo, "DHTStorage: remove: Packet ", key.ToBase64 (), ext,
+               " removed");
       return true;
     }
   else
     {
-      LogPrint(eLogError, "DHTStorage: remove: Can't remove file ", packet_path);
+      LogPrint(eLogError, "DHTStorage: remove: Can't remove packet ",
+               key.ToBase64 (), ext);
       return false;
     }
 }
@@ -167,43 +405,33 @@ DHTStorage::remove_index (const i2p::data::Tag<32>& index_dht_key,
       return false;
     }
 
-  int32_t removed = index_pkt.erase_entry (email_dht_key.data (),
-                                           del_auth.data ());
+  size_t entries = index_pkt.data.size ();
+  index_pkt.erase_entry (email_dht_key.data (), del_auth.data ());
 
-  if (removed == 0)
+  if (index_pkt.data.size () == entries)
     {
       LogPrint (eLogDebug, "DHTStorage: remove_index: Index without key: ",
                 index_dht_key.ToBase64 ());
       return false;
     }
 
-  LogPrint (eLogDebug, "DHTStorage: remove_index: Index entry removed, key: ",
-            index_dht_key.ToBase64 ());
-
-  Delete (type::DataI, index_dht_key);
+  /// Only removal is written, packet is rewritten by log compaction
+  std::vector<uint8_t> record;
+  add_log_record (record, LOG_RECORD_ERASE, email_dht_key.data (),
+                  del_auth.data (), context.ts_now ());
 
-  std::string pkt_path = pbote::fs::DataDirPath ("DHTindex",
-      index_dht_key.ToBase64 () + DEFAULT_FILE_EXTENSION);
-
-  LogPrint (eLogDebug, "DHTStorage: remove_index: Save packet to ", pkt_path);
-  auto index_bytes = index_pkt.toByte ();
-  std::ofstream file(pkt_path, std::ofstream::binary | std::ofstream::out);
-  if (file.is_open ())
+  if (append_log (type::DataI, index_dht_key, DEFAULT_FILE_EXTENSION, record)
+      != STORE_SUCCESS)
     {
-      file.write (reinterpret_cast<const char *> (index_bytes.data ()),
-                                                  index_bytes.size ());
-      file.close ();
-    }
-  else
-    {
-      LogPrint (eLogError, "DHTStorage: remove_index: Can't open file ",
-                pkt_path);
-      return STORE_FILE_OPEN_ERROR;
+      LogPrint (eLogError, "DHTStorage: remove_index: Can't save removal ",
+                index_dht_key.ToBase64 ());
+      return false;
     }
 
-  update_storage_usage ();
+  LogPrint (eLogDebug, "DHTStorage: remove_index: Index entry removed, key: ",
+            index_dht_key.ToBase64 ());
 
-  return STORE_SUCCESS;
+  return true;
 }
 
 size_t
@@ -269,84 +497,471 @@ std::vector<uint8_t>
 DHTStorage::getPacket (pbote::type type, i2p::data::Tag<32> key,
                        const char *ext)
 {
-  std::string dir_path;
-  std::set<std::string> local_list;
-
-  switch(type) {
-    case type::DataI:
-      dir_path = "DHTindex";
-      local_list = local_index_packets;
-      break;
-    case type::DataE:
-      dir_path = "DHTemail";
-      local_list = local_email_packets;
-      break;
-    case type::DataC:
-      dir_path = "DHTdirectory";
-      local_list = local_contact_packets;
-      break;
-    default:
+  if (type != type::DataI && type != type::DataE && type != type::DataC)
+    {
       LogPrint(eLogError, "DHTStorage: getPacket: Unsupported type: ", type);
       return {};
-  }
+    }
 
-  std::string filepath = pbote::fs::DataDirPath(dir_path, key.ToBase64 () + ext);
-  if (!pbote::fs::Exists(filepath))
+  if (!has_packet (type, key, ext))
     {
-      LogPrint(eLogDebug, "DHTStorage: getPacket: Have no file, type: ",
-               uint8_t(type), ", path: ", filepath);
+      LogPrint(eLogDebug, "DHTStorage: getPacket: Have no packet, type: ",
+               uint8_t(type), ", key: ", key.ToBase64 (), ext);
       return {};
     }
 
-  LogPrint(eLogDebug, "DHTStorage: getPacket: Found packet: ", filepath);
+  LogPrint(eLogDebug, "DHTStorage: getPacket: Found packet: ",
+           key.ToBase64 (), ext);
+
+  return read_merged (type, key, ext);
+}
+
+std::recursive_mutex &
+DHTStorage::packet_mutex (pbote::type type)
+{
+  switch (type)
+    {
+      case type::DataI:
+        return index_mutex;
+      case type::DataE:
+        return email_mutex;
+      default:
+        return contact_mutex;
+    }
+}
+
+bool
+DHTStorage::exist (pbote::type type, i2p::data::Tag<32> key)
+{
+  return has_packet (type, key, DEFAULT_FILE_EXTENSION);
+}
+
+KeyIndex *
+DHTStorage::key_index (pbote::type type, const char *ext)
+{
+  uint8_t kind = segment_kind (ext);
+
+  switch (type)
+    {
+      case type::DataI:
+        return &m_index_keys[kind];
+      case type::DataE:
+        return &m_email_keys[kind];
+      case type::DataC:
+        return &m_contact_keys[kind];
+      default:
+        return nullptr;
+    }
+}
+
+SegmentStore *
+DHTStorage::segment_store (pbote::type type)
+{
+  switch (type)
+    {
+      case type::DataI:
+        return m_index_store.get ();
+      case type::DataE:
+        return m_email_store.get ();
+      case type::DataC:
+        return m_contact_store.get ();
+      default:
+        return nullptr;
+    }
+}
+
+std::string
+DHTStorage::packet_path (pbote::type type, const i2p::data::Tag<32>& key,
+                         const char *ext)
+{
+  switch (type)
+    {
+      case type::DataI:
+        return pbote::fs::DataDirPath ("DHTindex", key.ToBase64 () + ext);
+      case type::DataE:
+        return pbote::fs::DataDirPath ("DHTemail", key.ToBase64 () + ext);
+      case type::DataC:
+        return pbote::fs::DataDirPath ("DHTdirectory", key.ToBase64 () + ext);
+      default:
+        return {};
+    }
+}
 
-  std::ifstream file(filepath, std::ios::binary);
+bool
+DHTStorage::has_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                        const char *ext)
+{
+  auto keys = key_index (type, ext);
+  return keys && keys->contains (key);
+}
+
+std::vector<uint8_t>
+DHTStorage::read_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                         const char *ext)
+{
+  if (m_segments)
+    {
+      auto store = segment_store (type);
+      if (!store)
+        return {};
+      return store->get (segment_kind (ext), key);
+    }
+
+  std::string path = packet_path (type, key, ext);
+  std::ifstream file (path, std::ios::binary);
 
-  if (!file.is_open())
+  if (!file.is_open ())
     {
-      LogPrint(eLogError, "DHTStorage: getPacket: Can't open file ", filepath);
+      LogPrint (eLogError, "DHTStorage: read_packet: Can't open file ", path);
       return {};
     }
 
-  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)),
-                             (std::istreambuf_iterator<char>()));
-  file.close();
+  std::vector<uint8_t> bytes ((std::istreambuf_iterator<char> (file)),
+                              (std::istreambuf_iterator<char> ()));
+  file.close ();
 
   return bytes;
 }
 
+int
+DHTStorage::write_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                          const char *ext, const std::vector<uint8_t>& data)
+{
+  if (m_segments)
+    {
+      auto store = segment_store (type);
+      if (!store || !store->put (segment_kind (ext), key, data))
+        return STORE_FILE_NOT_STORED;
+
+      key_index (type, ext)->insert (key);
+      used = segments_usage ();
+      schedule_expiration (type, key, ext, data);
+      return STORE_SUCCESS;
+    }
+
+  std::string path = packet_path (type, key, ext);
+
+  /// Packet is overwritten, so its old size isn't used anymore
+  if (has_packet (type, key, ext))
+    usage_sub (file_size (path));
+
+  std::ofstream file (path, std::ofstream::binary | std::ofstream::out);
+  if (!file.is_open ())
+    {
+      LogPrint (eLogError, "DHTStorage: write_packet: Can't open file ", path);
+      return STORE_FILE_OPEN_ERROR;
+    }
+
+  file.write (reinterpret_cast<const char *>(data.data ()), data.size ());
+  file.close ();
+
+  key_index (type, ext)->insert (key);
+  used += data.size ();
+  schedule_expiration (type, key, ext, data);
+
+  return STORE_SUCCESS;
+}
+
 bool
-DHTStorage::exist (pbote::type type, i2p::data::Tag<32> key)
+DHTStorage::remove_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                           const char *ext)
 {
-  std::string packet_path;
+  bool removed;
+  if (m_segments)
+    {
+      auto store = segment_store (type);
+      removed = store && store->remove (segment_kind (ext), key);
+      used = segments_usage ();
+    }
+  else
+    {
+      std::string path = packet_path (type, key, ext);
+      size_t bytes = file_size (path);
+      removed = pbote::fs::Remove (path);
+      if (removed)
+        usage_sub (bytes);
+    }
 
-  switch (type)
+  if (removed)
     {
-      case pbote::type::DataI:
-        packet_path = pbote::fs::DataDirPath ("DHTindex", key.ToBase64 () + DEFAULT_FILE_EXTENSION);
-        break;
-      case pbote::type::DataE:
-        packet_path = pbote::fs::DataDirPath ("DHTemail", key.ToBase64 () + DEFAULT_FILE_EXTENSION);
-        break;
-      case pbote::type::DataC:
-        packet_path = pbote::fs::DataDirPath ("DHTdirectory", key.ToBase64 () + DEFAULT_FILE_EXTENSION);
-        break;
-      default:
-        return false;
+      key_index (type, ext)->erase (key);
+      m_expiration.cancel ({ type, segment_kind (ext), key });
+    }
+
+  return removed;
+}
+
+std::vector<uint8_t>
+DHTStorage::read_merged (pbote::type type, const i2p::data::Tag<32>& key,
+                         const char *ext)
+{
+  auto data = read_packet (type, key, ext);
+
+  const char *log_ext = log_extension (type, ext);
+  if (data.empty () || !log_ext || !has_packet (type, key, log_ext))
+    return data;
+
+  auto log = read_packet (type, key, log_ext);
+
+  /// Incomplete record at the end is left from interrupted write
+  if (segment_kind (ext) == SEGMENT_RECORD_DELETION)
+    {
+      DeletionInfoPacket deletion_info;
+      if (!deletion_info.fromBuffer (data, true))
+        return data;
+
+      for (size_t offset = 0; offset + LOG_RECORD_LEN <= log.size ();
+           offset += LOG_RECORD_LEN)
+        {
+          if (log[offset] != LOG_RECORD_DELETION)
+            continue;
+
+          DeletionInfoPacket::item item;
+          memcpy (item.key, log.data () + offset + 1, 32);
+          memcpy (item.DA, log.data () + offset + 33, 32);
+          item.time = (int32_t)bufbe32toh (log.data () + offset + 65);
+
+          if (std::find (deletion_info.data.begin (), deletion_info.data.end (),
+                         item) == deletion_info.data.end ())
+            deletion_info.data.push_back (item);
+        }
+
+      deletion_info.count = deletion_info.data.size ();
+      return deletion_info.toByte ();
     }
 
-  return pbote::fs::Exists(packet_path);
+  IndexPacket index_packet;
+  if (!index_packet.fromBuffer (data, true))
+    return data;
+
+  for (size_t offset = 0; offset + LOG_RECORD_LEN <= log.size ();
+       offset += LOG_RECORD_LEN)
+    {
+      const uint8_t *record = log.data () + offset;
+      if (record[0] == LOG_RECORD_ENTRY)
+        {
+          IndexPacket::Entry entry;
+          memcpy (entry.key, record + 1, 32);
+          memcpy (entry.dv, record + 33, 32);
+          entry.time = (int32_t)bufbe32toh (record + 65);
+
+          if (std::find (index_packet.data.begin (), index_packet.data.end (),
+                         entry) == index_packet.data.end ())
+            index_packet.data.push_back (entry);
+        }
+      else if (record[0] == LOG_RECORD_ERASE)
+        index_packet.erase_entry (record + 1, record + 33);
+    }
+
+  index_packet.nump = index_packet.data.size ();
+  return index_packet.toByte ();
+}
+
+int
+DHTStorage::append_log (pbote::type type, const i2p::data::Tag<32>& key,
+                        const char *ext, const std::vector<uint8_t>& records)
+{
+  const char *log_ext = log_extension (type, ext);
+  if (!log_ext)
+    return STORE_FILE_NOT_STORED;
+
+  size_t log_size = 0;
+  if (m_segments)
+    {
+      auto store = segment_store (type);
+      uint8_t kind = segment_kind (log_ext);
+      if (!store || !store->append (kind, key, records))
+        return STORE_FILE_NOT_STORED;
+
+      key_index (type, log_ext)->insert (key);
+      used = segments_usage ();
+      log_size = store->length (kind, key);
+    }
+  else
+    {
+      std::string path = packet_path (type, key, log_ext);
+      std::ofstream file (path, std::ofstream::binary | std::ofstream::out
+                                | std::ofstream::app);
+      if (!file.is_open ())
+        {
+          LogPrint (eLogError, "DHTStorage: append_log: Can't open file ",
+                    path);
+          return STORE_FILE_OPEN_ERROR;
+        }
+
+      file.write (reinterpret_cast<const char *>(records.data ()),
+                  records.size ());
+      log_size = (size_t)file.tellp ();
+      file.close ();
+
+      key_index (type, log_ext)->insert (key);
+      used += records.size ();
+    }
+
+  if (log_size >= LOG_MAX_RECORDS * LOG_RECORD_LEN)
+    compact_log (type, key, ext);
+
+  return STORE_SUCCESS;
+}
+
+bool
+DHTStorage::compact_log (pbote::type type, const i2p::data::Tag<32>& key,
+                         const char *ext)
+{
+  const char *log_ext = log_extension (type, ext);
+  if (!log_ext || !has_packet (type, key, log_ext))
+    return false;
+
+  /// Packet is written first, so log applied again after crash changes
+  /// nothing
+  if (has_packet (type, key, ext))
+    {
+      auto merged = read_merged (type, key, ext);
+      if (merged.empty ()
+          || write_packet (type, key, ext, merged) != STORE_SUCCESS)
+        {
+          LogPrint (eLogError, "DHTStorage: compact_log: Can't save packet ",
+                    key.ToBase64 (), ext);
+          return false;
+        }
+    }
+
+  return remove_packet (type, key, log_ext);
+}
+
+void
+DHTStorage::compact_logs ()
+{
+  const std::vector<std::pair<pbote::type, const char *> > packets = {
+    { type::DataI, DEFAULT_FILE_EXTENSION },
+    { type::DataI, DELETED_FILE_EXTENSION },
+    { type::DataE, DELETED_FILE_EXTENSION } };
+
+  size_t compacted = 0;
+  for (const auto &packet : packets)
+    {
+      auto type = packet.first;
+      auto keys = key_index (type, log_extension (type, packet.second))->keys ();
+
+      for (const auto &key : keys)
+        {
+          if (compacted >= LOG_COMPACT_BATCH)
+            break;
+
+          std::unique_lock<std::recursive_mutex> l (
+            type == type::DataI ? index_mutex : email_mutex);
+
+          if (compact_log (type, key, packet.second))
+            compacted++;
+        }
+    }
+
+  if (compacted > 0)
+    LogPrint (eLogDebug, "DHTStorage: compact_logs: Compacted: ", compacted);
+}
+
+size_t
+DHTStorage::file_size (const std::string &path)
+{
+  boost::system::error_code ec;
+  auto bytes = boost::filesystem::file_size (path, ec);
+  return ec ? 0 : (size_t)bytes;
+}
+
+size_t
+DHTStorage::segments_usage ()
+{
+  /// Garbage is removed by compaction, so it's not counted against limit
+  return m_index_store->live () + m_email_store->live () +
+         m_contact_store->live ();
+}
+
+void
+DHTStorage::usage_sub (size_t bytes)
+{
+  size_t current = used.load ();
+  while (!used.compare_exchange_weak (current,
+                                      current > bytes ? current - bytes : 0))
+    {
+    }
+}
+
+size_t
+DHTStorage::import_files ()
+{
+  if (!m_segments && !open_segments ())
+    {
+      LogPrint (eLogError, "DHTStorage: import_files: Can't open segment store");
+      return 0;
+    }
+
+  const std::vector<std::pair<pbote::type, std::string> > dirs = {
+    { type::DataI, "DHTindex" },
+    { type::DataE, "DHTemail" },
+    { type::DataC, "DHTdirectory" } };
+
+  size_t imported = 0;
+  for (const auto &dir : dirs)
+    {
+      std::vector<std::string> files;
+      if (!pbote::fs::ReadDir (pbote::fs::DataDirPath (dir.second), files))
+        continue;
+
+      for (const auto &path : files)
+        {
+          std::string name = base_name (path);
+          const char *ext = packet_extension (name);
+          if (!ext)
+            continue;
+
+          i2p::data::Tag<32> key;
+          if (key.FromBase64 (remove_extension (name)) != 32)
+            {
+              LogPrint (eLogWarning, "DHTStorage: import_files: Skip ", path);
+              continue;
+            }
+
+          std::ifstream file (path, std::ios::binary);
+          if (!file.is_open ())
+            {
+              LogPrint (eLogError, "DHTStorage: import_files: Can't open file ",
+                        path);
+              continue;
+            }
+
+          std::vector<uint8_t> bytes ((std::istreambuf_iterator<char> (file)),
+                                      (std::istreambuf_iterator<char> ()));
+          file.close ();
+
+          if (!segment_store (dir.first)->put (segment_kind (ext), key, bytes))
+            {
+              LogPrint (eLogError, "DHTStorage: import_files: Can't store ",
+                        path);
+              continue;
+            }
+
+          pbote::fs::Remove (path);
+          imported++;
+        }
+    }
+
+  LogPrint (eLogInfo, "DHTStorage: import_files: Imported packets: ",
+            imported);
+
+  return imported;
 }
 
 int
 DHTStorage::safeIndex (i2p::data::Tag<32> key,
                        const std::vector<uint8_t>& data)
 {
-  std::string packetPath = pbote::fs::DataDirPath("DHTindex", key.ToBase64() + DEFAULT_FILE_EXTENSION);
+  std::string packetPath = key.ToBase64 () + DEFAULT_FILE_EXTENSION;
 
-  LogPrint(eLogDebug, "DHTStorage: safeIndex: Path: ", packetPath);
+  LogPrint(eLogDebug, "DHTStorage: safeIndex: Packet: ", packetPath);
+
+  std::unique_lock<std::recursive_mutex> l (index_mutex);
 
-  if (pbote::fs::Exists(packetPath))
+  if (has_packet (type::DataI, key, DEFAULT_FILE_EXTENSION))
     {
       int status = update_index(key, data);
       if (status == STORE_FILE_EXIST)
@@ -363,21 +978,14 @@ DHTStorage::safeIndex (i2p::data::Tag<32> key,
       return STORE_SUCCESS;
     }
 
-  LogPrint(eLogDebug, "DHTStorage: safeIndex: save packet to ", packetPath);
-  std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
-  if (file.is_open())
+  LogPrint(eLogDebug, "DHTStorage: safeIndex: save packet ", packetPath);
+  if (write_packet (type::DataI, key, DEFAULT_FILE_EXTENSION, data)
+      != STORE_SUCCESS)
     {
-      file.write(reinterpret_cast<const char *>(data.data()), data.size());
-      file.close();
-    }
-  else
-    {
-      LogPrint(eLogError, "DHTStorage: safeIndex: can't open file ", packetPath);
+      LogPrint(eLogError, "DHTStorage: safeIndex: can't save packet ", packetPath);
       return STORE_FILE_OPEN_ERROR;
     }
 
-  update_storage_usage();
-
   return STORE_SUCCESS;
 }
 
@@ -385,9 +993,11 @@ int
 DHTStorage::safe_deleted_index (i2p::data::Tag<32> key,
                                 const std::vector<uint8_t>& data)
 {
-  std::string packetPath = pbote::fs::DataDirPath("DHTindex", key.ToBase64() + DELETED_FILE_EXTENSION);
+  std::string packetPath = key.ToBase64 () + DELETED_FILE_EXTENSION;
 
-  if (pbote::fs::Exists(packetPath))
+  std::unique_lock<std::recursive_mutex> l (index_mutex);
+
+  if (has_packet (type::DataI, key, DELETED_FILE_EXTENSION))
     {
       int status = update_deletion_info(type::DataI, key, data);
       if (status == STORE_FILE_EXIST)
@@ -404,21 +1014,14 @@ DHTStorage::safe_deleted_index (i2p::data::Tag<32> key,
       return STORE_SUCCESS;
     }
 
-  LogPrint(eLogDebug, "DHTStorage: update_deleted_index: save packet to ", packetPath);
-  std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
-  if (file.is_open())
+  LogPrint(eLogDebug, "DHTStorage: update_deleted_index: save packet ", packetPath);
+  if (write_packet (type::DataI, key, DELETED_FILE_EXTENSION, data)
+      != STORE_SUCCESS)
     {
-      file.write(reinterpret_cast<const char *>(data.data()), data.size());
-      file.close();
-    }
-  else
-    {
-      LogPrint(eLogError, "DHTStorage: update_deleted_index: can't open file ", packetPath);
+      LogPrint(eLogError, "DHTStorage: update_deleted_index: can't save packet ", packetPath);
       return STORE_FILE_OPEN_ERROR;
     }
 
-  update_storage_usage();
-
   return STORE_SUCCESS;
 }
 
@@ -426,31 +1029,28 @@ int
 DHTStorage::safeEmail (i2p::data::Tag<32> key,
                        const std::vector<uint8_t>& data)
 {
-  std::string packetPath = pbote::fs::DataDirPath("DHTemail", key.ToBase64() + DEFAULT_FILE_EXTENSION);
+  std::string packetPath = key.ToBase64 () + DEFAULT_FILE_EXTENSION;
+
+  std::unique_lock<std::recursive_mutex> l (email_mutex);
 
-  if (pbote::fs::Exists(packetPath))
+  if (has_packet (type::DataE, key, DEFAULT_FILE_EXTENSION))
     {
       LogPrint(eLogDebug, "DHTStorage: safeEmail: packet already exist: ", packetPath);
       return STORE_FILE_EXIST;
     }
 
-  LogPrint(eLogDebug, "DHTStorage: safeEmail: save packet to ", packetPath);
-  std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
-  if (!file.is_open())
-    {
-      LogPrint(eLogError, "DHTStorage: safeEmail: can't open file ", packetPath);
-      return STORE_FILE_OPEN_ERROR;
-    }
+  LogPrint(eLogDebug, "DHTStorage: safeEmail: save packet ", packetPath);
 
   EmailEncryptedPacket email_packet;
   email_packet.fromBuffer(const_cast<uint8_t *>(data.data()), data.size(), true);
   email_packet.stored_time = context.ts_now ();
-  auto packet_bytes = email_packet.toByte();
 
-  file.write(reinterpret_cast<const char *>(packet_bytes.data()), (long)packet_bytes.size());
-  file.close();
-
-  update_storage_usage();
+  if (write_packet (type::DataE, key, DEFAULT_FILE_EXTENSION,
+                    email_packet.toByte ()) != STORE_SUCCESS)
+    {
+      LogPrint(eLogError, "DHTStorage: safeEmail: can't save packet ", packetPath);
+      return STORE_FILE_OPEN_ERROR;
+    }
 
   return STORE_SUCCESS;
 }
@@ -459,27 +1059,24 @@ int
 DHTStorage::safe_deleted_email (i2p::data::Tag<32> key,
                                 const std::vector<uint8_t>& data)
 {
-  std::string packetPath = pbote::fs::DataDirPath("DHTemail", key.ToBase64() + DELETED_FILE_EXTENSION);
+  std::string packetPath = key.ToBase64 () + DELETED_FILE_EXTENSION;
 
-  if (pbote::fs::Exists(packetPath))
+  std::unique_lock<std::recursive_mutex> l (email_mutex);
+
+  if (has_packet (type::DataE, key, DELETED_FILE_EXTENSION))
     {
       LogPrint(eLogDebug, "DHTStorage: safe_deleted_email: packet already exist: ", packetPath);
       return STORE_FILE_EXIST;
     }
 
-  LogPrint(eLogDebug, "DHTStorage: safe_deleted_email: save packet to ", packetPath);
-  std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
-  if (!file.is_open())
+  LogPrint(eLogDebug, "DHTStorage: safe_deleted_email: save packet ", packetPath);
+  if (write_packet (type::DataE, key, DELETED_FILE_EXTENSION, data)
+      != STORE_SUCCESS)
     {
-      LogPrint(eLogError, "DHTStorage: safe_deleted_email: can't open file ", packetPath);
+      LogPrint(eLogError, "DHTStorage: safe_deleted_email: can't save packet ", packetPath);
       return STORE_FILE_OPEN_ERROR;
     }
 
-  file.write(reinterpret_cast<const char *>(data.data()), (long)data.size());
-  file.close();
-
-  update_storage_usage();
-
   return STORE_SUCCESS;
 }
 
@@ -487,27 +1084,24 @@ int
 DHTStorage::safeContact (i2p::data::Tag<32> key,
                          const std::vector<uint8_t>& data)
 {
-  std::string packetPath = pbote::fs::DataDirPath("DHTdirectory", key.ToBase64() + DEFAULT_FILE_EXTENSION);
+  std::string packetPath = key.ToBase64 () + DEFAULT_FILE_EXTENSION;
 
-  if (pbote::fs::Exists(packetPath))
+  std::unique_lock<std::recursive_mutex> l (contact_mutex);
+
+  if (has_packet (type::DataC, key, DEFAULT_FILE_EXTENSION))
     {
       LogPrint(eLogDebug, "DHTStorage: safeContact: packet already exist: ", packetPath);
       return STORE_FILE_EXIST;
     }
 
-  LogPrint(eLogDebug, "DHTStorage: safeContact: save packet to ", packetPath);
-  std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
-  if (!file.is_open())
+  LogPrint(eLogDebug, "DHTStorage: safeContact: save packet ", packetPath);
+  if (write_packet (type::DataC, key, DEFAULT_FILE_EXTENSION, data)
+      != STORE_SUCCESS)
     {
-      LogPrint(eLogError, "DHTStorage: safeContact: can't open file ", packetPath);
+      LogPrint(eLogError, "DHTStorage: safeContact: can't save packet ", packetPath);
       return STORE_FILE_OPEN_ERROR;
     }
 
-  file.write(reinterpret_cast<const char *>(data.data()), data.size());
-  file.close();
-
-  update_storage_usage();
-
   return STORE_SUCCESS;
 }
 
@@ -516,61 +1110,46 @@ DHTStorage::update_index (i2p::data::Tag<32> key,
                           const std::vector<uint8_t>& data)
 {
   std::unique_lock<std::recursive_mutex> l (index_mutex);
-  IndexPacket new_pkt, old_pkt;
+  IndexPacket new_pkt;
   new_pkt.fromBuffer (data, true);
 
-  auto old_data = getIndex (key);
-  if (old_data.empty ())
-    {
-      LogPrint (eLogError, "DHTStorage: update_index: Can't open old index ",
-                key.ToBase64 ());
-      return STORE_FILE_OPEN_ERROR;
-    }
+  if (new_pkt.data.empty ())
+    return STORE_SUCCESS;
 
-  old_pkt.fromBuffer (old_data, true);
-  size_t duplicated = 0, added = 0;
+  /// Entries which are stored already keep their time and don't grow log
+  IndexPacket stored_pkt;
+  stored_pkt.fromBuffer (read_merged (type::DataI, key,
+                                      DEFAULT_FILE_EXTENSION), true);
 
-  for (auto entry : new_pkt.data)
+  std::vector<uint8_t> records;
+  records.reserve (new_pkt.data.size () * LOG_RECORD_LEN);
+  int32_t ts = context.ts_now ();
+  size_t added = 0;
+  for (auto &entry : new_pkt.data)
     {
-      if (std::find (old_pkt.data.begin (), old_pkt.data.end (),entry)
-            != old_pkt.data.end())
-        {
-          duplicated++;
-        }
-      else
-        {
-          entry.time = context.ts_now ();
-          old_pkt.data.push_back (entry);
-          added++;
-        }
-    }
+      if (std::find (stored_pkt.data.begin (), stored_pkt.data.end (), entry)
+          != stored_pkt.data.end ())
+        continue;
 
-  LogPrint (eLogDebug, "DHTStorage: update_index: New entries: ",
-            new_pkt.data.size (), ", duplicated: ", duplicated,
-            ", added: ", added);
+      add_log_record (records, LOG_RECORD_ENTRY, entry.key, entry.dv, ts);
+      stored_pkt.data.push_back (entry);
+      added++;
+    }
 
-  Delete (type::DataI, key);
+  LogPrint (eLogDebug, "DHTStorage: update_index: New entries: ", added,
+            " of ", new_pkt.data.size (), ", key: ", key.ToBase64 ());
 
-  std::string pkt_path = pbote::fs::DataDirPath ("DHTindex", key.ToBase64 () + DEFAULT_FILE_EXTENSION);
+  if (records.empty ())
+    return STORE_SUCCESS;
 
-  LogPrint (eLogDebug, "DHTStorage: update_index: Save packet to ", pkt_path);
-  std::ofstream file(pkt_path, std::ofstream::binary | std::ofstream::out);
-  if (file.is_open ())
+  int status = append_log (type::DataI, key, DEFAULT_FILE_EXTENSION, records);
+  if (status != STORE_SUCCESS)
     {
-      file.write (reinterpret_cast<const char *>(data.data ()), data.size ());
-      file.close ();
-    }
-  else
-    {
-      LogPrint (eLogError, "DHTStorage: update_index: Can't open file ",
-                pkt_path);
+      LogPrint (eLogError, "DHTStorage: update_index: Can't save entries ",
+                key.ToBase64 ());
       return STORE_FILE_OPEN_ERROR;
     }
 
-  LogPrint (eLogDebug, "DHTStorage: update_index: Packet saved to ", pkt_path);
-
-  update_storage_usage ();
-
   return STORE_SUCCESS;
 }
 
@@ -578,77 +1157,37 @@ int
 DHTStorage::update_deletion_info (pbote::type type, i2p::data::Tag<32> key,
                                   const std::vector<uint8_t>& data)
 {
-  if (type == type::DataI)
-    std::unique_lock<std::recursive_mutex> l (index_mutex);
-  if (type == type::DataE)
-    std::unique_lock<std::recursive_mutex> l (email_mutex);
-
-  DeletionInfoPacket new_pkt, old_pkt;
-  new_pkt.fromBuffer(data, true);
-
-  auto old_data = getPacket(type, key, DELETED_FILE_EXTENSION);
-  if (old_data.empty())
+  if (type != type::DataI && type != type::DataE)
     {
-      LogPrint(eLogError, "DHTStorage: update_deletion_info: can't open file ",
-               key.ToBase64());
+      LogPrint(eLogError, "DHTStorage: update_deletion_info: Unsupported type: ", type);
       return STORE_FILE_OPEN_ERROR;
     }
 
-  old_pkt.fromBuffer(old_data, true);
-  size_t duplicated = 0, added = 0;
+  std::unique_lock<std::recursive_mutex> l (type == type::DataI
+                                            ? index_mutex : email_mutex);
 
-  for (auto item : new_pkt.data)
-    {
-      if (std::find(old_pkt.data.begin(), old_pkt.data.end(), item) != old_pkt.data.end())
-        {
-          duplicated++;
-        }
-      else
-        {
-          item.time = context.ts_now ();
-          old_pkt.data.push_back(item);
-          added++;
-        }
-    }
-
-  LogPrint(eLogDebug, "DHTStorage: update_deletion_info: New entries: ",
-           new_pkt.data.size(), ", duplicated: ", duplicated,
-           ", added: ", added);
-
-  Delete(type, key, DELETED_FILE_EXTENSION);
+  DeletionInfoPacket new_pkt;
+  new_pkt.fromBuffer(data, true);
 
-  std::string dir_path;
+  if (new_pkt.data.empty ())
+    return STORE_SUCCESS;
 
-  switch(type) {
-    case type::DataI:
-      dir_path = "DHTindex";
-      break;
-    case type::DataE:
-      dir_path = "DHTemail";
-      break;
-    default:
-      LogPrint(eLogError, "DHTStorage: update_deletion_info: Unsupported type: ", type);
-      return STORE_FILE_OPEN_ERROR;
-  }
+  std::vector<uint8_t> records;
+  records.reserve (new_pkt.data.size () * LOG_RECORD_LEN);
+  int32_t ts = context.ts_now ();
+  for (const auto &item : new_pkt.data)
+    add_log_record (records, LOG_RECORD_DELETION, item.key, item.DA, ts);
 
-  std::string pkt_path = pbote::fs::DataDirPath(dir_path, key.ToBase64() + DELETED_FILE_EXTENSION);
+  LogPrint(eLogDebug, "DHTStorage: update_deletion_info: New entries: ",
+           new_pkt.data.size (), ", key: ", key.ToBase64 ());
 
-  LogPrint(eLogDebug, "DHTStorage: update_deletion_info: Save packet to ", pkt_path);
-  std::ofstream file(pkt_path, std::ofstream::binary | std::ofstream::out);
-  if (file.is_open())
-    {
-      file.write(reinterpret_cast<const char *>(data.data()), data.size());
-      file.close();
-    }
-  else
+  if (append_log (type, key, DELETED_FILE_EXTENSION, records) != STORE_SUCCESS)
     {
-      LogPrint(eLogError, "DHTStorage: update_deletion_info: Can't open file ",
-               pkt_path);
+      LogPrint(eLogError, "DHTStorage: update_deletion_info: Can't save entries ",
+               key.ToBase64 ());
       return STORE_FILE_OPEN_ERROR;
     }
 
-  update_storage_usage ();
-
   return STORE_SUCCESS;
 }
 
@@ -707,10 +1246,7 @@ int
 DHTStorage::clean_deletion_info (pbote::type type, i2p::data::Tag<32> key,
                                  int32_t ts_now)
 {
-  if (type == type::DataI)
-    std::unique_lock<std::recursive_mutex> l (index_mutex);
-  if (type == type::DataE)
-    std::unique_lock<std::recursive_mutex> l (email_mutex);
+  std::unique_lock<std::recursive_mutex> l (packet_mutex (type));
 
   DeletionInfoPacket deletion_info;
   auto deletion_data = getPacket(type, key, DELETED_FILE_EXTENSION);
@@ -762,81 +1298,6 @@ DHTStorage::clean_deletion_info (pbote::type type, i2p::data::Tag<32> key,
   return removed;
 }
 
-void
-DHTStorage::loadLocalIndexPackets ()
-{
-  std::set<std::string> temp_index_packets;
-  std::vector<std::string> packets_path;
-
-  if (!pbote::fs::ReadDir(pbote::fs::DataDirPath("DHTindex"), packets_path))
-    {
-      LogPrint(eLogWarning, "DHTStorage: loadLocalIndexPackets: have no index files");
-      return;
-    }
-
-  for (const auto &path : packets_path)
-    {
-      if (path.compare (path.size () - 4, 4, DELETED_FILE_EXTENSION) != 0)
-        continue;
-
-      auto filename = remove_extension(base_name(path));
-      temp_index_packets.insert(filename);
-    }
-
-  LogPrint(eLogDebug, "DHTStorage: loadLocalIndexPackets: index loaded: ",
-           temp_index_packets.size());
-  local_index_packets = temp_index_packets;
-}
-
-void
-DHTStorage::loadLocalEmailPackets ()
-{
-  std::set<std::string> temp_email_packets;
-  std::vector<std::string> packets_path;
-
-  if (!pbote::fs::ReadDir(pbote::fs::DataDirPath("DHTemail"), packets_path))
-    {
-      LogPrint(eLogWarning, "DHTStorage: loadLocalEmailPackets: have no mail files");
-      return;
-    }
-
-  for (const auto &path : packets_path)
-    {
-      if (path.compare (path.size () - 4, 4, DELETED_FILE_EXTENSION) != 0)
-        continue;
-
-      auto filename = remove_extension(base_name(path));
-      temp_email_packets.insert(filename);
-    }
-
-  LogPrint(eLogDebug, "DHTStorage: loadLocalEmailPackets: mails loaded: ",
-           temp_email_packets.size());
-  local_email_packets = temp_email_packets;
-}
-
-void
-DHTStorage::loadLocalContactPackets ()
-{
-  std::set<std::string> temp_contact_packets;
-  std::vector<std::string> packets_path;
-
-  if (!pbote::fs::ReadDir(pbote::fs::DataDirPath("DHTdirectory"), packets_path))
-    {
-      LogPrint(eLogWarning, "DHTStorage: loadLocalContactPackets: have no contact files");
-      return;
-    }
-
-  for (const auto &path : packets_path)
-    {
-      auto filename = remove_extension(base_name(path));
-      temp_contact_packets.insert(filename);
-    }
-
-  LogPrint(eLogDebug, "DHTStorage: loadLocalContactPackets: contacts loaded: ",
-           temp_contact_packets.size());
-  local_contact_packets = temp_contact_packets;
-}
-
 size_t
 DHTStorage::suffix_to_multiplier (const std::string &size_str)
 {
@@ -890,6 +1351,12 @@ DHTStorage::set_storage_limit ()
 void
 DHTStorage::update_storage_usage ()
 {
+  if (m_segments)
+    {
+      used = segments_usage ();
+      return;
+    }
+
   size_t new_used = 0;
 
   try
@@ -918,91 +1385,162 @@ DHTStorage::update_storage_usage ()
             new_used += boost::filesystem::file_size(*it);
         }
 
-      used = new_used;
+      size_t counted = used.exchange (new_used);
+      if (counted != new_used)
+        LogPrint(eLogDebug, "DHTStorage: update_storage_usage: Counted: ",
+                 counted, ", actual: ", new_used);
     }
   catch (const std::exception& e)
     {
       std::string e_what(e.what());
       LogPrint(eLogError, "DHTStorage: update_storage_usage: ", e_what);
     }
-
-  loadLocalIndexPackets ();
-  loadLocalEmailPackets ();
-  loadLocalContactPackets ();
 }
 
-void
-DHTStorage::remove_old_packets ()
+int32_t
+DHTStorage::expiration_time (pbote::type type, const char *ext,
+                             const std::vector<uint8_t>& data)
 {
-  size_t removed_count = 0;
-  const int32_t ts = context.ts_now ();
+  int32_t oldest = std::numeric_limits<int32_t>::max ();
 
-  if (boost::filesystem::is_empty(pbote::fs::DataDirPath("DHTemail").c_str()))
+  if (segment_kind (ext) == SEGMENT_RECORD_DELETION)
     {
-      LogPrint(eLogDebug, "DHTStorage: remove_old_packets: DHTemail directory is empty");
-      return;
+      DeletionInfoPacket deletion_info;
+      if (!deletion_info.fromBuffer (data, true))
+        return 0;
+
+      for (const auto &item : deletion_info.data)
+        oldest = std::min (oldest, item.time);
     }
+  else if (type == type::DataI)
+    {
+      IndexPacket index_packet;
+      if (!index_packet.fromBuffer (data, true))
+        return 0;
 
-  {
-    std::unique_lock<std::recursive_mutex> l (email_mutex);
-    for (const auto& pkt : local_email_packets)
-      {
-        i2p::data::Tag<32> key;
-        key.FromBase64(pkt);
-        auto data = getPacket(type::DataE, key);
-        EmailEncryptedPacket email_pkt;
-        email_pkt.fromBuffer (data.data (), data.size (), true);
-        int32_t store_ts = email_pkt.stored_time + store_duration;
-
-        LogPrint(eLogDebug, "DHTStorage: remove_old_packets: current_ts: ", ts);
-        LogPrint(eLogDebug, "DHTStorage: remove_old_packets: packet_ts:  ", store_ts);
-
-        if (store_ts > ts)
-          {
-            LogPrint(eLogDebug, "DHTStorage: remove_old_packets: packet ", pkt, " is too young to die.");
-            continue;
-          }
+      for (const auto &entry : index_packet.data)
+        oldest = std::min (oldest, entry.time);
+    }
+  else if (type == type::DataE)
+    {
+      EmailEncryptedPacket email_packet;
+      if (!email_packet.fromBuffer (const_cast<uint8_t *>(data.data ()),
+                                    data.size (), true))
+        return 0;
 
-        LogPrint(eLogDebug, "DHTStorage: remove_old_packets: remove: ", pkt);
+      oldest = email_packet.stored_time;
+    }
+  else
+    return 0;
 
-        if (Delete(type::DataE, key))
-          removed_count++;
-        else
-          LogPrint(eLogError, "DHTStorage: remove_old_packets: can't remove file: ", pkt);
-      }
-  }
+  /// Empty packet is removed right away
+  if (oldest > std::numeric_limits<int32_t>::max () - store_duration)
+    return 1;
 
-  LogPrint(eLogDebug, "DHTStorage: remove_old_packets: packets removed: ", removed_count);
+  return oldest + store_duration;
 }
 
 void
-DHTStorage::remove_old_entries ()
+DHTStorage::schedule_expiration (pbote::type type,
+                                 const i2p::data::Tag<32>& key,
+                                 const char *ext,
+                                 const std::vector<uint8_t>& data)
 {
-  size_t removed_entries = 0, removed_packets = 0;
+  uint8_t kind = segment_kind (ext);
+  if ((type != type::DataI && type != type::DataE)
+      || (kind != SEGMENT_RECORD_PACKET && kind != SEGMENT_RECORD_DELETION))
+    return;
+
+  int32_t time = expiration_time (type, ext, data);
+  if (time != 0)
+    m_expiration.schedule ({ type, segment_kind (ext), key }, time);
+}
 
-  if (boost::filesystem::is_empty(pbote::fs::DataDirPath("DHTindex").c_str()))
+void
+DHTStorage::expire ()
+{
+  const int32_t ts = context.ts_now ();
+  const auto started = std::chrono::steady_clock::now ();
+  size_t checked = 0, removed = 0, cleaned = 0;
+
+  /// Large backlog after start is taken in one pass, but other storage
+  /// users get locks between packets
+  while (std::chrono::steady_clock::now () - started
+         < std::chrono::milliseconds (EXPIRATION_PASS_TIME))
     {
-      LogPrint(eLogDebug, "DHTStorage: remove_old_entries: DHTindex directory is empty");
-      return;
+      auto packets = m_expiration.due (ts, EXPIRATION_BATCH_SIZE);
+      if (packets.empty ())
+        break;
+
+      expire_batch (packets, ts, removed, cleaned);
+      checked += packets.size ();
     }
 
-  const int32_t ts = context.ts_now ();
-  std::set<std::string> index_copy = local_index_packets;
-  for (const auto& pkt : index_copy)
+  if (checked == 0)
+    return;
+
+  LogPrint (eLogDebug, "DHTStorage: expire: Checked: ", checked,
+            ", removed: ", removed, ", cleaned: ", cleaned,
+            ", scheduled: ", m_expiration.size ());
+}
+
+void
+DHTStorage::expire_batch (const std::vector<ExpirationIndex::item> &packets,
+                          int32_t ts, size_t &removed, size_t &cleaned)
+{
+  for (const auto &packet : packets)
     {
-      i2p::data::Tag<32> key;
-      key.FromBase64(pkt);
-      int result = clean_index(key, ts);
+      auto type = (pbote::type)packet.type;
+      const char *ext = kind_extension (packet.kind);
 
-      if (result > 0)
-        removed_entries += result;
+      std::unique_lock<std::recursive_mutex> l (
+        type == type::DataI ? index_mutex : email_mutex);
 
-      if (result == -1)
-        removed_packets++;
-    }
+      if (!has_packet (type, packet.key, ext))
+        continue;
+
+      auto data = getPacket (type, packet.key, ext);
+      if (data.empty ())
+        {
+          /// Read failed, packet is checked again later
+          m_expiration.schedule (packet, ts + EXPIRATION_BUCKET_SIZE);
+          continue;
+        }
+
+      int32_t time = expiration_time (type, ext, data);
+      if (time == 0)
+        {
+          LogPrint (eLogWarning, "DHTStorage: expire: Can't parse packet ",
+                    packet.key.ToBase64 (), ext, ", removed");
+          if (Delete (type, packet.key, ext))
+            removed++;
+          continue;
+        }
+
+      /// Packet was stored before start or has only newer entries now
+      if (time > ts)
+        {
+          m_expiration.schedule (packet, time);
+          continue;
+        }
 
-  LogPrint(eLogDebug, "DHTStorage: remove_old_entries: Records removed: ", removed_entries);
-  LogPrint(eLogDebug, "DHTStorage: remove_old_entries: Packets removed: ", removed_packets);
+      if (packet.kind == SEGMENT_RECORD_DELETION)
+        {
+          clean_deletion_info (type, packet.key, ts);
+          cleaned++;
+        }
+      else if (type == type::DataI)
+        {
+          clean_index (packet.key, ts);
+          cleaned++;
+        }
+      else if (Delete (type, packet.key))
+        {
+          LogPrint (eLogDebug, "DHTStorage: expire: Removed: ",
+                    packet.key.ToBase64 ());
+          removed++;
+        }
+    }
 }
 
 } // kademlia
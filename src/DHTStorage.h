@@ -9,10 +9,16 @@
 #ifndef PBOTE_SRC_DHTSTORAGE_H_
 #define PBOTE_SRC_DHTSTORAGE_H_
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
 
+#include "ExpirationIndex.h"
 #include "FileSystem.h"
+#include "KeyIndex.h"
 #include "Packet.h"
+#include "SegmentStore.h"
 
 namespace pbote
 {
@@ -24,6 +30,22 @@ namespace kademlia
 #define STORE_FILE_OPEN_ERROR (-2)
 #define STORE_FILE_NOT_STORED (-3)
 
+/// Entries appended to index packet and deletion info
+#define ENTRIES_LOG_FILE_EXTENSION ".log"
+#define DELETED_LOG_FILE_EXTENSION ".dlg"
+/// op[1] + key[32] + dv or DA[32] + time[4] = 69
+#define LOG_RECORD_LEN 69
+#define LOG_RECORD_ENTRY 'A'
+#define LOG_RECORD_ERASE 'R'
+#define LOG_RECORD_DELETION 'T'
+/// Longer log is merged into packet right away
+#define LOG_MAX_RECORDS 64
+/// Max. number of logs merged into packets by one update
+#define LOG_COMPACT_BATCH 64
+
+/// Saved times of stored packets expiration
+#define EXPIRATION_FILE_NAME "expiration.idx"
+
 /// How long the packet is kept in DHT storage
 const int32_t store_duration = 8640000; /// 100 * 24 * 3600 (100 days)
 
@@ -46,7 +68,10 @@ class DHTStorage
   DHTStorage () = default;
   //~DHTStorage ();
 
+  void init ();
   void update ();
+  /// Save state which is costly to rebuild on start
+  void save ();
   int safe (const std::vector<uint8_t>& data);
   int safe_deleted (pbote::type type, const i2p::data::Tag<32>& key,
                     const std::vector<uint8_t>& data);
@@ -65,15 +90,45 @@ class DHTStorage
   std::vector<uint8_t> getPacket (pbote::type type, i2p::data::Tag<32> key,
                                   const char *ext = DEFAULT_FILE_EXTENSION);
 
-  std::set<std::string> getIndexList () {return local_index_packets;}
-  std::set<std::string> getEmailList () {return local_email_packets;}
-  std::set<std::string> getContactList () {return local_contact_packets;}
+  std::set<std::string> getIndexList ();
+  std::set<std::string> getEmailList ();
+  std::set<std::string> getContactList ();
 
   void set_storage_limit ();
   bool limit_reached (size_t data_size);
   double limit_used () {return (double)((100 / (double)limit) * (double)used);}
 
+  /// Move packets stored as files to segment store, return number of moved
+  size_t import_files ();
+
  private:
+  bool open_segments ();
+  void load_keys ();
+  KeyIndex *key_index (pbote::type type, const char *ext);
+  SegmentStore *segment_store (pbote::type type);
+  std::string packet_path (pbote::type type, const i2p::data::Tag<32>& key,
+                           const char *ext);
+
+  bool has_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                   const char *ext);
+  std::vector<uint8_t> read_packet (pbote::type type,
+                                    const i2p::data::Tag<32>& key,
+                                    const char *ext);
+  int write_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                    const char *ext, const std::vector<uint8_t>& data);
+  bool remove_packet (pbote::type type, const i2p::data::Tag<32>& key,
+                      const char *ext);
+
+  /// Packet with its log of entries applied
+  std::vector<uint8_t> read_merged (pbote::type type,
+                                    const i2p::data::Tag<32>& key,
+                                    const char *ext);
+  int append_log (pbote::type type, const i2p::data::Tag<32>& key,
+                  const char *ext, const std::vector<uint8_t>& records);
+  bool compact_log (pbote::type type, const i2p::data::Tag<32>& key,
+                    const char *ext);
+  void compact_logs ();
+
   bool exist (pbote::type type, i2p::data::Tag<32> key);
 
   int safeIndex (i2p::data::Tag<32> key, const std::vector<uint8_t>& data);
@@ -93,24 +148,48 @@ class DHTStorage
   int clean_deletion_info (pbote::type type, i2p::data::Tag<32> key,
                            int32_t current_timestamp);
 
-  void loadLocalIndexPackets ();
-  void loadLocalEmailPackets ();
-  void loadLocalContactPackets ();
-
   size_t suffix_to_multiplier (const std::string &size_str);
 
+  /// Walk storage to correct counted usage
   void update_storage_usage ();
-
-  void remove_old_packets ();
-  void remove_old_entries ();
-
-  size_t limit, used;
-  int update_counter;
-
+  size_t file_size (const std::string &path);
+  size_t segments_usage ();
+  void usage_sub (size_t bytes);
+
+  /// Time when packet or its oldest entry expires, 0 if unknown
+  int32_t expiration_time (pbote::type type, const char *ext,
+                           const std::vector<uint8_t>& data);
+  void schedule_expiration (pbote::type type, const i2p::data::Tag<32>& key,
+                            const char *ext, const std::vector<uint8_t>& data);
+  /// Remove expired packets and entries, in batches until time is over
+  void expire ();
+  void expire_batch (const std::vector<ExpirationIndex::item> &packets,
+                     int32_t ts, size_t &removed, size_t &cleaned);
+
+  /// Packets of type are changed only under this lock
+  std::recursive_mutex &packet_mutex (pbote::type type);
+
+  size_t limit;
+  /// Bytes in storage, changed on every write and removal
+  std::atomic<size_t> used { 0 };
+  int update_counter = 0;
+
+  /// Storage is changed from handler threads and DHT worker
   std::recursive_mutex index_mutex, email_mutex, contact_mutex;
-  std::set<std::string> local_index_packets;
-  std::set<std::string> local_email_packets;
-  std::set<std::string> local_contact_packets;
+
+  /// Keys of all stored packets and deletion info by record kind,
+  /// so lookups of missing packets don't touch disk
+  std::array<KeyIndex, SEGMENT_RECORD_KINDS> m_index_keys;
+  std::array<KeyIndex, SEGMENT_RECORD_KINDS> m_email_keys;
+  std::array<KeyIndex, SEGMENT_RECORD_KINDS> m_contact_keys;
+  /// Index and email packets by expiration time
+  ExpirationIndex m_expiration;
+
+  /// Packets are kept in segment stores instead of files
+  bool m_segments = false;
+  std::unique_ptr<SegmentStore> m_index_store;
+  std::unique_ptr<SegmentStore> m_email_store;
+  std::unique_ptr<SegmentStore> m_contact_store;
 };
 
 } // kademlia
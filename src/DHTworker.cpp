@@ -42,20 +42,28 @@ DHTworker::~DHTworker ()
 void
 DHTworker::start ()
 {
-  m_local_node
-      = std::make_shared<Node> (context.getLocalDestination ()->ToBase64 ());
+  m_local_node = std::make_shared<Node> (
+      destinations ().intern (*context.getLocalDestination ()));
   if (isStarted ())
     return;
 
+  m_routing_table.set_local (m_local_node->hash ());
+
   if (!loadNodes ())
     LogPrint (eLogWarning, "DHT: Have no nodes for start");
 
   LogPrint (eLogDebug, "DHT: Load local packets");
+  m_dht_storage.init ();
   m_dht_storage.set_storage_limit ();
   m_dht_storage.update ();
 
   m_started = true;
   m_worker_thread = new std::thread (std::bind (&DHTworker::run, this));
+
+  m_find_service.restart ();
+  m_find_work.reset (new boost::asio::io_service::work (m_find_service));
+  for (size_t i = 0; i < FIND_MANY_PARALLELISM; i++)
+    m_find_threads.emplace_back ([this] { run_find_service (); });
 }
 
 void
@@ -66,16 +74,24 @@ DHTworker::stop ()
 
   m_started = false;
 
+  /// Queued keys are finished quickly, find returns nothing when stopped
+  m_find_work.reset ();
+  for (auto &thread : m_find_threads)
+    thread.join ();
+  m_find_threads.clear ();
+
+  m_dht_storage.save ();
+
   LogPrint (eLogInfo, "DHT: Stopped");
 }
 
 bool
 DHTworker::addNode (const std::string &dest)
 {
-  i2p::data::IdentityEx identity;
-  if (identity.FromBase64 (dest))
+  auto destination = destinations ().intern (dest);
+  if (destination)
     {
-      return addNode (identity);
+      return addNode (destination);
     }
   else
     {
@@ -87,9 +103,9 @@ DHTworker::addNode (const std::string &dest)
 bool
 DHTworker::addNode (const uint8_t *buf, size_t len)
 {
-  i2p::data::IdentityEx identity;
-  if (identity.FromBuffer (buf, len))
-    return addNode (identity);
+  auto destination = destinations ().intern (buf, len);
+  if (destination)
+    return addNode (destination);
   else
     {
       LogPrint (eLogWarning, "DHT: addNode: Can't create node from buffer");
@@ -100,40 +116,32 @@ DHTworker::addNode (const uint8_t *buf, size_t len)
 bool
 DHTworker::addNode (const i2p::data::IdentityEx &identity)
 {
-  if (findNode (identity.GetIdentHash ()))
+  return addNode (destinations ().intern (identity));
+}
+
+bool
+DHTworker::addNode (const sp_destination &destination)
+{
+  if (findNode (destination->hash))
     return false;
 
   auto local_destination = context.getLocalDestination ();
-  if (*local_destination == identity)
+  if (local_destination->GetIdentHash () == destination->hash)
     {
       LogPrint (eLogDebug, "DHT: addNode: Local destination, skipped");
       return false;
     }
 
-  auto node = std::make_shared<Node> ();
-  node->FromBase64 (identity.ToBase64 ());
-
-  auto result = findNode (node->GetIdentHash ());
-  if (result)
-    return false;
-
+  auto node = std::make_shared<Node> (destination);
   node->lastseen (context.ts_now ());
 
-  std::unique_lock<std::mutex> l (m_nodes_mutex);
-  return m_nodes
-      .insert (std::pair<HashKey, sp_node> (node->GetIdentHash (), node))
-      .second;
+  return m_routing_table.add (node);
 }
 
 sp_node
 DHTworker::findNode (const HashKey &ident) const
 {
-  std::unique_lock<std::mutex> l (m_nodes_mutex);
-  auto it = m_nodes.find (ident);
-  if (it != m_nodes.end ())
-    return it->second;
-  else
-    return nullptr;
+  return m_routing_table.find (ident);
 }
 
 sp_node
@@ -145,102 +153,22 @@ DHTworker::getClosestNode (const HashKey &key, bool to_us)
 std::vector<sp_node>
 DHTworker::getClosestNodes (HashKey key, size_t num, bool to_us)
 {
-  struct sortable_node
-  {
-    sp_node node;
-    i2p::data::XORMetric metric;
-    bool
-    operator< (const sortable_node &other) const
-    {
-      return metric < other.metric;
-    };
-  };
-
   LogPrint (eLogDebug, "DHT: getClosestNodes: key: ", key.ToBase64 (),
             ", num: ", num, ", to_us: ", to_us ? "true" : "false");
 
-  std::set<sortable_node> sorted_nodes;
-
-  i2p::data::XORMetric our_metric;
-  if (to_us)
-    our_metric = key ^ m_local_node->GetIdentHash ();
-
-  {
-    std::unique_lock<std::mutex> l (m_nodes_mutex);
-    for (const auto &it : m_nodes)
-      {
-        if (it.second->locked ())
-          continue;
-        /// Distance - XOR result for two hashes.
-        /// Will be than larger, the more they differ.
-        /// We are interested in the minimum difference (distance).
-        i2p::data::XORMetric metric = key ^ it.second->GetIdentHash ();
-
-        if (to_us && our_metric < metric)
-          continue;
-
-        if (sorted_nodes.size () < num)
-          sorted_nodes.insert ({ it.second, metric });
-        else if (metric < sorted_nodes.rbegin ()->metric)
-          {
-            /// If current metric less than biggest in sorted node
-            ///   add current and remove one from the end
-            sorted_nodes.insert ({ it.second, metric });
-            sorted_nodes.erase (std::prev (sorted_nodes.end ()));
-          }
-      }
-  }
-
-  std::vector<sp_node> result;
-  size_t i = 0;
-  for (const auto &it : sorted_nodes)
-    {
-      if (i >= num)
-        break;
-
-      /// For debug only
-      /*
-      std::stringstream ss;
-      for (int k = 0;k<3;k++)
-        ss << std::setw(3) << std::setfill('0') << unsigned(it.metric.metric[k]);
-
-      LogPrint (eLogDebug, "DHT: getClosestNodes: node: ",
-                it.node->GetIdentHash ().ToBase32 (), ", metric: ", ss.str());
-      */
-
-      result.push_back (it.node);
-      i++;
-    }
-
-  return result;
+  return m_routing_table.closest (key, num, to_us);
 }
 
 std::vector<sp_node>
 DHTworker::getAllNodes ()
 {
-  std::vector<sp_node> result;
-
-  for (const auto &node : m_nodes)
-    result.push_back (node.second);
-
-  return result;
+  return m_routing_table.all ();
 }
 
 std::vector<sp_node>
 DHTworker::getUnlockedNodes ()
 {
-  std::vector<sp_node> res;
-  std::unique_lock<std::mutex> l (m_nodes_mutex);
-
-  for (const auto &it : m_nodes)
-    {
-      if (!it.second->locked ())
-        {
-          res.push_back (it.second);
-        }
-    }
-
-  return res;
+  return m_routing_table.unlocked ();
 }
 
 std::vector<sp_comm_pkt>
@@ -279,72 +207,73 @@ DHTworker::find (HashKey key, uint8_t type, bool exhaustive)
   LogPrint (eLogDebug, "DHT: find: Start for type: ", type,
             ", key: ", key.ToBase64 ());
 
-  auto batch = std::make_shared<batch_comm_packet> ();
-  batch->owner = "DHT::find";
+  /// Email and contact packets are immutable, so local copy is enough,
+  /// but other nodes may have more entries of index packet
+  auto local_response = findLocal (key, type);
+  if (local_response && (!exhaustive || type != type::DataI))
+    {
+      LogPrint (eLogDebug, "DHT: find: Found locally, key: ", key.ToBase64 ());
+      return { local_response };
+    }
 
   std::vector<sp_node> closestNodes = closestNodesLookupTask (key);
+  auto result = retrieve (key, type, exhaustive, closestNodes);
+
+  if (local_response)
+    result.insert (result.begin (), local_response);
 
-  // ToDo: add find locally
+  LogPrint (eLogDebug, "DHT: find: Got ", result.size (), " valid responses");
 
+  return result;
+}
+
+std::vector<sp_comm_pkt>
+DHTworker::retrieve (const HashKey &key, uint8_t type, bool exhaustive,
+                     std::vector<sp_node> closestNodes)
+{
   LogPrint (eLogDebug,
-            "DHT: find: Closest nodes count: ", closestNodes.size ());
+            "DHT: retrieve: Closest nodes count: ", closestNodes.size ());
 
   if (closestNodes.size () < MIN_CLOSEST_NODES)
     {
-      LogPrint (eLogInfo, "DHT: find: Not enough nodes, try usual nodes");
+      LogPrint (eLogInfo, "DHT: retrieve: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        closestNodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        closestNodes.push_back (node);
 
-      LogPrint (eLogDebug, "DHT: find: Usual nodes: ", closestNodes.size ());
+      LogPrint (eLogDebug,
+                "DHT: retrieve: Usual nodes: ", closestNodes.size ());
     }
 
   if (closestNodes.empty ())
     {
-      LogPrint (eLogError, "DHT: find: Not enough nodes");
+      LogPrint (eLogError, "DHT: retrieve: Not enough nodes");
       return {};
     }
 
-  for (const auto &node : closestNodes)
+  auto batch = std::make_shared<batch_comm_packet> ();
+  batch->owner = "DHT::retrieve";
+  requests_map requests;
+
+  request_builder builder = [type, &key] (const cid_key &cid)
     {
       auto packet = retrieveRequestPacket (type, key);
+      memcpy (packet.cid, cid.data (), 32);
+      return packet.toByte ();
+    };
 
-      PacketForQueue q_packet (node->ToBase64 (), packet.toByte ().data (),
-                               packet.toByte ().size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
-
-  LogPrint (eLogDebug, "DHT: find: Batch size: ", batch->packetCount ());
-  context.send (batch);
-
-  if (exhaustive)
-    batch->waitLast (RESPONSE_TIMEOUT);
-  else
-    batch->waitFist (RESPONSE_TIMEOUT);
-
-  int counter = 0;
+  /// Not exhaustive search is done with first found packet
+  size_t quorum = exhaustive ? BATCH_QUORUM_ALL : 1;
+  batch->setFilter (statusFilter ({ StatusCode::OK }));
 
-  while (batch->responseCount () < 1 && counter < 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: find: No responses, resend: #", counter);
-      context.removeBatch (batch);
-      context.send (batch);
+  sendRequests (key, batch, requests, closestNodes, builder, quorum);
 
-      if (exhaustive)
-        batch->waitLast (RESPONSE_TIMEOUT);
-      else
-        batch->waitFist (RESPONSE_TIMEOUT);
-      counter++;
-    }
-
-  LogPrint (eLogDebug, "DHT: find: Got ", batch->responseCount (),
+  LogPrint (eLogDebug, "DHT: retrieve: Got ", batch->responseCount (),
             " responses for ", key.ToBase64 (), ", type: ", type);
 
   context.removeBatch (batch);
   auto responses = batch->getResponses ();
+  update_liveness (responses, requests, exhaustive);
 
   std::vector<sp_comm_pkt> result;
   result.reserve (responses.size ());
@@ -355,22 +284,92 @@ DHTworker::find (HashKey key, uint8_t type, bool exhaustive)
       bool parsed = response_packet.from_comm_packet (*response, true);
       if (!parsed)
         {
-          LogPrint (eLogWarning, "DHT: find: Can't parse response");
+          LogPrint (eLogWarning, "DHT: retrieve: Can't parse response");
           continue;
         }
 
-      LogPrint (eLogDebug, "DHT: find: Response status ",
+      LogPrint (eLogDebug, "DHT: retrieve: Response status ",
                 statusToString (response_packet.status));
 
       if (response_packet.status == StatusCode::OK)
         result.push_back (response);
     }
 
-  LogPrint (eLogDebug, "DHT: find: Got ", result.size (), " valid responses");
+  LogPrint (eLogDebug,
+            "DHT: retrieve: Got ", result.size (), " valid responses");
 
   return result;
 }
 
+std::vector<sp_comm_pkt>
+DHTworker::findMany (const std::vector<HashKey> &keys, uint8_t type,
+                     const find_callback &on_found)
+{
+  if (!m_started)
+  {
+    LogPrint (eLogDebug, "DHT: Stopping");
+    return {};
+  }
+
+  std::vector<HashKey> unique_keys (keys);
+  std::sort (unique_keys.begin (), unique_keys.end ());
+  unique_keys.erase (std::unique (unique_keys.begin (), unique_keys.end ()),
+                     unique_keys.end ());
+
+  LogPrint (eLogDebug, "DHT: findMany: Start for type: ", type, ", keys: ",
+            unique_keys.size ());
+
+  /// State is shared with tasks, so caller can leave if service stops
+  struct find_many_state
+  {
+    std::mutex mutex;
+    std::condition_variable done;
+    std::vector<sp_comm_pkt> result;
+    size_t remaining;
+  };
+
+  auto state = std::make_shared<find_many_state> ();
+  state->remaining = unique_keys.size ();
+
+  /// Every key is looked up by itself, repeated lookups are
+  /// served from cache or coalesced with running ones
+  for (const auto &key : unique_keys)
+    {
+      m_find_service.post ([this, state, key, type, on_found] ()
+        {
+          std::vector<sp_comm_pkt> key_result;
+          try
+            {
+              key_result = find (key, type, false);
+            }
+          catch (std::exception &ex)
+            {
+              LogPrint (eLogError, "DHT: findMany: Exception: ", ex.what ());
+            }
+
+          if (on_found)
+            on_found (key, key_result);
+
+          std::unique_lock<std::mutex> l (state->mutex);
+          state->result.insert (state->result.end (), key_result.begin (),
+                                key_result.end ());
+
+          if (--state->remaining == 0)
+            state->done.notify_all ();
+        });
+    }
+
+  /// Keys posted after stop are never taken by service
+  std::unique_lock<std::mutex> l (state->mutex);
+  while (state->remaining > 0 && !m_find_service.stopped ())
+    state->done.wait_for (l, std::chrono::seconds (1));
+
+  LogPrint (eLogDebug, "DHT: findMany: Got ", state->result.size (),
+            " valid responses for ", unique_keys.size (), " keys");
+
+  return state->result;
+}
+
 std::vector<std::string>
 DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
 {
@@ -385,6 +384,7 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "DHT::store";
+  requests_map requests;
 
   std::vector<sp_node> closestNodes = closestNodesLookupTask (hash);
 
@@ -394,8 +394,8 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
     {
       LogPrint (eLogWarning, "DHT: store: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        closestNodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        closestNodes.push_back (node);
 
       LogPrint (eLogDebug, "DHT: store: Usual nodes: ", closestNodes.size ());
     }
@@ -406,42 +406,26 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
       return {};
     }
 
-  for (const auto &node : closestNodes)
+  request_builder builder = [&packet] (const cid_key &cid)
     {
-      context.random_cid (packet.cid, 32);
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
+      memcpy (packet.cid, cid.data (), 32);
+      return packet.toByte ();
+    };
 
-  LogPrint (eLogDebug, "DHT: store: Batch size: ", batch->packetCount ());
+  /// Packet is stored as soon as K nodes acknowledged it
+  batch->setFilter (statusFilter ({ StatusCode::OK,
+                                    StatusCode::DUPLICATED_DATA }));
 
-  context.send (batch);
-  batch->waitLast (RESPONSE_TIMEOUT);
-
-  int counter = 0;
-
-  // ToDo:
-  //while (batch->responseCount () < KADEMLIA_CONSTANT_K && counter <= 5)
-  while (batch->responseCount () < 2 && counter <= 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: store: No responses, resend: #", counter);
-      context.removeBatch (batch);
-      context.send (batch);
-
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
-    }
+  bool stored = sendRequests (hash, batch, requests, closestNodes, builder,
+                              KADEMLIA_CONSTANT_K);
 
   LogPrint (eLogDebug, "DHT: store: Got ", batch->responseCount (),
             " responses for ", hash.ToBase64 (), ", type: ", type);
 
   context.removeBatch (batch);
   auto responses = batch->getResponses ();
+  /// With quorum reached the rest of nodes had no chance to answer
+  update_liveness (responses, requests, !stored);
 
   std::vector<std::string> result;
   result.reserve (responses.size ());
@@ -462,7 +446,7 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
       if (response_packet.status == StatusCode::OK ||
           response_packet.status == StatusCode::DUPLICATED_DATA)
         {
-          result.push_back (response->from);
+          result.push_back (response->from->base64);
         }
     }
 
@@ -503,6 +487,7 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "DHT::deleteEmail";
+  requests_map requests;
 
   std::vector<sp_node> closestNodes = closestNodesLookupTask (hash);
 
@@ -514,8 +499,8 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
       LogPrint (eLogInfo,
                 "DHT: deleteEmail: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        closestNodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        closestNodes.push_back (node);
 
       LogPrint (eLogDebug,
                 "DHT: deleteEmail: Usual nodes: ", closestNodes.size ());
@@ -527,35 +512,14 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
         }
     }
 
-  for (const auto &node : closestNodes)
+  request_builder builder = [&packet] (const cid_key &cid)
     {
-      context.random_cid (packet.cid, 32);
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
-
-  LogPrint (eLogDebug,
-            "DHT: deleteEmail: Batch size: ", batch->packetCount ());
-  context.send (batch);
+      memcpy (packet.cid, cid.data (), 32);
+      return packet.toByte ();
+    };
 
-  batch->waitLast (RESPONSE_TIMEOUT);
-
-  int counter = 0;
-  while (batch->responseCount () < 1 && counter <= 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: deleteEmail: No responses, resend: #",
-                counter);
-      context.removeBatch (batch);
-      context.send (batch);
-      // ToDo: remove answered nodes from batch
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
-    }
+  sendRequests (hash, batch, requests, closestNodes, builder,
+                BATCH_QUORUM_ALL);
 
   LogPrint (eLogDebug, "DHT: deleteEmail: Got ", batch->responseCount (),
             " responses for ", hash.ToBase64 (), ", type: ", type);
@@ -564,6 +528,7 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
   std::vector<std::string> res;
 
   auto responses = batch->getResponses ();
+  update_liveness (responses, requests, true);
 
   res.reserve (responses.size ());
   for (const auto &response : responses)
@@ -574,9 +539,9 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
       if (res_packet.status == StatusCode::OK ||
           res_packet.status == StatusCode::NO_DATA_FOUND)
         {
-          res.push_back (response->from);
+          res.push_back (response->from->base64);
           LogPrint (eLogDebug, "DHT: deleteEmail: Valid response from: ",
-                    response->from.substr (0, 15), "...");
+                    response->from->base64.substr (0, 15), "...");
         }
     }
 
@@ -606,6 +571,7 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "DHT::deleteIndexEntry";
+  requests_map requests;
 
   std::vector<sp_node> closestNodes = closestNodesLookupTask (index_dht_key);
 
@@ -617,8 +583,8 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
       LogPrint (eLogInfo,
                 "DHT: deleteIndexEntry: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        closestNodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        closestNodes.push_back (node);
 
       LogPrint (eLogDebug,
                 "DHT: deleteIndexEntry: Usual nodes: ", closestNodes.size ());
@@ -630,10 +596,10 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
       return {};
     }
 
-  for (const auto &node : closestNodes)
+  request_builder builder = [&] (const cid_key &cid)
     {
       pbote::IndexDeleteRequestPacket packet;
-      context.random_cid (packet.cid, 32);
+      memcpy (packet.cid, cid.data (), 32);
 
       memcpy (packet.dht_key, index_dht_key.data (), 32);
       packet.count = 1;
@@ -643,33 +609,11 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
 
       packet.data.push_back (item);
 
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
-
-  LogPrint (eLogDebug,
-            "DHT: deleteIndexEntry: Batch size: ", batch->packetCount ());
-
-  context.send (batch);
+      return packet.toByte ();
+    };
 
-  batch->waitLast (RESPONSE_TIMEOUT);
-
-  int counter = 0;
-  while (batch->responseCount () < 1 && counter < 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: deleteIndexEntry: No responses, resend: #",
-                counter);
-      context.removeBatch (batch);
-      context.send (batch);
-      // ToDo: remove answered nodes from batch
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
-    }
+  sendRequests (index_dht_key, batch, requests, closestNodes, builder,
+                BATCH_QUORUM_ALL);
 
   LogPrint (eLogDebug, "DHT: deleteIndexEntry: Got ", batch->responseCount (),
             " responses for key ", email_dht_key.ToBase64 ());
@@ -679,6 +623,7 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
   std::vector<std::string> res;
 
   auto responses = batch->getResponses ();
+  update_liveness (responses, requests, true);
 
   for (const auto &response : responses)
     {
@@ -688,9 +633,9 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
       if (res_packet.status == StatusCode::OK ||
           res_packet.status == StatusCode::NO_DATA_FOUND)
         {
-          res.push_back (response->from);
+          res.push_back (response->from->base64);
           LogPrint (eLogDebug, "DHT: deleteIndexEntry: Valid response from: ",
-                    response->from.substr (0, 15), "...");
+                    response->from->base64.substr (0, 15), "...");
         }
     }
 
@@ -720,6 +665,7 @@ DHTworker::deleteIndexEntries (HashKey index_dht_key,
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "DHT::deleteIndexEntries";
+  requests_map requests;
 
   std::vector<sp_node> closestNodes = closestNodesLookupTask (index_dht_key);
 
@@ -731,8 +677,8 @@ DHTworker::deleteIndexEntries (HashKey index_dht_key,
       LogPrint (eLogInfo,
                 "DHT: deleteIndexEntries: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        closestNodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        closestNodes.push_back (node);
 
       LogPrint (eLogDebug,
                 "DHT: deleteIndexEntries: Usual nodes: ", closestNodes.size ());
@@ -744,37 +690,14 @@ DHTworker::deleteIndexEntries (HashKey index_dht_key,
       return {};
     }
 
-  for (const auto &node : closestNodes)
+  request_builder builder = [&packet] (const cid_key &cid)
     {
-      context.random_cid (packet.cid, 32);
-
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
-
-  LogPrint (eLogDebug,
-            "DHT: deleteIndexEntries: Batch size: ", batch->packetCount ());
-
-  context.send (batch);
-
-  batch->waitLast (RESPONSE_TIMEOUT);
+      memcpy (packet.cid, cid.data (), 32);
+      return packet.toByte ();
+    };
 
-  int counter = 0;
-  while (batch->responseCount () < 1 && counter < 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: deleteIndexEntries: No responses, resend: #",
-                counter);
-      context.removeBatch (batch);
-      context.send (batch);
-      // ToDo: remove answered nodes from batch
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
-    }
+  sendRequests (index_dht_key, batch, requests, closestNodes, builder,
+                BATCH_QUORUM_ALL);
 
   LogPrint (eLogDebug, "DHT: deleteIndexEntries: Got ", batch->responseCount (),
             " responses for key ", index_dht_key.ToBase64 ());
@@ -784,6 +707,7 @@ DHTworker::deleteIndexEntries (HashKey index_dht_key,
   std::vector<std::string> res;
 
   auto responses = batch->getResponses ();
+  update_liveness (responses, requests, true);
 
   for (const auto &response : responses)
     {
@@ -793,9 +717,9 @@ DHTworker::deleteIndexEntries (HashKey index_dht_key,
       if (res_packet.status == StatusCode::OK ||
           res_packet.status == StatusCode::NO_DATA_FOUND)
         {
-          res.push_back (response->from);
+          res.push_back (response->from->base64);
           LogPrint (eLogDebug, "DHT: deleteIndexEntries: Valid response from: ",
-                    response->from.substr (0, 15), "...");
+                    response->from->base64.substr (0, 15), "...");
         }
     }
 
@@ -848,6 +772,7 @@ DHTworker::deletion_query (const HashKey &key)
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "DHT::deletion_query";
+  requests_map requests;
 
   std::vector<sp_node> close_nodes = closestNodesLookupTask (key);
 
@@ -859,8 +784,8 @@ DHTworker::deletion_query (const HashKey &key)
       LogPrint (eLogInfo,
                 "DHT: deletion_query: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes)
-        close_nodes.push_back (node.second);
+      for (const auto &node : getAllNodes ())
+        close_nodes.push_back (node);
 
       LogPrint (eLogDebug,
                 "DHT: deletion_query: Usual nodes: ", close_nodes.size ());
@@ -872,39 +797,18 @@ DHTworker::deletion_query (const HashKey &key)
       return {};
     }
 
-  for (const auto &node : close_nodes)
+  request_builder builder = [&key] (const cid_key &cid)
     {
       pbote::DeletionQueryPacket packet;
-      context.random_cid (packet.cid, 32);
+      memcpy (packet.cid, cid.data (), 32);
       memcpy (packet.dht_key, key.data (), 32);
+      return packet.toByte ();
+    };
 
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
-
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
-    }
-
-  LogPrint (eLogDebug,
-            "DHT: deletion_query: Batch size: ", batch->packetCount ());
-
-  context.send (batch);
+  /// One deletion info is enough to know packet was deleted
+  batch->setFilter (statusFilter ({ StatusCode::OK }));
 
-  batch->waitLast (RESPONSE_TIMEOUT);
-
-  int counter = 0;
-  while (batch->responseCount () < 1 && counter < 5 && m_started)
-    {
-      LogPrint (eLogWarning, "DHT: deletion_query: No responses, resend: #",
-                counter);
-      context.removeBatch (batch);
-      context.send (batch);
-      // ToDo: remove answered nodes from batch
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
-    }
+  bool found = sendRequests (key, batch, requests, close_nodes, builder, 1);
 
   LogPrint (eLogDebug, "DHT: deletion_query: Got ", batch->responseCount (),
             " responses for key ", key.ToBase64 ());
@@ -912,6 +816,7 @@ DHTworker::deletion_query (const HashKey &key)
   context.removeBatch (batch);
 
   auto responses = batch->getResponses ();
+  update_liveness (responses, requests, !found);
 
   for (const auto &response : responses)
     {
@@ -921,7 +826,7 @@ DHTworker::deletion_query (const HashKey &key)
       if (res_packet.status == StatusCode::OK)
         {
           LogPrint (eLogDebug, "DHT: deletion_query: OK response from: ",
-                    response->from.substr (0, 15), "...");
+                    response->from->base64.substr (0, 15), "...");
 
           pbote::DeletionInfoPacket del_info_packet;
           del_info_packet.fromBuffer (res_packet.data, true);
@@ -944,80 +849,200 @@ DHTworker::closestNodesLookupTask (HashKey key)
     return {};
   }
 
-  auto batch = std::make_shared<batch_comm_packet> ();
-  batch->owner = "DHT::closestNodesLookup";
+  std::unique_lock<std::mutex> l (m_lookup_mutex);
 
-  std::map<HashKey, sp_node> closestNodes;
-  std::vector<sp_comm_pkt> responses;
-  std::map<std::vector<uint8_t>, sp_node> active_requests;
+  auto cached = m_lookup_cache.find (key);
+  if (cached != m_lookup_cache.end ())
+    {
+      auto &nodes = cached->second.nodes;
+      bool expired
+          = context.ts_now () - cached->second.created > CLOSEST_NODES_CACHE_TTL;
+      bool unresponsive = std::any_of (nodes.begin (), nodes.end (),
+                                       [] (const sp_node &node)
+                                       { return node->locked (); });
 
-  /// Set start time
-  int32_t task_start_time = context.ts_now ();
-  auto unlocked_nodes = getUnlockedNodes ();
+      if (!expired && !unresponsive)
+        {
+          LogPrint (eLogDebug, "DHT: closestNodesLookupTask: Cached result",
+                    " for key ", key.ToBase64 ());
+          return nodes;
+        }
 
-  if (unlocked_nodes.empty ())
-    unlocked_nodes = getAllNodes ();
+      m_lookup_cache.erase (cached);
+    }
 
-  for (auto node : unlocked_nodes)
+  /// Join lookup for the same key which is already running
+  auto running = m_running_lookups.find (key);
+  if (running != m_running_lookups.end ())
     {
-      /// Create find closest peers packet
-      auto packet = findClosePeersPacket (key);
-      auto bytes = packet.toByte ();
-
-      PacketForQueue q_packet (node->ToBase64 (), bytes.data (), bytes.size ());
-      std::vector<uint8_t> vcid (std::begin (packet.cid), std::end (packet.cid));
+      auto result = running->second;
+      l.unlock ();
 
-      /// Copy packet to pending task for check timeout later
-      active_requests.insert (
-          std::pair<std::vector<uint8_t>, sp_node> (vcid, node));
-      batch->addPacket (vcid, q_packet);
+      LogPrint (eLogDebug, "DHT: closestNodesLookupTask: Wait for running",
+                " lookup for key ", key.ToBase64 ());
+      return result.get ();
     }
 
+  std::promise<std::vector<sp_node> > promise;
+  m_running_lookups[key] = promise.get_future ().share ();
+  l.unlock ();
+
+  bool converged = false;
+  auto nodes = closestNodesLookup (key, converged);
+
+  l.lock ();
+  m_running_lookups.erase (key);
+
+  if (converged && !nodes.empty ())
+    m_lookup_cache[key] = { nodes, context.ts_now () };
+  l.unlock ();
+
+  promise.set_value (nodes);
+
+  return nodes;
+}
+
+std::vector<sp_node>
+DHTworker::closestNodesLookup (const HashKey &key, bool &converged)
+{
+  struct lookup_node
+  {
+    sp_node node;
+    bool queried = false;
+    bool answered = false;
+  };
+
+  /// Shortlist of candidates sorted by distance to the key
+  std::map<i2p::data::XORMetric, lookup_node> shortlist;
+
+  auto add_candidate = [&] (const sp_node &node)
+  {
+    if (node->hash () == m_local_node->hash ())
+      return;
+
+    lookup_node candidate;
+    candidate.node = node;
+    shortlist.insert (std::pair<i2p::data::XORMetric, lookup_node> (
+        key ^ node->hash (), candidate));
+  };
+
+  auto start_nodes = getClosestNodes (key, CLOSEST_NODES_LOOKUP_SIZE, false);
+
+  if (start_nodes.empty ())
+    start_nodes = getAllNodes ();
+
+  for (const auto &node : start_nodes)
+    add_candidate (node);
+
+  /// Set start time
+  int32_t task_start_time = context.ts_now ();
   int32_t exec_duration = 0;
-  size_t counter = 1;
+  size_t counter = 1, answered = 0;
 
-  /// While we have unanswered requests and timeout not reached
-  while (!active_requests.empty ()  && m_started
-         && exec_duration < CLOSEST_NODES_LOOKUP_TIMEOUT)
+  while (m_started && exec_duration < CLOSEST_NODES_LOOKUP_TIMEOUT)
     {
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Request #", counter);
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Batch size: ",
-                batch->packetCount ());
+      /// Take up to alpha closest not queried nodes, but only from
+      /// the k closest candidates, so the lookup converges to the key
+      std::vector<sp_node> round_nodes;
+      size_t position = 0;
+
+      for (auto &candidate : shortlist)
+        {
+          if (position >= CLOSEST_NODES_LOOKUP_SIZE
+              || round_nodes.size () >= KADEMLIA_CONSTANT_ALPHA)
+            break;
+
+          position++;
+
+          if (candidate.second.queried)
+            continue;
+
+          candidate.second.queried = true;
+          round_nodes.push_back (candidate.second.node);
+        }
+
+      /// All k closest candidates have been queried
+      if (round_nodes.empty ())
+        break;
 
+      auto batch = std::make_shared<batch_comm_packet> ();
+      batch->owner = "DHT::closestNodesLookup";
+
+      requests_map active_requests;
+      /// Round lasts until the slowest node had a chance to answer twice
+      long round_timeout = 0;
+
+      for (const auto &node : round_nodes)
+        {
+          round_timeout = std::max (round_timeout, node->rto (2));
+
+          /// Create find closest peers packet
+          auto packet = findClosePeersPacket (key);
+          auto bytes = packet.toByte ();
+
+          PacketForQueue q_packet (node->destination, bytes.data (),
+                                   bytes.size ());
+
+          active_requests[HashKey (packet.cid)] = node;
+          batch->addPacket (cid_key (packet.cid), q_packet);
+        }
+
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: Request #", counter,
+                ", batch size: ", batch->packetCount ());
       counter++;
 
+      round_timeout = std::min (round_timeout, RESPONSE_TIMEOUT * 1000L);
+
+      auto sent_at = std::chrono::steady_clock::now ();
       context.send (batch);
-      batch->waitLast (RESPONSE_TIMEOUT);
+      batch->waitQuorum (BATCH_QUORUM_ALL,
+                         std::chrono::milliseconds (round_timeout));
       context.removeBatch (batch);
-      responses = batch->getResponses ();
 
-      if (responses.empty ())
+      auto responses = batch->getResponses ();
+
+      for (const auto &request : active_requests)
         {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
-                                 "responses, resend batch");
-          exec_duration = context.ts_now () - task_start_time;
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ", exec_duration);
-          continue;
+          std::chrono::steady_clock::time_point answered_at;
+          if (!batch->answeredAt (request.first, answered_at))
+            continue;
+
+          auto rtt = std::chrono::duration_cast<std::chrono::milliseconds> (
+              answered_at - sent_at);
+          request.second->rtt_sample (rtt.count ());
         }
 
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Got ",responses.size (),
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: Got ", responses.size (),
                 " responses for key ", key.ToBase64 ());
 
+      update_liveness (responses, active_requests, true);
+
       for (const auto &response : responses)
         {
-          std::vector<uint8_t> vcid (std::begin (response->cid),
-                                     std::end (response->cid));
           /// Check if we sent requests with this CID
-          if (active_requests.find (vcid) != active_requests.end ())
-            {
-              /// Remove node from active requests and from batch
-              active_requests.erase (vcid);
-              batch->removePacket (vcid);
-            }
+          auto request_itr = active_requests.find (HashKey (response->cid));
+          if (request_itr == active_requests.end ())
+            continue;
+
+          auto node = request_itr->second;
+          active_requests.erase (request_itr);
+
+          auto candidate = shortlist.find (key ^ node->hash ());
+          if (candidate != shortlist.end ())
+            candidate->second.answered = true;
+          answered++;
+
+          for (const auto &peer : receivePeerList (response))
+            add_candidate (peer);
         }
 
+      /// Nodes without response can't be the closest ones
+      for (const auto &request : active_requests)
+        shortlist.erase (key ^ request.second->hash ());
+
       exec_duration = context.ts_now () - task_start_time;
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ", exec_duration);
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ",
+                exec_duration);
     }
 
   if (!m_started)
@@ -1031,204 +1056,175 @@ DHTworker::closestNodesLookupTask (HashKey key)
       LogPrint (eLogDebug, "DHT: closestNodesLookup: Timed out");
     }
 
-  context.removeBatch (batch);
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: Rounds: ", counter - 1,
+            ", answered: ", answered, ", candidates: ", shortlist.size ());
 
-  /// If we have at least one response
-  for (const auto &response : responses)
-    {
-      if (response->type != type::CommN)
-        {
-          // ToDo: Looks like in case if we got request to ourself,
-          // for now we just skip it
-          LogPrint (eLogWarning,
-                    "DHT: closestNodesLookup: Got non-response packet, type: ",
-                    response->type, ", ver: ", unsigned (response->ver));
-          continue;
-        }
-
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Response from: ",
-                response->from.substr (0, 15), "...");
+  {
+    uint16_t days;
+    pbote::config::GetOption ("cleaninterval", days);
+    LogPrint (eLogDebug, "DHT: closestNodesLookup: Silent interval days: ",
+              days);
+    LogPrint (eLogDebug, "DHT: closestNodesLookup: Silent interval sec.: ",
+              (ONE_DAY_SECONDS * days));
 
-      pbote::ResponsePacket packet;
-      bool parsed = packet.from_comm_packet (*response, true);
-      if (!parsed)
-        {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Payload is too "
-                                 "short, parsing skipped");
-          continue;
-        }
+    size_t nodes_removed
+        = m_routing_table.remove_silent (ONE_DAY_SECONDS * days);
 
-      if (packet.status != StatusCode::OK)
-        {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Response status: ",
-                    statusToString (packet.status), ", parsing skipped");
-          continue;
-        }
+    LogPrint (eLogInfo, "DHT: closestNodesLookup: Silent node(s) removed: ", nodes_removed);
+  }
 
-      if (packet.length == 0)
-        {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Packet without "
-                                 "payload, parsing skipped");
-          continue;
-        }
+  /// If we have no responses - try with known nodes
+  if (answered == 0)
+    {
+      LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
+                "responses, will use known nodes");
+      return getClosestNodes (key, CLOSEST_NODES_LOOKUP_SIZE, false);
+    }
 
-      size_t nodes_added = 0, nodes_dup = 0;
-      std::vector<sp_node> node_list;
+  converged = true;
 
-      if (unsigned (packet.data[1]) == 4)
-        {
-          pbote::PeerListPacketV4 peer_list;
-          bool parsed = peer_list.fromBuffer (packet.data.data (),
-                                              packet.length, true);
-
-          if (!parsed)
-          {
-            LogPrint (eLogWarning,
-                      "DHT: closestNodesLookup: V4 packet parsing failed");
-            continue;
-          }
+  std::vector<sp_node> result;
+  for (const auto &candidate : shortlist)
+    {
+      if (result.size () >= CLOSEST_NODES_LOOKUP_SIZE)
+        break;
 
-          for (auto node : peer_list.data)
-            {
-              if (addNode (node))
-                nodes_added++;
-              else
-                nodes_dup++;
-              node_list.emplace_back (std::make_shared<Node> (node.ToBase64 ()));
-            }
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: V4 nodes: ",
-                    node_list.size (), ", added: ", nodes_added,
-                    ", dup: ", nodes_dup);
-        }
+      if (candidate.second.answered)
+        result.push_back (candidate.second.node);
+    }
 
-      if (unsigned (packet.data[1]) == 5)
-        {
-          pbote::PeerListPacketV5 peer_list;
-          bool parsed = peer_list.fromBuffer (packet.data.data (),
-                                              packet.length, true);
-
-          if (!parsed)
-          {
-            LogPrint (eLogWarning,
-                      "DHT: closestNodesLookup: V5 packet parsing failed");
-            continue;
-          }
+  return result;
+}
 
-          for (auto node : peer_list.data)
-            {
-              if (addNode (node))
-                nodes_added++;
-              else
-                nodes_dup++;
-              node_list.emplace_back (std::make_shared<Node> (node.ToBase64 ()));
-            }
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: V5 nodes: ",
-                    node_list.size (), ", added: ", nodes_added,
-                    ", dup: ", nodes_dup);
-        }
+void
+DHTworker::cleanLookupCache ()
+{
+  std::unique_lock<std::mutex> l (m_lookup_mutex);
+  int32_t ts_now = context.ts_now ();
+  size_t removed = 0;
 
-      if (node_list.empty ())
+  for (auto itr = m_lookup_cache.begin (); itr != m_lookup_cache.end ();)
+    {
+      if (ts_now - itr->second.created > CLOSEST_NODES_CACHE_TTL)
         {
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list empty");
-          continue;
+          itr = m_lookup_cache.erase (itr);
+          removed++;
         }
+      else
+        ++itr;
+    }
 
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list size: ",
-                node_list.size ());
+  if (removed > 0)
+    LogPrint (eLogDebug, "DHT: cleanLookupCache: Removed ", removed,
+              " expired lookup result(s)");
+}
 
-      for (const auto &peer : node_list)
-        {
-          auto it = closestNodes.find (peer->GetIdentHash ());
-          if (it == closestNodes.end ())
-            {
-              closestNodes.insert (
-                  std::pair<HashKey, sp_node> (peer->GetIdentHash (), peer));
-              LogPrint (eLogDebug, "DHT: closestNodesLookup: Added node: ",
-                        peer->GetIdentHash ().ToBase64 ());
-            }
-        }
+std::vector<sp_node>
+DHTworker::receivePeerList (const sp_comm_pkt &response)
+{
+  if (response->type != type::CommN)
+    {
+      // ToDo: Looks like in case if we got request to ourself,
+      // for now we just skip it
+      LogPrint (eLogWarning,
+                "DHT: receivePeerList: Got non-response packet, type: ",
+                response->type, ", ver: ", unsigned (response->ver));
+      return {};
     }
 
-  context.removeBatch (batch);
+  LogPrint (eLogDebug, "DHT: receivePeerList: Response from: ",
+            response->from->base64.substr (0, 15), "...");
 
-  /// If we have no responses - try with known nodes
-  if (responses.empty ())
+  pbote::ResponsePacket packet;
+  bool parsed = packet.from_comm_packet (*response, true);
+  if (!parsed)
     {
-      LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
-                "responses, will use known nodes");
-      return getClosestNodes (key, 20, false);
+      LogPrint (eLogWarning, "DHT: receivePeerList: Payload is too "
+                             "short, parsing skipped");
+      return {};
+    }
+
+  if (packet.status != StatusCode::OK)
+    {
+      LogPrint (eLogWarning, "DHT: receivePeerList: Response status: ",
+                statusToString (packet.status), ", parsing skipped");
+      return {};
     }
 
-  /// Now we can lock nodes
-  calc_locks (responses);
+  if (packet.length < 2)
+    {
+      LogPrint (eLogWarning, "DHT: receivePeerList: Packet without "
+                             "payload, parsing skipped");
+      return {};
+    }
 
-  /// If the node is in the received list - the answering node has it unlocked
-  /// If we have node locally and it's locked - unlock it
-  size_t unlocked_counter = 0;
-  auto node_itr = closestNodes.begin ();
-  while (node_itr != closestNodes.end ())
+  std::vector<i2p::data::IdentityEx> identities;
+
+  if (unsigned (packet.data[1]) == 4)
     {
-      auto known_node = findNode (node_itr->second->GetIdentHash ());
-      if (known_node && known_node->locked ())
+      pbote::PeerListPacketV4 peer_list;
+      if (!peer_list.fromBuffer (packet.data.data (), packet.length, true))
         {
-          known_node->gotResponse ();
-          unlocked_counter++;
+          LogPrint (eLogWarning, "DHT: receivePeerList: V4 packet parsing failed");
+          return {};
         }
-      ++node_itr;
+
+      identities = peer_list.data;
     }
 
-  LogPrint (eLogDebug, "DHT: closestNodesLookup: Unlocked node(s): ",
-            unlocked_counter);
+  if (unsigned (packet.data[1]) == 5)
+    {
+      pbote::PeerListPacketV5 peer_list;
+      if (!peer_list.fromBuffer (packet.data.data (), packet.length, true))
+        {
+          LogPrint (eLogWarning, "DHT: receivePeerList: V5 packet parsing failed");
+          return {};
+        }
 
-  {
-    uint16_t days;
-    pbote::config::GetOption ("cleaninterval", days);
-    LogPrint (eLogDebug, "DHT: closestNodesLookup: Silent interval days: ",
-              days);
-    LogPrint (eLogDebug, "DHT: closestNodesLookup: Silent interval sec.: ",
-              (ONE_DAY_SECONDS * days));
+      identities = peer_list.data;
+    }
 
-    std::unique_lock<std::mutex> l (m_nodes_mutex);
-    size_t nodes_removed = 0;
-    long sec_now = context.ts_now ();
-
-    LogPrint (eLogDebug, "DHT: closestNodesLookup: Current time: ", sec_now);
-
-    auto node_itr = m_nodes.begin ();
-    while (node_itr != m_nodes.end ())
-      {
-        long node_ls = (*node_itr).second->lastseen ();
-        long diff = sec_now - node_ls;
-        //LogPrint (eLogDebug, "DHT: closestNodesLookup: Node ls: ", node_ls,
-        //          ", diff: ", diff);
-
-        if ((diff > (ONE_DAY_SECONDS * days)) && (*node_itr).second->locked ())
-          {
-            nodes_removed++;
-            LogPrint (eLogDebug, "DHT: closestNodesLookup: Remove node: ",
-                      (*node_itr).second->short_name ());
-            node_itr = m_nodes.erase (node_itr);
-            continue;
-          }
-        ++node_itr;
-      }
+  size_t nodes_added = 0, nodes_dup = 0, nodes_unlocked = 0;
+  std::vector<sp_node> node_list;
 
-    LogPrint (eLogInfo, "DHT: closestNodesLookup: Silent node(s) removed: ", nodes_removed);
-  }  
+  for (const auto &identity : identities)
+    {
+      if (addNode (identity))
+        nodes_added++;
+      else
+        nodes_dup++;
+
+      /// If the node is in the received list - the answering node has it
+      /// unlocked. If we have node locally and it's locked - unlock it
+      auto known_node = findNode (identity.GetIdentHash ());
+      if (known_node)
+        {
+          if (known_node->locked ())
+            {
+              known_node->gotResponse ();
+              nodes_unlocked++;
+            }
+          node_list.push_back (known_node);
+        }
+      else
+        node_list.push_back (
+            std::make_shared<Node> (destinations ().intern (identity)));
+    }
 
-  for (const auto &node : closestNodes)
-    addNode (node.second->ToBase64 ());
+  LogPrint (eLogDebug, "DHT: receivePeerList: V", unsigned (packet.data[1]),
+            " nodes: ", node_list.size (), ", added: ", nodes_added,
+            ", dup: ", nodes_dup, ", unlocked: ", nodes_unlocked);
 
-  return getClosestNodes (key, 20, false);
+  return node_list;
 }
 
 void
 DHTworker::receiveRetrieveRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveRetrieveRequest: Request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning,
                 "DHT: receiveRetrieveRequest: Self request, skipped");
@@ -1310,9 +1306,9 @@ void
 DHTworker::receiveDeletionQuery (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveDeletionQuery: request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning,
                 "DHT: receiveDeletionQuery: Self request, skipped");
@@ -1389,9 +1385,9 @@ void
 DHTworker::receiveStoreRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: StoreRequest: request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning, "DHT: StoreRequest: Self request, skipped");
       return;
@@ -1471,9 +1467,9 @@ void
 DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: EmailPacketDelete: request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning, "DHT: EmailPacketDelete: Self request, skipped");
       return;
@@ -1609,9 +1605,9 @@ void
 DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: IndexPacketDelete: Request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning, "DHT: IndexPacketDelete: Self request, skipped");
       return;
@@ -1799,9 +1795,9 @@ void
 DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveFindClosePeers: Request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
-  if (packet->from == m_local_node->ToBase64 ())
+  if (packet->from->hash == m_local_node->hash ())
     {
       LogPrint (eLogWarning,
                 "DHT: receiveFindClosePeers: Self request, skipped");
@@ -1857,9 +1853,7 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
 
       for (const auto &node : closest_nodes)
         {
-          i2p::data::IdentityEx identity;
-          identity.FromBase64 (node->ToBase64 ());
-          peer_list.data.push_back (identity);
+          peer_list.data.push_back (node->destination->identity);
         }
 
       response.data = peer_list.toByte ();
@@ -1873,9 +1867,7 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
 
       for (const auto &node : closest_nodes)
         {
-          i2p::data::IdentityEx identity;
-          identity.FromBase64 (node->ToBase64 ());
-          peer_list.data.push_back (identity);
+          peer_list.data.push_back (node->destination->identity);
         }
 
       response.data = peer_list.toByte ();
@@ -1893,11 +1885,35 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
   context.send (q_packet);
 }
 
+void
+DHTworker::run_find_service ()
+{
+  /// Runs until work guard is released on stop
+  while (true)
+    {
+      try
+        {
+          m_find_service.run ();
+          return;
+        }
+      catch (std::exception &ex)
+        {
+          LogPrint (eLogError, "DHT: Find service runtime exception: ",
+                    ex.what ());
+        }
+    }
+}
+
 void
 DHTworker::run ()
 {
   while (m_started)
     {
+      size_t swapped = m_routing_table.maintain ();
+      if (swapped > 0)
+        LogPrint (eLogDebug, "DHT: run: Replaced locked node(s): ", swapped);
+
+      cleanLookupCache ();
       writeNodes ();
       m_dht_storage.update ();
       std::this_thread::sleep_for (std::chrono::seconds (60));
@@ -1938,8 +1954,14 @@ DHTworker::loadNodes ()
 
   for (const auto &node_str : nodes_list)
     {
-      auto node = std::make_shared<Node> (node_str);
-      nodes.push_back (node);
+      auto destination = destinations ().intern (node_str);
+      if (!destination)
+        {
+          LogPrint (eLogWarning, "DHT: loadNodes: Can't parse node");
+          continue;
+        }
+
+      nodes.push_back (std::make_shared<Node> (destination));
     }
 
   if (!nodes.empty ())
@@ -1948,10 +1970,7 @@ DHTworker::loadNodes ()
       for (const auto &node : nodes)
         {
           LogPrint (eLogDebug, "DHT: loadNodes: Node: ", node->short_name ());
-          auto t_hash = node->GetIdentHash ();
-          bool result
-              = m_nodes.insert (std::pair<HashKey, sp_node> (t_hash, node))
-                    .second;
+          bool result = m_routing_table.add (node);
 
           if (result)
             counter++;
@@ -1967,10 +1986,10 @@ DHTworker::loadNodes ()
 
       /// Now we need lock all loaded nodes for initial check in
       /// first running of closestNodesLookupTask
-      for (auto node : m_nodes)
+      for (const auto &node : getAllNodes ())
         {
-          node.second->lastseen (context.ts_now ());
-          node.second->noResponse ();
+          node->lastseen (context.ts_now ());
+          node->noResponse ();
         }
 
       return true;
@@ -1995,10 +2014,10 @@ DHTworker::loadNodes ()
             }
         }
 
-      for (auto node : m_nodes)
+      for (const auto &node : getAllNodes ())
         {
-          node.second->lastseen (context.ts_now ());
-          node.second->noResponse ();
+          node->lastseen (context.ts_now ());
+          node->noResponse ();
         }
 
       return true;
@@ -2026,12 +2045,10 @@ DHTworker::writeNodes ()
   nodes_file << "# Each line is one Base64-encoded I2P destination.\n";
   nodes_file << "# Do not edit this file while pbote is running as it will be "
                 "overwritten.\n\n";
-  std::unique_lock<std::mutex> l (m_nodes_mutex);
-
   size_t saved = 0;
-  for (const auto &node : m_nodes)
+  for (const auto &node : getAllNodes ())
     {
-      nodes_file << node.second->ToBase64 ();
+      nodes_file << node->destination->base64;
       nodes_file << "\n";
       saved++;
     }
@@ -2040,28 +2057,250 @@ DHTworker::writeNodes ()
   LogPrint (eLogDebug, "DHT: writeNodes: ", saved, " node(s) saved to FS");
 }
 
-void
-DHTworker::calc_locks (std::vector<sp_comm_pkt> responses)
+bool
+DHTworker::sendRequests (const HashKey &key,
+                         const std::shared_ptr<batch_comm_packet> &batch,
+                         requests_map &requests,
+                         const std::vector<sp_node> &nodes,
+                         const request_builder &builder, size_t quorum)
 {
-  size_t counter = 0;
-  for (const auto &node : m_nodes)
+  using clock = std::chrono::steady_clock;
+
+  struct pending_request
+  {
+    sp_node node;
+    PacketForQueue packet;
+    clock::time_point sent;
+    int attempts;
+  };
+
+  std::unordered_map<cid_key, pending_request> pending;
+  std::unordered_set<HashKey> used;
+  size_t retransmitted = 0, replaced = 0, exhausted = 0;
+
+  auto add_request = [&] (const sp_node &node)
+  {
+    cid_key cid;
+    context.random_cid (cid, 32);
+
+    auto bytes = builder (cid);
+    PacketForQueue q_packet (node->destination, bytes.data (), bytes.size ());
+
+    batch->addPacket (cid, q_packet);
+    requests[cid] = node;
+    used.insert (node->hash ());
+
+    pending.emplace (cid, pending_request { node, q_packet, clock::now (), 1 });
+    return cid;
+  };
+
+  for (const auto &node : nodes)
     {
-      /// If we found response later node will be unlocked
-      node.second->noResponse ();
-      for (auto response : responses)
+      if (used.find (node->hash ()) == used.end ())
+        add_request (node);
+    }
+
+  LogPrint (eLogDebug, "DHT: sendRequests: ", batch->owner, ": Batch size: ",
+            batch->packetCount ());
+
+  context.send (batch);
+
+  auto deadline = clock::now () + std::chrono::seconds (REQUEST_DEADLINE);
+
+  while (m_started)
+    {
+      /// Forget answered requests
+      for (auto itr = pending.begin (); itr != pending.end ();)
         {
-          if (response->from == node.second->ToBase64 ())
+          clock::time_point answered_at;
+          if (!batch->answeredAt (itr->first, answered_at))
+            {
+              ++itr;
+              continue;
+            }
+
+          /// Response to retransmitted request is ambiguous for RTT
+          if (itr->second.attempts == 1)
             {
-              node.second->gotResponse ();
-              /*
-              LogPrint (eLogDebug, "DHT: calc_locks: Node unlocked: ",
-                        node.second->short_name ());
-              */
-              counter++;
+              auto rtt = std::chrono::duration_cast<std::chrono::milliseconds> (
+                  answered_at - itr->second.sent);
+              itr->second.node->rtt_sample (rtt.count ());
             }
+
+          itr = pending.erase (itr);
+        }
+
+      auto now = clock::now ();
+      if (batch->quorumReached (quorum) || pending.empty () || now >= deadline)
+        break;
+
+      auto next_timer = deadline;
+      for (const auto &request : pending)
+        {
+          auto timer = request.second.sent + std::chrono::milliseconds (
+              request.second.node->rto (request.second.attempts));
+          next_timer = std::min (next_timer, timer);
+        }
+
+      if (next_timer > now)
+        {
+          batch->waitQuorum (quorum,
+                             std::chrono::duration_cast<std::chrono::milliseconds> (
+                                 next_timer - now));
+          continue;
+        }
+
+      /// Retransmit requests which timed out, only to the node they were
+      /// sent to, or replace silent node with the next closest one
+      std::vector<cid_key> expired;
+      for (const auto &request : pending)
+        {
+          auto timer = request.second.sent + std::chrono::milliseconds (
+              request.second.node->rto (request.second.attempts));
+          if (timer <= now)
+            expired.push_back (request.first);
         }
+
+      for (const auto &cid : expired)
+        {
+          auto &request = pending.at (cid);
+
+          if (request.attempts < REQUEST_MAX_ATTEMPTS)
+            {
+              request.attempts++;
+              request.sent = now;
+              context.send (batch, cid, request.packet);
+              retransmitted++;
+              continue;
+            }
+
+          /// Response came after the check above, it's taken next pass
+          clock::time_point answered_at;
+          if (batch->answeredAt (cid, answered_at))
+            continue;
+
+          /// Node is silent on every attempt, so it's penalized even if
+          /// caller stops early and doesn't penalize cancelled requests
+          request.node->noResponse ();
+          requests.erase (cid);
+          exhausted++;
+
+          batch->abandonPacket (cid);
+          context.removeRequest (cid);
+          pending.erase (cid);
+
+          for (const auto &node : getClosestNodes (key, used.size () + 1, false))
+            {
+              if (used.find (node->hash ()) != used.end ())
+                continue;
+
+              auto new_cid = add_request (node);
+              context.send (batch, new_cid, pending.at (new_cid).packet);
+              replaced++;
+              break;
+            }
+        }
+    }
+
+  /// Result is ready, answers to outstanding requests are not needed
+  for (const auto &request : pending)
+    {
+      batch->abandonPacket (request.first);
+      context.removeRequest (request.first);
+    }
+
+  LogPrint (eLogDebug, "DHT: sendRequests: ", batch->owner, ": Got ",
+            batch->responseCount (), " responses, retransmitted: ",
+            retransmitted, ", exhausted: ", exhausted, ", replaced: ",
+            replaced, ", cancelled: ", pending.size ());
+
+  return batch->quorumReached (quorum);
+}
+
+void
+DHTworker::update_liveness (const std::vector<sp_comm_pkt> &responses,
+                            const requests_map &requests, bool penalize)
+{
+  std::unordered_set<HashKey> answered;
+
+  for (const auto &response : responses)
+    {
+      auto request_itr = requests.find (HashKey (response->cid));
+      if (request_itr == requests.end ())
+        continue;
+
+      request_itr->second->gotResponse ();
+      answered.insert (request_itr->first);
+    }
+
+  size_t penalized = 0;
+
+  /// Nodes which did not answer any attempt are penalized already by
+  /// sendRequests, here are requests cancelled while still in flight
+  if (penalize)
+    {
+      for (const auto &request : requests)
+        {
+          if (answered.find (request.first) != answered.end ())
+            continue;
+
+          request.second->noResponse ();
+          penalized++;
+        }
+    }
+
+  LogPrint (eLogDebug, "DHT: update_liveness: Answered: ", answered.size (),
+            ", penalized: ", penalized, ", requests: ", requests.size ());
+}
+
+sp_comm_pkt
+DHTworker::findLocal (const HashKey &key, uint8_t type)
+{
+  std::vector<uint8_t> data;
+  switch (type)
+    {
+    case type::DataI:
+      data = m_dht_storage.getIndex (key);
+      break;
+    case type::DataE:
+      data = m_dht_storage.getEmail (key);
+      break;
+    case type::DataC:
+      data = m_dht_storage.getContact (key);
+      break;
+    default:
+      break;
     }
-  LogPrint (eLogDebug, "DHT: calc_locks: Nodes unlocked: ", counter);
+
+  if (data.empty ())
+    return nullptr;
+
+  /// Wrap local packet as response from us, so it's handled as others
+  pbote::ResponsePacket response;
+  context.random_cid (response.cid, 32);
+  response.status = pbote::StatusCode::OK;
+  response.length = data.size ();
+  response.data = data;
+
+  auto bytes = response.toByte ();
+  auto q_packet = std::make_shared<PacketForQueue> (
+      m_local_node->destination, bytes.data (), bytes.size ());
+
+  return parseCommPacket (q_packet);
+}
+
+batch_comm_packet::response_filter
+DHTworker::statusFilter (std::vector<uint8_t> statuses)
+{
+  return [statuses] (const sp_comm_pkt &response)
+    {
+      /// Status is the first byte of response payload
+      if (response->type != type::CommN || response->payload.empty ())
+        return false;
+
+      return std::find (statuses.begin (), statuses.end (),
+                        response->payload[0]) != statuses.end ();
+    };
 }
 
 pbote::FindClosePeersRequestPacket
@@ -9,12 +9,20 @@
 #ifndef PBOTE_DHT_WORKER_H_
 #define PBOTE_DHT_WORKER_H_
 
+#include <atomic>
+#include <boost/asio.hpp>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <random>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
 #include "ConfigParser.h"
@@ -23,6 +31,7 @@
 #include "Logging.h"
 #include "NetworkWorker.h"
 #include "PacketHandler.h"
+#include "RoutingTable.h"
 
 // libi2pd
 #include "Identity.h"
@@ -32,8 +41,6 @@ namespace pbote
 namespace kademlia
 {
 
-#define BIT_SIZE 256
-
 /// Number of redundant storage nodes
 // ToDo: change to 20 on release 0.9.0
 #ifdef NDEBUG
@@ -70,10 +77,25 @@ namespace kademlia
 /// Max. number of seconds to wait for replies to retrieve requests
 #define RESPONSE_TIMEOUT 30
 
+/// Max. number of seconds to wait for replies with retransmissions
+#define REQUEST_DEADLINE (3 * RESPONSE_TIMEOUT)
+
+/// Max. number of times request is sent to the same node
+#define REQUEST_MAX_ATTEMPTS 3
+
 /// The maximum amount of time a FIND_CLOSEST_NODES can take
 //#define CLOSEST_NODES_LOOKUP_TIMEOUT (5 * 60)
 #define CLOSEST_NODES_LOOKUP_TIMEOUT (2 * 60)
 
+/// Number of closest nodes the lookup converges to
+#define CLOSEST_NODES_LOOKUP_SIZE 20
+
+/// Number of seconds the lookup result can be reused for the same key
+#define CLOSEST_NODES_CACHE_TTL (10 * 60)
+
+/// Max. number of keys retrieved at the same time by findMany
+#define FIND_MANY_PARALLELISM 5
+
 /// 24*60*60
 #define ONE_DAY_SECONDS 86400
 
@@ -86,95 +108,13 @@ namespace kademlia
 
 #define DEFAULT_NODE_FILE_NAME "nodes.txt"
 
-struct Node : i2p::data::IdentityEx
-{
-  long first_seen;
-  long last_seen;
-  int consecutive_timeouts = 0;
-  long locked_until = 0;
-
-  Node ()
-      : first_seen (0), last_seen (0), consecutive_timeouts (0),
-        locked_until (0)
-  {
-  }
-
-  Node (const std::string &new_destination)
-      : first_seen (0), last_seen (0), consecutive_timeouts (0),
-        locked_until (0)
-  {
-    this->FromBase64 (new_destination);
-  }
-
-  Node (const uint8_t *buf, int len)
-      : first_seen (0), last_seen (0), consecutive_timeouts (0),
-        locked_until (0)
-  {
-    this->FromBuffer (buf, len);
-  }
-
-  Node (const std::string &new_destination, long firstSeen,
-        int consecutiveTimeouts, long lockedUntil)
-      : first_seen (firstSeen), last_seen (0),
-        consecutive_timeouts (consecutiveTimeouts), locked_until (lockedUntil)
-  {
-    this->FromBase64 (new_destination);
-  }
-
-  std::string
-  short_name ()
-  {
-    std::string str = this->ToBase64 ().substr (0, 15);
-    str.append ("...");
-    return str;
-  }
-
-  void
-  noResponse ()
-  {
-    consecutive_timeouts++;
-
-    const auto current_time = std::chrono::system_clock::now ();
-    const auto lock_time
-        = current_time + std::chrono::minutes (consecutive_timeouts * 10);
-    const auto lock_epoch = lock_time.time_since_epoch ();
-
-    locked_until
-        = std::chrono::duration_cast<std::chrono::seconds> (lock_epoch)
-              .count ();
-  }
-
-  void
-  gotResponse ()
-  {
-    last_seen = context.ts_now ();
-
-    consecutive_timeouts = 0;
-    locked_until = 0;
-  }
-
-  bool
-  locked ()
-  {
-    return context.ts_now () < locked_until;
-  }
-
-  long
-  lastseen ()
-  {
-    return last_seen;
-  }
-
-  void
-  lastseen (long ts)
-  {
-    last_seen = ts;
-  }
-
-};
-
-using sp_node = std::shared_ptr<Node>;
-using HashKey = i2p::data::Tag<32>;
+/// CID of the sent request -> node it was sent to
+using requests_map = std::unordered_map<HashKey, sp_node>;
+/// Serializes request packet with given CID
+using request_builder = std::function<std::vector<uint8_t> (const cid_key &)>;
+/// Called from worker thread of findMany for every key when it's done
+using find_callback = std::function<void (const HashKey &,
+                                          const std::vector<sp_comm_pkt> &)>;
 
 class DHTworker
 {
@@ -188,6 +128,7 @@ public:
   bool addNode (const std::string &dest);
   bool addNode (const uint8_t *buf, size_t len);
   bool addNode (const i2p::data::IdentityEx &identity);
+  bool addNode (const sp_destination &destination);
   sp_node findNode (const HashKey &ident) const; /// duplication check
 
   sp_node getClosestNode (const HashKey &key, bool to_us);
@@ -198,7 +139,7 @@ public:
   size_t
   getNodesCount ()
   {
-    return m_nodes.size ();
+    return m_routing_table.size ();
   }
   size_t
   get_unlocked_nodes_count ()
@@ -209,6 +150,9 @@ public:
   std::vector<sp_comm_pkt> findOne (HashKey hash, uint8_t type);
   std::vector<sp_comm_pkt> findAll (HashKey hash, uint8_t type);
   std::vector<sp_comm_pkt> find (HashKey hash, uint8_t type, bool exhaustive);
+  std::vector<sp_comm_pkt> findMany (const std::vector<HashKey> &keys,
+                                     uint8_t type,
+                                     const find_callback &on_found = nullptr);
   std::vector<std::string> store (HashKey hash, uint8_t type,
                                   StoreRequestPacket packet);
 
@@ -269,7 +213,24 @@ private:
   bool loadNodes ();
   void writeNodes ();
 
-  void calc_locks (std::vector<sp_comm_pkt> responses);
+  void update_liveness (const std::vector<sp_comm_pkt> &responses,
+                        const requests_map &requests, bool penalize);
+  std::vector<sp_node> receivePeerList (const sp_comm_pkt &response);
+  std::vector<sp_node> closestNodesLookup (const HashKey &key,
+                                           bool &converged);
+  void cleanLookupCache ();
+  sp_comm_pkt findLocal (const HashKey &key, uint8_t type);
+  std::vector<sp_comm_pkt> retrieve (const HashKey &key, uint8_t type,
+                                     bool exhaustive,
+                                     std::vector<sp_node> closestNodes);
+
+  bool sendRequests (const HashKey &key,
+                     const std::shared_ptr<batch_comm_packet> &batch,
+                     requests_map &requests, const std::vector<sp_node> &nodes,
+                     const request_builder &builder, size_t quorum);
+
+  static batch_comm_packet::response_filter
+  statusFilter (std::vector<uint8_t> statuses);
 
   static FindClosePeersRequestPacket findClosePeersPacket (HashKey key);
   static RetrieveRequestPacket retrieveRequestPacket (uint8_t data_type,
@@ -287,14 +248,32 @@ private:
     return true;
   };
 
+  void run_find_service ();
+
   bool m_started;
   std::thread *m_worker_thread;
   sp_node m_local_node;
 
-  mutable std::mutex m_nodes_mutex;
-  std::map<HashKey, sp_node> m_nodes;
+  /// Threads which retrieve keys for findMany
+  boost::asio::io_service m_find_service;
+  std::unique_ptr<boost::asio::io_service::work> m_find_work;
+  std::vector<std::thread> m_find_threads;
+
+  RoutingTable m_routing_table;
+
+  struct lookup_result
+  {
+    std::vector<sp_node> nodes;
+    int32_t created;
+  };
+
+  /// Recent lookup results and lookups in progress, by DHT key
+  std::mutex m_lookup_mutex;
+  std::unordered_map<HashKey, lookup_result> m_lookup_cache;
+  std::unordered_map<HashKey, std::shared_future<std::vector<sp_node> > >
+      m_running_lookups;
 
-  //ToDo: K-bucket/routing table and S-bucket (NEED MORE DISCUSSION)
+  //ToDo: S-bucket (NEED MORE DISCUSSION)
 
   //pbote::fs::HashedStorage m_storage_;
   kademlia::DHTStorage m_dht_storage;
@@ -0,0 +1,184 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+
+#include "DestinationRegistry.h"
+
+namespace pbote
+{
+
+sp_destination
+DestinationRegistry::intern (const std::string &base64)
+{
+  std::unique_lock<std::mutex> l (m_registry_mutex);
+
+  auto itr = m_by_base64.find (base64);
+  if (itr != m_by_base64.end ())
+    {
+      auto destination = itr->second.lock ();
+      if (destination)
+        return destination;
+    }
+
+  i2p::data::IdentityEx identity;
+  if (!identity.FromBase64 (base64))
+    return nullptr;
+
+  auto destination = insert_unlocked (identity);
+  /// Non-canonical form is remembered too, so it's parsed only once
+  if (destination->base64 != base64)
+    m_by_base64[base64] = destination;
+
+  return destination;
+}
+
+sp_destination
+DestinationRegistry::intern (const uint8_t *buf, size_t len)
+{
+  i2p::data::IdentityEx identity;
+  if (!identity.FromBuffer (buf, len))
+    return nullptr;
+
+  return intern (identity);
+}
+
+sp_destination
+DestinationRegistry::intern (const i2p::data::IdentityEx &identity)
+{
+  std::unique_lock<std::mutex> l (m_registry_mutex);
+  return insert_unlocked (identity);
+}
+
+sp_destination
+DestinationRegistry::find (const i2p::data::IdentHash &hash) const
+{
+  std::unique_lock<std::mutex> l (m_registry_mutex);
+
+  auto itr = m_by_hash.find (hash);
+  if (itr == m_by_hash.end ())
+    return nullptr;
+
+  return itr->second.lock ();
+}
+
+size_t
+DestinationRegistry::size () const
+{
+  std::unique_lock<std::mutex> l (m_registry_mutex);
+  return m_by_hash.size ();
+}
+
+void
+DestinationRegistry::set_container_support (const i2p::data::IdentHash &hash)
+{
+  auto now = clock::now ();
+  std::unique_lock<std::mutex> l (m_features_mutex);
+
+  m_features[hash].container_support
+      = now + std::chrono::seconds (DESTINATION_FEATURES_TTL);
+
+  if (m_features.size () >= m_features_purge_size)
+    purge_features_unlocked (now);
+}
+
+bool
+DestinationRegistry::container_support (const i2p::data::IdentHash &hash,
+                                        bool &announce)
+{
+  auto now = clock::now ();
+  std::unique_lock<std::mutex> l (m_features_mutex);
+
+  auto itr = m_features.find (hash);
+  if (itr == m_features.end ())
+    {
+      if (m_features.size () >= m_features_purge_size)
+        purge_features_unlocked (now);
+
+      itr = m_features.emplace (hash, features ()).first;
+    }
+
+  announce = itr->second.container_announced <= now;
+  if (announce)
+    itr->second.container_announced
+        = now + std::chrono::seconds (DESTINATION_FEATURES_TTL);
+
+  return itr->second.container_support > now;
+}
+
+sp_destination
+DestinationRegistry::insert_unlocked (const i2p::data::IdentityEx &identity)
+{
+  const auto &hash = identity.GetIdentHash ();
+
+  auto itr = m_by_hash.find (hash);
+  if (itr != m_by_hash.end ())
+    {
+      auto destination = itr->second.lock ();
+      if (destination)
+        return destination;
+    }
+
+  auto destination = std::make_shared<Destination> ();
+  destination->hash = hash;
+  destination->identity = identity;
+  destination->base64 = identity.ToBase64 ();
+  destination->binary.resize (identity.GetFullLen ());
+  identity.ToBuffer (destination->binary.data (),
+                     destination->binary.size ());
+
+  m_by_hash[hash] = destination;
+  m_by_base64[destination->base64] = destination;
+
+  if (m_by_hash.size () >= m_purge_size)
+    purge_unlocked ();
+
+  return destination;
+}
+
+void
+DestinationRegistry::purge_unlocked ()
+{
+  for (auto itr = m_by_hash.begin (); itr != m_by_hash.end ();)
+    {
+      if (itr->second.expired ())
+        itr = m_by_hash.erase (itr);
+      else
+        ++itr;
+    }
+
+  for (auto itr = m_by_base64.begin (); itr != m_by_base64.end ();)
+    {
+      if (itr->second.expired ())
+        itr = m_by_base64.erase (itr);
+      else
+        ++itr;
+    }
+
+  /// Next purge when registry doubles, so cost per insert stays constant
+  m_purge_size = std::max ((size_t)DESTINATION_REGISTRY_PURGE_MIN,
+                           m_by_hash.size () * 2);
+}
+
+void
+DestinationRegistry::purge_features_unlocked (const clock::time_point &now)
+{
+  for (auto itr = m_features.begin (); itr != m_features.end ();)
+    {
+      if (itr->second.container_support <= now
+          && itr->second.container_announced <= now)
+        itr = m_features.erase (itr);
+      else
+        ++itr;
+    }
+
+  m_features_purge_size = std::max ((size_t)DESTINATION_REGISTRY_PURGE_MIN,
+                                    m_features.size () * 2);
+}
+
+} // namespace pbote
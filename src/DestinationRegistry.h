@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_DESTINATION_REGISTRY_H_
+#define PBOTED_SRC_DESTINATION_REGISTRY_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// libi2pd
+#include "Identity.h"
+#include "Tag.h"
+
+namespace pbote
+{
+
+/// Min. number of entries before expired ones are purged from registry
+#define DESTINATION_REGISTRY_PURGE_MIN 1024
+/// Seconds for which container support of peer is remembered, and after
+/// which we announce ours to the same peer again
+#define DESTINATION_FEATURES_TTL (24 * 60 * 60)
+
+/**
+ * @brief I2P destination with all its representations
+ *
+ * Created only by DestinationRegistry, so every form is computed once
+ * for each destination we talk to.
+ */
+struct Destination
+{
+  i2p::data::IdentHash hash;
+  std::string base64;
+  std::vector<uint8_t> binary;
+  i2p::data::IdentityEx identity;
+
+  /// Peer failed to take stream, datagrams are used until this time
+  mutable std::atomic<int32_t> stream_blocked_until { 0 };
+
+  std::string
+  short_name () const
+  {
+    return base64.substr (0, 15) + "...";
+  }
+};
+
+/// Compact handle, passed along packets instead of Base64 string
+using sp_destination = std::shared_ptr<const Destination>;
+
+/**
+ * @brief Registry of interned I2P destinations
+ *
+ * Registry doesn't own destinations: entry lives while somebody holds
+ * a handle to it, expired entries are purged when registry grows.
+ */
+class DestinationRegistry
+{
+ public:
+  DestinationRegistry ()
+      : m_purge_size (DESTINATION_REGISTRY_PURGE_MIN),
+        m_features_purge_size (DESTINATION_REGISTRY_PURGE_MIN)
+  {
+  }
+
+  /// Return nullptr if destination can't be parsed
+  sp_destination intern (const std::string &base64);
+  sp_destination intern (const uint8_t *buf, size_t len);
+  sp_destination intern (const i2p::data::IdentityEx &identity);
+
+  sp_destination find (const i2p::data::IdentHash &hash) const;
+  size_t size () const;
+
+  /// Peer sent us container of packets, so it can unpack ours
+  void set_container_support (const i2p::data::IdentHash &hash);
+  /// True if peer can unpack containers. Announce is set if we should tell
+  /// peer about our support now, it's set once per TTL for every peer
+  bool container_support (const i2p::data::IdentHash &hash, bool &announce);
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  /// Negotiated features are kept apart from destinations, which are
+  /// purged as soon as nobody holds them
+  struct features
+  {
+    clock::time_point container_support;
+    clock::time_point container_announced;
+  };
+
+  sp_destination insert_unlocked (const i2p::data::IdentityEx &identity);
+  void purge_unlocked ();
+  void purge_features_unlocked (const clock::time_point &now);
+
+  mutable std::mutex m_registry_mutex;
+  std::unordered_map<i2p::data::IdentHash, std::weak_ptr<const Destination> >
+      m_by_hash;
+  /// Received packets carry Base64 form, so it's looked up without parsing
+  std::unordered_map<std::string, std::weak_ptr<const Destination> >
+      m_by_base64;
+  size_t m_purge_size;
+
+  std::mutex m_features_mutex;
+  std::unordered_map<i2p::data::IdentHash, features> m_features;
+  size_t m_features_purge_size;
+};
+
+inline DestinationRegistry &
+destinations ()
+{
+  static DestinationRegistry registry;
+  return registry;
+}
+
+} // namespace pbote
+
+#endif // PBOTED_SRC_DESTINATION_REGISTRY_H_
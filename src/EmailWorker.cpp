@@ -717,7 +717,7 @@ EmailWorker::retrieve_index (const sp_id_full &identity)
         }
 
       LogPrint (eLogDebug, "EmailWorker: retrieve_index: Got response from: ",
-                response->from.substr (0, 15), "...");
+                response->from->base64.substr (0, 15), "...");
       
       ResponsePacket res_packet;
       bool parsed = res_packet.from_comm_packet (*response, true);
@@ -785,6 +785,7 @@ EmailWorker::retrieve_email (const v_index &indices)
 {
   std::vector<std::shared_ptr<CommunicationPacket> > responses;
   v_enc_email local_email_packets;
+  std::vector<i2p::data::Tag<32> > dht_keys;
 
   for (const auto &index : indices)
     {
@@ -817,17 +818,23 @@ EmailWorker::retrieve_email (const v_index &indices)
           LogPrint (eLogDebug, "EmailWorker: retrieve_email: Can't find packet"
                     " for key: ", hash.ToBase64 (), " localy, try to ask DHT");
 
-          auto dht_results = DHT_worker.findAll (hash, DataE);
-
-          LogPrint (eLogDebug, "EmailWorker: retrieve_email: Got ",
-                    dht_results.size (), " DHT results for key ",
-                    hash.ToBase64 ());
-
-          responses.insert (responses.end (), dht_results.begin (),
-                            dht_results.end ());
+          dht_keys.push_back (hash);
         }
     }
 
+  if (!dht_keys.empty ())
+    {
+      responses = DHT_worker.findMany (
+          dht_keys, DataE,
+          [] (const i2p::data::Tag<32> &key,
+              const std::vector<sp_comm_pkt> &results)
+          {
+            LogPrint (eLogDebug, "EmailWorker: retrieve_email: Got ",
+                      results.size (), " DHT results for key ",
+                      key.ToBase64 ());
+          });
+    }
+
   LogPrint (eLogDebug, "EmailWorker: retrieve_email: Got ",
             local_email_packets.size (), " local and ", responses.size (),
             " DHT results: ");
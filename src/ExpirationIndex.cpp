@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+#include "ExpirationIndex.h"
+#include "Logging.h"
+
+// libi2pd
+#include "I2PEndian.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+void
+ExpirationIndex::schedule (const item &packet, int32_t time)
+{
+  /// Bucket is end of interval, rounded up
+  int32_t bucket = time <= 0 ? 0
+                   : (int32_t)(((int64_t)time + EXPIRATION_BUCKET_SIZE - 1)
+                               / EXPIRATION_BUCKET_SIZE
+                               * EXPIRATION_BUCKET_SIZE);
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  cancel_unlocked (packet);
+
+  m_buckets[bucket].insert (packet);
+  m_items[packet] = bucket;
+}
+
+void
+ExpirationIndex::cancel (const item &packet)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  cancel_unlocked (packet);
+}
+
+std::vector<ExpirationIndex::item>
+ExpirationIndex::due (int32_t ts, size_t max)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  std::vector<item> result;
+  auto bucket_itr = m_buckets.begin ();
+  while (bucket_itr != m_buckets.end () && bucket_itr->first <= ts
+         && result.size () < max)
+    {
+      auto &packets = bucket_itr->second;
+      while (!packets.empty () && result.size () < max)
+        {
+          result.push_back (*packets.begin ());
+          m_items.erase (*packets.begin ());
+          packets.erase (packets.begin ());
+        }
+
+      if (packets.empty ())
+        bucket_itr = m_buckets.erase (bucket_itr);
+    }
+
+  return result;
+}
+
+void
+ExpirationIndex::clear ()
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  m_buckets.clear ();
+  m_items.clear ();
+}
+
+size_t
+ExpirationIndex::size () const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_items.size ();
+}
+
+bool
+ExpirationIndex::save (const std::string &path) const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  std::vector<uint8_t> bytes;
+  bytes.reserve (m_items.size () * EXPIRATION_RECORD_LEN);
+  for (const auto &packet : m_items)
+    {
+      uint8_t time[4];
+      htobe32buf (time, (uint32_t)packet.second);
+
+      bytes.push_back (packet.first.type);
+      bytes.push_back (packet.first.kind);
+      bytes.insert (bytes.end (), packet.first.key.data (),
+                    packet.first.key.data () + 32);
+      bytes.insert (bytes.end (), time, time + 4);
+    }
+
+  l.unlock ();
+
+  /// Old file stays whole until new one is written
+  std::string tmp_path = path + ".tmp";
+  std::ofstream file (tmp_path, std::ofstream::binary | std::ofstream::out
+                                | std::ofstream::trunc);
+  if (!file.is_open ())
+    {
+      LogPrint (eLogError, "ExpirationIndex: save: Can't open file ",
+                tmp_path);
+      return false;
+    }
+
+  file.write (reinterpret_cast<const char *>(bytes.data ()), bytes.size ());
+  file.close ();
+
+  if (!file || std::rename (tmp_path.c_str (), path.c_str ()) != 0)
+    {
+      LogPrint (eLogError, "ExpirationIndex: save: Can't write file ", path);
+      return false;
+    }
+
+  return true;
+}
+
+std::map<ExpirationIndex::item, int32_t>
+ExpirationIndex::load (const std::string &path)
+{
+  std::map<item, int32_t> result;
+
+  std::ifstream file (path, std::ios::binary);
+  if (!file.is_open ())
+    return result;
+
+  std::vector<uint8_t> bytes ((std::istreambuf_iterator<char> (file)),
+                              (std::istreambuf_iterator<char> ()));
+
+  for (size_t offset = 0; offset + EXPIRATION_RECORD_LEN <= bytes.size ();
+       offset += EXPIRATION_RECORD_LEN)
+    {
+      const uint8_t *record = bytes.data () + offset;
+      item packet = { record[0], record[1],
+                      i2p::data::Tag<32> (record + 2) };
+      result[packet] = (int32_t)bufbe32toh (record + 34);
+    }
+
+  return result;
+}
+
+void
+ExpirationIndex::cancel_unlocked (const item &packet)
+{
+  auto item_itr = m_items.find (packet);
+  if (item_itr == m_items.end ())
+    return;
+
+  auto bucket_itr = m_buckets.find (item_itr->second);
+  if (bucket_itr != m_buckets.end ())
+    {
+      bucket_itr->second.erase (packet);
+      if (bucket_itr->second.empty ())
+        m_buckets.erase (bucket_itr);
+    }
+
+  m_items.erase (item_itr);
+}
+
+} // namespace kademlia
+} // namespace pbote
@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_EXPIRATION_INDEX_H_
+#define PBOTED_SRC_EXPIRATION_INDEX_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// libi2pd
+#include "Tag.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+/// Seconds of expiration time in one bucket
+#define EXPIRATION_BUCKET_SIZE 3600
+/// Max. number of packets checked in one run
+#define EXPIRATION_BATCH_SIZE 256
+/// Max. msec spent on expiration in one update, batches follow one
+/// another until there are no expired packets or time is over
+#define EXPIRATION_PASS_TIME 5000
+/// type[1] + kind[1] + key[32] + time[4]
+#define EXPIRATION_RECORD_LEN 38
+
+/**
+ * @brief Stored packets ordered by time when they (or their oldest
+ * entries) expire
+ *
+ * Times are rounded up to buckets, so packet is never taken before
+ * it expires, but can be taken up to one bucket later.
+ */
+class ExpirationIndex
+{
+ public:
+  struct item
+  {
+    uint8_t type;
+    uint8_t kind;
+    i2p::data::Tag<32> key;
+
+    bool
+    operator< (const item &other) const
+    {
+      if (type != other.type)
+        return type < other.type;
+      if (kind != other.kind)
+        return kind < other.kind;
+      return key < other.key;
+    }
+  };
+
+  /// Replace previous time of packet, if any
+  void schedule (const item &packet, int32_t time);
+  void cancel (const item &packet);
+
+  /// Remove and return up to max packets expired at ts
+  std::vector<item> due (int32_t ts, size_t max);
+
+  void clear ();
+  size_t size () const;
+
+  /// Save all packets with their times, so restart needs no rescan
+  bool save (const std::string &path) const;
+  /// Times saved before, empty if there is no file
+  static std::map<item, int32_t> load (const std::string &path);
+
+ private:
+  void cancel_unlocked (const item &packet);
+
+  mutable std::mutex m_mutex;
+  std::map<int32_t, std::set<item> > m_buckets;
+  std::map<item, int32_t> m_items;
+};
+
+} // namespace kademlia
+} // namespace pbote
+
+#endif // PBOTED_SRC_EXPIRATION_INDEX_H_
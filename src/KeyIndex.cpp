@@ -0,0 +1,254 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <array>
+#include <mutex>
+#include <random>
+
+#include "KeyIndex.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+namespace
+{
+
+std::array<uint64_t, 3>
+random_seeds ()
+{
+  std::random_device rd;
+  std::array<uint64_t, 3> seeds;
+  for (auto &seed : seeds)
+    seed = ((uint64_t)rd () << 32) | rd ();
+
+  return seeds;
+}
+
+} // namespace
+
+KeyIndex::KeyIndex ()
+  : m_size (0),
+    m_bloom_stale (0)
+{
+  resize_unlocked (KEY_INDEX_MIN_CAPACITY);
+}
+
+bool
+KeyIndex::insert (const i2p::data::Tag<32> &key)
+{
+  std::unique_lock<std::shared_mutex> l (m_mutex);
+
+  size_t slot = find_unlocked (key);
+  if (m_used[slot])
+    return false;
+
+  m_slots[slot] = key;
+  m_used[slot] = 1;
+  m_size++;
+  bloom_add_unlocked (key);
+
+  if (m_size * 100 > m_slots.size () * KEY_INDEX_MAX_LOAD_PERCENT)
+    resize_unlocked (m_slots.size () * 2);
+
+  return true;
+}
+
+bool
+KeyIndex::erase (const i2p::data::Tag<32> &key)
+{
+  std::unique_lock<std::shared_mutex> l (m_mutex);
+
+  if (!bloom_check_unlocked (key))
+    return false;
+
+  size_t slot = find_unlocked (key);
+  if (!m_used[slot])
+    return false;
+
+  /// Backward shift, so probing never needs deleted marks
+  const size_t mask = m_slots.size () - 1;
+  size_t next = slot;
+  while (true)
+    {
+      next = (next + 1) & mask;
+      if (!m_used[next])
+        break;
+
+      size_t next_home = home (m_slots[next], mask);
+      /// Key stays if its home is cyclically in (slot, next]
+      bool stays = slot <= next
+                   ? (slot < next_home && next_home <= next)
+                   : (slot < next_home || next_home <= next);
+      if (stays)
+        continue;
+
+      m_slots[slot] = m_slots[next];
+      slot = next;
+    }
+
+  m_used[slot] = 0;
+  m_size--;
+  m_bloom_stale++;
+
+  if (m_bloom_stale > KEY_INDEX_MIN_CAPACITY && m_bloom_stale > m_size)
+    rebuild_bloom_unlocked ();
+
+  return true;
+}
+
+bool
+KeyIndex::contains (const i2p::data::Tag<32> &key) const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+
+  if (!bloom_check_unlocked (key))
+    return false;
+
+  return m_used[find_unlocked (key)] != 0;
+}
+
+void
+KeyIndex::clear ()
+{
+  std::unique_lock<std::shared_mutex> l (m_mutex);
+
+  m_size = 0;
+  m_slots.clear ();
+  m_used.clear ();
+  resize_unlocked (KEY_INDEX_MIN_CAPACITY);
+}
+
+size_t
+KeyIndex::size () const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  return m_size;
+}
+
+std::vector<i2p::data::Tag<32> >
+KeyIndex::keys () const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+
+  std::vector<i2p::data::Tag<32> > result;
+  result.reserve (m_size);
+  for (size_t i = 0; i < m_slots.size (); i++)
+    {
+      if (m_used[i])
+        result.push_back (m_slots[i]);
+    }
+
+  return result;
+}
+
+size_t
+KeyIndex::find_unlocked (const i2p::data::Tag<32> &key) const
+{
+  const size_t mask = m_slots.size () - 1;
+  size_t slot = home (key, mask);
+
+  while (m_used[slot] && m_slots[slot] != key)
+    slot = (slot + 1) & mask;
+
+  return slot;
+}
+
+void
+KeyIndex::resize_unlocked (size_t capacity)
+{
+  std::vector<i2p::data::Tag<32> > old_slots (capacity);
+  std::vector<uint8_t> old_used (capacity, 0);
+  old_slots.swap (m_slots);
+  old_used.swap (m_used);
+
+  const size_t mask = capacity - 1;
+  for (size_t i = 0; i < old_slots.size (); i++)
+    {
+      if (!old_used[i])
+        continue;
+
+      size_t slot = home (old_slots[i], mask);
+      while (m_used[slot])
+        slot = (slot + 1) & mask;
+
+      m_slots[slot] = old_slots[i];
+      m_used[slot] = 1;
+    }
+
+  rebuild_bloom_unlocked ();
+}
+
+void
+KeyIndex::rebuild_bloom_unlocked ()
+{
+  size_t max_keys = m_slots.size () * KEY_INDEX_MAX_LOAD_PERCENT / 100;
+  size_t words = (max_keys * KEY_INDEX_BLOOM_BITS_PER_KEY + 63) / 64;
+
+  m_bloom.assign (words, 0);
+  m_bloom_stale = 0;
+
+  for (size_t i = 0; i < m_slots.size (); i++)
+    {
+      if (m_used[i])
+        bloom_add_unlocked (m_slots[i]);
+    }
+}
+
+void
+KeyIndex::bloom_add_unlocked (const i2p::data::Tag<32> &key)
+{
+  const size_t bits = m_bloom.size () * 64;
+  uint64_t h1 = hash (key, 1), h2 = hash (key, 2) | 1;
+
+  for (int i = 0; i < KEY_INDEX_BLOOM_HASHES; i++)
+    {
+      size_t bit = (h1 + i * h2) % bits;
+      m_bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+bool
+KeyIndex::bloom_check_unlocked (const i2p::data::Tag<32> &key) const
+{
+  const size_t bits = m_bloom.size () * 64;
+  uint64_t h1 = hash (key, 1), h2 = hash (key, 2) | 1;
+
+  for (int i = 0; i < KEY_INDEX_BLOOM_HASHES; i++)
+    {
+      size_t bit = (h1 + i * h2) % bits;
+      if (!(m_bloom[bit / 64] & ((uint64_t)1 << (bit % 64))))
+        return false;
+    }
+
+  return true;
+}
+
+uint64_t
+KeyIndex::hash (const i2p::data::Tag<32> &key, int n)
+{
+  static const std::array<uint64_t, 3> seeds = random_seeds ();
+
+  /// Multiply-xorshift rounds, every bit of key affects every bit of hash
+  uint64_t x = seeds[n];
+  for (int i = 0; i < 4; i++)
+    {
+      x ^= key.GetLL ()[i];
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdULL;
+      x ^= x >> 33;
+      x *= 0xc4ceb9fe1a85ec53ULL;
+      x ^= x >> 33;
+    }
+
+  return x;
+}
+
+} // namespace kademlia
+} // namespace pbote
@@ -0,0 +1,88 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_KEY_INDEX_H_
+#define PBOTED_SRC_KEY_INDEX_H_
+
+#include <cstdint>
+#include <shared_mutex>
+#include <vector>
+
+// libi2pd
+#include "Tag.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+/// Initial number of slots, must be power of two
+#define KEY_INDEX_MIN_CAPACITY 1024
+/// Table grows when it's filled more
+#define KEY_INDEX_MAX_LOAD_PERCENT 70
+/// About 1% of false positives
+#define KEY_INDEX_BLOOM_BITS_PER_KEY 10
+#define KEY_INDEX_BLOOM_HASHES 7
+
+/**
+ * @brief Set of stored DHT keys
+ *
+ * Keys are kept in open-addressing table with linear probing.
+ * Bloom filter in front of it answers most misses without probing.
+ * Removed keys stay in filter until it's rebuilt, that happens when
+ * table grows or when there are too many of them.
+ *
+ * Keys come from peers, so they are mixed with random per-process seed
+ * before use, otherwise peer could put all its keys in one probe cluster.
+ */
+class KeyIndex
+{
+ public:
+  KeyIndex ();
+
+  /// False if key is already there
+  bool insert (const i2p::data::Tag<32> &key);
+  /// False if there was no key
+  bool erase (const i2p::data::Tag<32> &key);
+  bool contains (const i2p::data::Tag<32> &key) const;
+
+  void clear ();
+  size_t size () const;
+  std::vector<i2p::data::Tag<32> > keys () const;
+
+ private:
+  /// Slot with key or empty slot where it should be placed
+  size_t find_unlocked (const i2p::data::Tag<32> &key) const;
+  void resize_unlocked (size_t capacity);
+  void rebuild_bloom_unlocked ();
+  void bloom_add_unlocked (const i2p::data::Tag<32> &key);
+  bool bloom_check_unlocked (const i2p::data::Tag<32> &key) const;
+
+  /// Seeded hash of whole key, n selects one of independent seeds
+  static uint64_t hash (const i2p::data::Tag<32> &key, int n);
+
+  static size_t
+  home (const i2p::data::Tag<32> &key, size_t mask)
+  {
+    return hash (key, 0) & mask;
+  }
+
+  mutable std::shared_mutex m_mutex;
+  std::vector<i2p::data::Tag<32> > m_slots;
+  std::vector<uint8_t> m_used;
+  size_t m_size;
+
+  std::vector<uint64_t> m_bloom;
+  /// Removed keys which are still set in filter
+  size_t m_bloom_stale;
+};
+
+} // namespace kademlia
+} // namespace pbote
+
+#endif // PBOTED_SRC_KEY_INDEX_H_
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <utility>
 
+#include "ConfigParser.h"
 #include "NetworkWorker.h"
 
 namespace pbote
@@ -63,6 +64,21 @@ UDPReceiver::UDPReceiver (const std::string &address, int port)
            + ":" + decimal_port + "\", errcode=" + gai_strerror (errcode))
               .c_str ());
     }
+
+  m_recv_slots.resize (UDP_BATCH_SIZE);
+  m_recv_msgs.resize (UDP_BATCH_SIZE);
+  m_recv_iovecs.resize (UDP_BATCH_SIZE);
+
+  for (size_t i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+      m_recv_slots[i].resize (DATAGRAM_BUFFER_SIZE);
+      m_recv_iovecs[i].iov_base = m_recv_slots[i].data ();
+      m_recv_iovecs[i].iov_len = MAX_DATAGRAM_SIZE;
+
+      memset (&m_recv_msgs[i], 0, sizeof (struct mmsghdr));
+      m_recv_msgs[i].msg_hdr.msg_iov = &m_recv_iovecs[i];
+      m_recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 }
 
 UDPReceiver::~UDPReceiver ()
@@ -118,62 +134,92 @@ UDPReceiver::run ()
     }
 }
 
-ssize_t
+int
 UDPReceiver::recv ()
 {
-  return ::recv (f_socket, UDP_recv_buffer, MAX_DATAGRAM_SIZE, 0);
+  /// Block until first datagram and take all others already queued
+  return ::recvmmsg (f_socket, m_recv_msgs.data (), UDP_BATCH_SIZE,
+                     MSG_WAITFORONE, nullptr);
 }
 
 void
 UDPReceiver::handle_receive ()
 {
-  ssize_t bytes_transferred = recv ();
+  int received = recv ();
 
-  if (bytes_transferred < 1)
+  if (received < 1)
     {
-      if (bytes_transferred == 0)
-        {
-          LogPrint (eLogWarning, "Network: UDPReceiver: Zero-length datagram");
-          return;
-        }
-
       LogPrint (eLogError, "Network: UDPReceiver: Receive error: ", strerror(errno));
       return;
     }
 
+  std::vector<sp_queue_pkt> packets;
+  packets.reserve (received);
+
+  for (int i = 0; i < received; i++)
+    {
+      auto packet = handle_datagram (i, m_recv_msgs[i].msg_len);
+      if (packet)
+        packets.push_back (packet);
+    }
+
+  m_recvQueue->Put (packets);
+}
+
+sp_queue_pkt
+UDPReceiver::handle_datagram (size_t slot, size_t bytes_transferred)
+{
+  if (bytes_transferred == 0)
+    {
+      LogPrint (eLogWarning, "Network: UDPReceiver: Zero-length datagram");
+      return nullptr;
+    }
+
   /// Count total receive bytes
   context.add_recv_byte_count (bytes_transferred);
-  /// Terminating array
-  UDP_recv_buffer[bytes_transferred] = 0;
+
+  std::vector<uint8_t> &buf = m_recv_slots[slot];
   /// Get newline char position
-  char *eol = strchr ((char *)UDP_recv_buffer, '\n');
+  auto eol = (uint8_t *)memchr (buf.data (), '\n', bytes_transferred);
 
   if (!eol)
     {
       LogPrint (eLogWarning, "Network: UDPReceiver: Malformed datagram");
-      return;
+      return nullptr;
     }
 
-  *eol = 0;
-  eol++;
-  size_t payload_len = bytes_transferred - ((uint8_t *)eol - UDP_recv_buffer);
-  size_t dest_len = bytes_transferred - payload_len - 1;
+  size_t dest_len = eol - buf.data ();
+  size_t payload_len = bytes_transferred - dest_len - 1;
 
-  std::string dest (&UDP_recv_buffer[0], &UDP_recv_buffer[dest_len]);
+  /// Known senders are found without parsing of destination
+  auto dest = destinations ().intern (std::string ((char *)buf.data (),
+                                                   dest_len));
+  if (!dest)
+    {
+      LogPrint (eLogWarning, "Network: UDPReceiver: Bad sender destination");
+      return nullptr;
+    }
 
   LogPrint (eLogDebug, "Network: UDPReceiver: Datagram received, dest: ",
-            dest, ", size: ", payload_len);
+            dest->short_name (), ", size: ", payload_len);
+
+  /// Slot stays for the next datagram, packet keeps only its own bytes
+  const uint8_t *payload_begin = eol + 1;
+  std::vector<uint8_t> payload;
+  if (payload_len >= DATAGRAM_POOLED_MIN_SIZE)
+    payload = util::datagram_pool ().get ();
+
+  payload.assign (payload_begin, payload_begin + payload_len);
 
-  auto packet = std::make_shared<PacketForQueue> (dest, (uint8_t *)eol,
-                                                  payload_len);
-  m_recvQueue->Put (packet);
+  return std::make_shared<PacketForQueue> (std::move (dest),
+                                           std::move (payload));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
 UDPSender::UDPSender (const std::string &addr, int port)
-  : running_ (false), m_SendThread (nullptr), f_port (port),
-    f_addr (addr), m_sendQueue (nullptr)
+  : running_ (false), m_SendThread (nullptr), m_containers (false),
+    f_port (port), f_addr (addr), m_sendQueue (nullptr)
 {
   // ToDo: restart on error
   int errcode;
@@ -231,6 +277,16 @@ UDPSender::start ()
       m_SendThread = nullptr;
     }
 
+  if (m_sendQueue)
+    m_sendQueue->Open ();
+
+  pbote::config::GetOption ("containers", m_containers);
+
+  uint16_t rate = SEND_RATE, peer_rate = SEND_PEER_RATE;
+  pbote::config::GetOption ("sendrate", rate);
+  pbote::config::GetOption ("sendpeerrate", peer_rate);
+  m_scheduler.set_rates (rate, peer_rate);
+
   running_ = true;
   m_SendThread = new std::thread ([this] { run (); });
 }
@@ -240,6 +296,10 @@ UDPSender::stop ()
 {
   running_ = false;
 
+  /// Sender thread sleeps on empty queue until it's closed
+  if (m_sendQueue)
+    m_sendQueue->Close ();
+
   if (m_SendThread)
     {
       m_SendThread->join ();
@@ -265,35 +325,186 @@ UDPSender::run ()
 void
 UDPSender::send ()
 {
-  auto packet = m_sendQueue->GetNextWithTimeout (UDP_SEND_TIMEOUT);
+  std::vector<sp_queue_pkt> packets;
+  packets.reserve (UDP_QUEUE_BULK_SIZE);
+
+  /// Sleep on queue only while nothing waits for its turn
+  if (m_scheduler.empty ())
+    m_sendQueue->GetBulk (packets, UDP_QUEUE_BULK_SIZE);
+  else
+    m_sendQueue->GetBulk (packets, UDP_QUEUE_BULK_SIZE,
+                          m_scheduler.delay ());
 
-  if (!packet)
+  for (auto &packet : packets)
+    m_scheduler.push (std::move (packet));
+
+  packets.clear ();
+  if (m_scheduler.pop (packets, UDP_BATCH_SIZE) == 0)
     return;
 
+  if (m_streams)
+    {
+      std::vector<sp_queue_pkt> datagrams;
+      datagrams.reserve (packets.size ());
+
+      /// Large packets go through streams, if peer takes them
+      for (auto &packet : packets)
+        if (!m_streams->send (packet))
+          datagrams.push_back (std::move (packet));
+
+      packets = std::move (datagrams);
+      if (packets.empty ())
+        return;
+    }
+
+  if (m_containers)
+    coalesce (packets);
+
   check_session();
 
-  std::string payload (packet->payload.begin (), packet->payload.end ());
-  std::string message
-      = SAM::Message::datagramSend (m_sessionID_, packet->destination);
-  message.append (payload);
+  if (m_headers_session_id != m_sessionID_
+      || m_sam_headers.size () > SAM_HEADER_CACHE_SIZE)
+    {
+      m_sam_headers.clear ();
+      m_headers_session_id = m_sessionID_;
+    }
 
-  ssize_t bytes_transferred
-      = sendto (f_socket, message.c_str (), message.size (), 0,
-                f_addrinfo->ai_addr, f_addrinfo->ai_addrlen);
+  /// Header and payload are sent as is, without copying to one buffer
+  std::vector<struct iovec> iovecs (packets.size () * 2);
+  std::vector<struct mmsghdr> msgs (packets.size ());
 
-  if (bytes_transferred < 1)
+  for (size_t i = 0; i < packets.size (); i++)
     {
-      if (bytes_transferred == 0)
+      const std::string &header = sam_header (packets[i]->destination);
+
+      iovecs[i * 2].iov_base = (void *)header.data ();
+      iovecs[i * 2].iov_len = header.size ();
+      iovecs[i * 2 + 1].iov_base = packets[i]->payload.data ();
+      iovecs[i * 2 + 1].iov_len = packets[i]->payload.size ();
+
+      memset (&msgs[i], 0, sizeof (struct mmsghdr));
+      msgs[i].msg_hdr.msg_name = f_addrinfo->ai_addr;
+      msgs[i].msg_hdr.msg_namelen = f_addrinfo->ai_addrlen;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i * 2];
+      msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+  size_t sent = 0;
+  while (sent < msgs.size ())
+    {
+      int count = sendmmsg (f_socket, msgs.data () + sent,
+                            msgs.size () - sent, 0);
+
+      /// Failed datagram is skipped, the rest are sent with next call
+      if (count < 1)
         {
-          LogPrint (eLogWarning, "Network: UDPSender: Zero-length datagram");
-          return;
+          LogPrint (eLogError, "Network: UDPSender: Send error: ",
+                    strerror(errno));
+          sent++;
+          continue;
         }
 
-      LogPrint (eLogError, "Network: UDPSender: Send error: ", strerror(errno));
-      return;
+      for (int i = 0; i < count; i++)
+        context.add_sent_byte_count (msgs[sent + i].msg_len);
+
+      sent += count;
     }
+}
 
-  context.add_sent_byte_count (bytes_transferred);
+const std::string &
+UDPSender::sam_header (const sp_destination &destination)
+{
+  auto header_itr = m_sam_headers.find (destination->hash);
+  if (header_itr != m_sam_headers.end ())
+    return header_itr->second;
+
+  auto header = SAM::Message::datagramSend (m_sessionID_, destination->base64);
+  return m_sam_headers.emplace (destination->hash, header).first->second;
+}
+
+void
+UDPSender::coalesce (std::vector<sp_queue_pkt> &packets)
+{
+  std::vector<sp_queue_pkt> result;
+  /// Small packets of destination and position of their container
+  std::unordered_map<const Destination *,
+                     std::pair<size_t, std::vector<sp_queue_pkt> > > groups;
+
+  for (auto &packet : packets)
+    {
+      const auto &destination = packet->destination;
+
+      /// Peer can't know about our containers before the first one
+      bool announce = false;
+      bool support = destinations ().container_support (destination->hash,
+                                                        announce);
+      if (announce)
+        result.push_back (std::make_shared<PacketForQueue> (
+            destination, makeContainerPacket ({})));
+
+      if (!support || packet->payload.size () > CONTAINER_PACKET_MAX_SIZE)
+        {
+          result.push_back (std::move (packet));
+          continue;
+        }
+
+      auto group_itr = groups.find (destination.get ());
+      if (group_itr == groups.end ())
+        {
+          std::vector<sp_queue_pkt> group_packets;
+          group_itr = groups.emplace (destination.get (),
+                                      std::make_pair (result.size (),
+                                                      group_packets)).first;
+          result.push_back (packet);
+        }
+
+      group_itr->second.second.push_back (std::move (packet));
+    }
+
+  size_t coalesced = 0;
+  for (auto &group : groups)
+    {
+      auto &group_packets = group.second.second;
+      if (group_packets.size () < 2)
+        continue;
+
+      /// Group can take more than one container
+      std::vector<sp_queue_pkt> containers;
+      std::vector<sp_queue_pkt> chunk;
+      size_t chunk_size = CONTAINER_HEADER_LEN;
+
+      for (auto &packet : group_packets)
+        {
+          size_t packet_size = packet->payload.size () + 2;
+          if (!chunk.empty ()
+              && (chunk_size + packet_size > CONTAINER_MAX_SIZE
+                  || chunk.size () >= CONTAINER_MAX_COUNT))
+            {
+              containers.push_back (std::make_shared<PacketForQueue> (
+                  packet->destination, makeContainerPacket (chunk)));
+              chunk.clear ();
+              chunk_size = CONTAINER_HEADER_LEN;
+            }
+
+          chunk.push_back (packet);
+          chunk_size += packet_size;
+        }
+
+      containers.push_back (std::make_shared<PacketForQueue> (
+          chunk.front ()->destination, makeContainerPacket (chunk)));
+
+      coalesced += group_packets.size () - containers.size ();
+
+      /// First container takes place of the first packet
+      result[group.second.first] = containers.front ();
+      result.insert (result.end (), containers.begin () + 1, containers.end ());
+    }
+
+  if (coalesced > 0)
+    LogPrint (eLogDebug, "Network: UDPSender: Coalesced datagrams: ",
+              coalesced);
+
+  packets = std::move (result);
 }
 
 void
@@ -311,7 +522,8 @@ UDPSender::check_session()
 NetworkWorker::NetworkWorker ()
   : listenPortUDP_ (0), routerPortTCP_ (0), routerPortUDP_ (0),
     router_session_ (nullptr), m_RecvHandler (nullptr),
-    m_SendHandler (nullptr), m_recvQueue (nullptr), m_sendQueue (nullptr)
+    m_SendHandler (nullptr), m_streams (nullptr), m_recvQueue (nullptr),
+    m_sendQueue (nullptr)
 {
 }
 
@@ -322,6 +534,7 @@ NetworkWorker::~NetworkWorker ()
   router_session_ = nullptr;
   m_RecvHandler = nullptr;
   m_SendHandler = nullptr;
+  m_streams = nullptr;
 }
 
 void
@@ -386,6 +599,18 @@ NetworkWorker::start ()
       m_SendHandler->set_sam_session (router_session_);
       m_SendHandler->setSessionID (
           const_cast<std::string &> (router_session_->getSessionID ()));
+
+      bool streams = false;
+      pbote::config::GetOption ("streams", streams);
+      if (streams)
+        {
+          m_streams = std::make_shared<StreamTransport> (routerAddress_,
+                                                         routerPortTCP_);
+          m_streams->setQueues (m_recvQueue, m_sendQueue);
+          m_streams->start (router_session_->getSessionID ());
+          m_SendHandler->set_streams (m_streams);
+        }
+
       m_SendHandler->start ();
 
       LogPrint (eLogInfo, "Network: SAM session started");
@@ -402,6 +627,9 @@ NetworkWorker::stop ()
   m_RecvHandler->stop ();
   m_SendHandler->stop ();
 
+  if (m_streams)
+    m_streams->stop ();
+
   // ToDo: Close SAM session
 
   LogPrint (eLogInfo, "Network: Stopped");
@@ -416,6 +644,11 @@ NetworkWorker::running ()
             recv_run ? "true" : "false");
   LogPrint (send_run ? eLogDebug : eLogError, "Network: UDPSender: running: ",
             send_run ? "true" : "false");
+
+  if (m_streams)
+    LogPrint (eLogDebug, "Network: StreamTransport: running: ",
+              m_streams->running () ? "true" : "false", ", streams: ",
+              m_streams->connections ());
 }
 
 std::shared_ptr<i2p::data::PrivateKeys>
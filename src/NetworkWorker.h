@@ -17,12 +17,18 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "BoteContext.h"
+#include "BufferPool.h"
 #include "Logging.h"
 #include "Queue.h"
 
+#include "SendScheduler.h"
+#include "StreamTransport.h"
 #include "i2psam.h"
 
 namespace pbote
@@ -30,10 +36,14 @@ namespace pbote
 namespace network
 {
 
-/// Timeout in msec
-#define UDP_SEND_TIMEOUT 500
 /// 32 KiB
 #define MAX_DATAGRAM_SIZE 32768
+/// Max. number of datagrams received or sent with one syscall
+#define UDP_BATCH_SIZE 32
+/// Max. number of datagrams taken from send queue at once
+#define UDP_QUEUE_BULK_SIZE 128
+/// Max. number of cached SAM datagram headers
+#define SAM_HEADER_CACHE_SIZE 4096
 
 #define SAM_DEFAULT_NICKNAME "pboted"
 
@@ -90,8 +100,9 @@ public:
 
 private:
   void run ();
-  ssize_t recv ();
+  int recv ();
   void handle_receive ();
+  sp_queue_pkt handle_datagram (size_t slot, size_t len);
 
   bool running_;
   std::thread *m_RecvThread;
@@ -101,7 +112,11 @@ private:
   std::string f_addr;
   struct addrinfo *f_addrinfo{};
 
-  uint8_t UDP_recv_buffer[MAX_DATAGRAM_SIZE + 1] = {0};
+  /// UDP_BATCH_SIZE buffers for recvmmsg, payload of valid datagram is
+  /// copied to buffer of its size or to pooled one if it's large
+  std::vector<std::vector<uint8_t> > m_recv_slots;
+  std::vector<struct mmsghdr> m_recv_msgs;
+  std::vector<struct iovec> m_recv_iovecs;
   queue_type m_recvQueue;
 };
 
@@ -138,6 +153,12 @@ public:
     sam_session = session;
   };
 
+  void
+  set_streams (std::shared_ptr<StreamTransport> streams)
+  {
+    m_streams = streams;
+  };
+
   int
   get_socket () const
   {
@@ -162,11 +183,19 @@ public:
     return running_;
   };
 
+  size_t
+  dropped () const
+  {
+    return m_scheduler.dropped ();
+  };
+
 private:
   void run ();
   void send ();
 
   void check_session();
+  const std::string &sam_header (const sp_destination &destination);
+  void coalesce (std::vector<sp_queue_pkt> &packets);
 
   bool running_;
   std::thread *m_SendThread;
@@ -175,6 +204,17 @@ private:
 
   std::shared_ptr<SAM::DatagramSession> sam_session;
 
+  /// SAM datagram header by destination, valid for one session only
+  std::unordered_map<i2p::data::IdentHash, std::string> m_sam_headers;
+  std::string m_headers_session_id;
+
+  /// Datagrams taken from queue and waiting for their turn
+  SendScheduler m_scheduler;
+  /// Small packets to one destination are sent in one container
+  bool m_containers;
+  /// Large packets are sent through streams, if enabled
+  std::shared_ptr<StreamTransport> m_streams;
+
   int f_socket;
   int f_port;
   std::string f_addr;
@@ -219,6 +259,7 @@ private:
 
   std::shared_ptr<UDPReceiver> m_RecvHandler;
   std::shared_ptr<UDPSender> m_SendHandler;
+  std::shared_ptr<StreamTransport> m_streams;
 
   queue_type m_recvQueue;
   queue_type m_sendQueue;
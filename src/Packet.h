@@ -13,6 +13,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -22,9 +23,12 @@
 #include <openssl/sha.h>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "BufferPool.h"
+#include "DestinationRegistry.h"
 #include "Logging.h"
 
 // libi2pd
@@ -37,6 +41,16 @@ namespace pbote
 /// prefix[4] + type[1] + ver[1] + cid[32] = 38
 #define COMM_DATA_LEN 38
 
+/// Container of communication packets to one destination
+/// prefix[4] + type[1] + ver[1] + count[1] = 7
+#define CONTAINER_HEADER_LEN 7
+#define CONTAINER_VERSION 1
+/// Only packets up to this size are put to container
+#define CONTAINER_PACKET_MAX_SIZE 2048
+/// Container is kept well below max. datagram size
+#define CONTAINER_MAX_SIZE 16384
+#define CONTAINER_MAX_COUNT 255
+
 //#define PACKET_ERROR_MALFORMED -1
 
 const std::array<std::uint8_t, 12> PACKET_TYPE{ 0x52, 0x4b, 0x46, 0x4e,
@@ -88,6 +102,8 @@ enum type : uint8_t
   CommD = 0x44, // email packet delete request
   CommX = 0x58, // index packet delete request
   CommF = 0x46, // find close peers
+  /// pboted extension, sent only to peers which sent container to us
+  CommB = 0x42, // container of communication packets
 };
 
 /**
@@ -124,23 +140,44 @@ statusToString (uint8_t status_code)
 
 struct PacketForQueue
 {
-  PacketForQueue (std::string destination, uint8_t *buf, size_t len)
+  PacketForQueue (sp_destination destination, uint8_t *buf, size_t len)
       : destination (std::move (destination)), payload (buf, buf + len)
   {
   }
-  std::string destination;
+
+  /// Takes buffer without copying
+  PacketForQueue (sp_destination destination, std::vector<uint8_t> &&buf)
+      : destination (std::move (destination)), payload (std::move (buf))
+  {
+  }
+
+  sp_destination destination;
   std::vector<uint8_t> payload;
 };
 
+/// Communication packet ID
+using cid_key = i2p::data::Tag<32>;
+
+/// Quorum value to wait for responses on every request of batch
+#define BATCH_QUORUM_ALL SIZE_MAX
+
 template <typename T> struct PacketBatch
 {
-  std::map<std::vector<uint8_t>, PacketForQueue> outgoingPackets;
+  using response_filter = std::function<bool (const std::shared_ptr<T> &)>;
+
+  std::unordered_map<cid_key, PacketForQueue> outgoingPackets;
   std::vector<std::shared_ptr<T> > incomingPackets;
+  /// Time of the first response for every answered request
+  std::unordered_map<cid_key, std::chrono::steady_clock::time_point> answered;
   std::mutex m_batchMutex;
-  std::condition_variable m_first, m_last;
+  std::condition_variable m_completed;
   std::string owner;
   size_t removed = 0;
 
+  /// Only accepted responses count towards quorum, all by default
+  response_filter m_filter;
+  size_t accepted = 0;
+
   bool
   operator== (const PacketBatch &other) const
   {
@@ -152,63 +189,92 @@ template <typename T> struct PacketBatch
                           other.incomingPackets.begin ());
   }
 
-  std::map<std::vector<uint8_t>, PacketForQueue>
+  std::unordered_map<cid_key, PacketForQueue>
   getPackets ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return outgoingPackets;
   }
 
   std::vector<std::shared_ptr<T> >
   getResponses ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return incomingPackets;
   }
 
   bool
-  contains (const std::vector<uint8_t> &id)
+  contains (const cid_key &id)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return outgoingPackets.find (id) != outgoingPackets.end ();
   }
 
+  bool
+  answeredAt (const cid_key &id, std::chrono::steady_clock::time_point &time)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    auto answered_itr = answered.find (id);
+    if (answered_itr == answered.end ())
+      return false;
+
+    time = answered_itr->second;
+    return true;
+  }
+
   size_t
   packetCount ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return outgoingPackets.size ();
   }
 
   size_t
   responseCount ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return incomingPackets.size ();
   }
 
   size_t
   remain ()
   {
-    size_t total_requests = packetCount () + removed;
-    return total_requests - responseCount ();
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return remain_unlocked ();
   }
 
   void
-  addPacket (const std::vector<uint8_t> &id, const PacketForQueue &packet)
+  addPacket (const cid_key &id, const PacketForQueue &packet)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     outgoingPackets.insert (
-        std::pair<std::vector<uint8_t>, PacketForQueue> (id, packet));
+        std::pair<cid_key, PacketForQueue> (id, packet));
   }
 
   void
-  removePacket (const std::vector<uint8_t> &cid)
+  removePacket (const cid_key &cid)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     if (outgoingPackets.erase (cid) > 0)
       removed++;
   }
 
+  /// Unlike removePacket, batch don't wait for abandoned request anymore
   void
-  removePacket (const std::string &to)
+  abandonPacket (const cid_key &cid)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    if (answered.find (cid) == answered.end ())
+      outgoingPackets.erase (cid);
+  }
+
+  void
+  removePacket (const sp_destination &to)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     for (auto it = outgoingPackets.begin(); it != outgoingPackets.end(); it++)
       {
-        if (it->second.destination == to)
+        if (it->second.destination->hash == to->hash)
           {
             outgoingPackets.erase (it->first);
             removed++;
@@ -217,52 +283,100 @@ template <typename T> struct PacketBatch
       }
   }
 
+  /// Must be set before batch is sent
   void
+  setFilter (response_filter filter)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    m_filter = std::move (filter);
+  }
+
+  bool
   addResponse (std::shared_ptr<T> packet)
   {
-    incomingPackets.push_back (packet);
+    {
+      std::unique_lock<std::mutex> lk (m_batchMutex);
+      cid_key cid (packet->cid);
+
+      /// Duplicates of retransmitted requests and late abandoned ones
+      if (outgoingPackets.find (cid) == outgoingPackets.end ()
+          || !answered.emplace (cid, std::chrono::steady_clock::now ()).second)
+        return false;
 
-    if (incomingPackets.size () == 1)
-      m_first.notify_one ();
+      incomingPackets.push_back (packet);
 
-    if (remain () == 0)
-      m_last.notify_one ();
+      if (!m_filter || m_filter (packet))
+        accepted++;
+    }
+
+    /// Waiters check the state under lock, so notify can't be missed
+    m_completed.notify_all ();
+
+    return true;
   }
 
   bool
-  waitFist (long timeout_sec)
+  quorumReached (size_t quorum)
   {
-    std::chrono::duration<long> timeout = std::chrono::seconds (timeout_sec);
     std::unique_lock<std::mutex> lk (m_batchMutex);
+    return accepted >= quorum || (quorum == BATCH_QUORUM_ALL && quorum_met (quorum));
+  }
 
-    auto status = m_first.wait_for (lk, timeout);
+  /**
+   * Wait until quorum of accepted responses, answers on all requests
+   * or deadline, whatever comes first
+   * @return true if quorum is reached
+   */
+  bool
+  waitQuorum (size_t quorum, std::chrono::milliseconds timeout)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
 
-    if (status == std::cv_status::no_timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " got first");
+    bool completed = m_completed.wait_for (
+        lk, timeout, [this, quorum] { return quorum_met (quorum); });
 
-    if (status == std::cv_status::timeout)
+    if (completed)
+      LogPrint (eLogDebug, "Packet: Batch ", owner, " got ", accepted, " of ",
+                quorum == BATCH_QUORUM_ALL ? outgoingPackets.size () : quorum);
+    else
       LogPrint (eLogDebug, "Packet: Batch ", owner, " timed out");
 
-    lk.unlock ();
-    return true;
+    return accepted >= quorum || (quorum == BATCH_QUORUM_ALL && completed);
   }
 
   bool
-  waitLast (long timeout_sec)
+  waitQuorum (size_t quorum, long timeout_sec)
   {
-    std::chrono::duration<long> timeout = std::chrono::seconds (timeout_sec);
-    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return waitQuorum (quorum, std::chrono::seconds (timeout_sec));
+  }
 
-    auto status = m_last.wait_for (lk, timeout);
+  bool
+  waitFist (long timeout_sec)
+  {
+    return waitQuorum (1, timeout_sec);
+  }
 
-    if (status == std::cv_status::no_timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " got last");
+  bool
+  waitLast (long timeout_sec)
+  {
+    return waitQuorum (BATCH_QUORUM_ALL, timeout_sec);
+  }
 
-    if (status == std::cv_status::timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " timed out");
+ private:
+  size_t
+  remain_unlocked ()
+  {
+    size_t total_requests = outgoingPackets.size () + removed;
+    if (incomingPackets.size () >= total_requests)
+      return 0;
 
-    lk.unlock ();
-    return true;
+    return total_requests - incomingPackets.size ();
+  }
+
+  bool
+  quorum_met (size_t quorum)
+  {
+    return accepted >= quorum || remain_unlocked () == 0;
   }
 };
 
@@ -716,9 +830,10 @@ public:
         if (dh_h == dv_h && key_cmp == 0)
           {
             LogPrint (eLogDebug, "Packet: I: erase_entry: DV: ", dv_h.ToBase64 ());
+            int32_t time = data[i].time;
             data.erase (data.begin () + i);
             nump = data.size ();
-            return data[i].time;
+            return time;
           }
       }
 
@@ -829,6 +944,11 @@ public:
 
     for (auto entry : data)
       {
+        uint32_t temp_time;
+        std::memcpy (&temp_time, &entry.time, 4);
+        temp_time = htonl (temp_time);
+        std::memcpy (&entry.time, &temp_time, 4);
+
         uint8_t arr[68];
         memcpy (arr, entry.key, 68);
         result.insert (result.end (), std::begin (arr), std::end (arr));
@@ -1061,11 +1181,22 @@ public:
   {
   }
 
+  CommunicationPacket (const CommunicationPacket &) = default;
+  CommunicationPacket (CommunicationPacket &&) = default;
+  CommunicationPacket &operator= (const CommunicationPacket &) = default;
+  CommunicationPacket &operator= (CommunicationPacket &&) = default;
+
+  /// Payload of received packet is a pooled datagram buffer
+  ~CommunicationPacket ()
+  {
+    util::datagram_pool ().put (std::move (payload));
+  }
+
   uint8_t prefix[4] = { 0x6D, 0x30, 0x52, 0xE9 };
   uint8_t type;
   uint8_t ver;
   uint8_t cid[32] = {0};
-  std::string from;
+  sp_destination from;
   std::vector<uint8_t> payload;
 };
 
@@ -1778,20 +1909,20 @@ parseCommPacket (const sp_queue_pkt &packet)
       return nullptr;
     }
 
-  CommunicationPacket data (CommA);
+  auto data = std::make_shared<CommunicationPacket> (CommA);
 
   /// Skipping prefix
   size_t offset = 4;
 
-  std::memcpy (&data.type, packet->payload.data () + offset, 1);
+  std::memcpy (&data->type, packet->payload.data () + offset, 1);
   offset += 1;
-  std::memcpy (&data.ver, packet->payload.data () + offset, 1);
+  std::memcpy (&data->ver, packet->payload.data () + offset, 1);
   offset += 1;
-  std::memcpy (&data.cid, packet->payload.data () + offset, 32);
+  std::memcpy (&data->cid, packet->payload.data () + offset, 32);
   offset += 32;
 
   auto found_type = std::find (std::begin (PACKET_TYPE),
-                               std::end (PACKET_TYPE), data.type);
+                               std::end (PACKET_TYPE), data->type);
   if (found_type == std::end (PACKET_TYPE))
     {
       LogPrint (eLogWarning, "Packet: Bad type");
@@ -1799,7 +1930,7 @@ parseCommPacket (const sp_queue_pkt &packet)
     }
 
   auto found_ver = std::find (std::begin (BOTE_VERSION),
-                              std::end (BOTE_VERSION), data.ver);
+                              std::end (BOTE_VERSION), data->ver);
   if (found_ver == std::end (BOTE_VERSION))
     {
       LogPrint (eLogWarning, "Packet: Bad version");
@@ -1813,11 +1944,93 @@ parseCommPacket (const sp_queue_pkt &packet)
       return nullptr;
     }
 
-  data.from = std::move (packet->destination);
-  data.payload = std::vector<uint8_t> (packet->payload.begin () + offset,
-                                       packet->payload.end ());
+  /// Packet buffer is reused, only header is cut off
+  data->from = std::move (packet->destination);
+  data->payload = std::move (packet->payload);
+  data->payload.erase (data->payload.begin (),
+                       data->payload.begin () + offset);
+
+  return data;
+}
+
+/// Container without packets announces that we can unpack containers
+inline std::vector<uint8_t>
+makeContainerPacket (const std::vector<sp_queue_pkt> &packets)
+{
+  std::vector<uint8_t> result (COMM_PREFIX.begin (), COMM_PREFIX.end ());
+  result.push_back (type::CommB);
+  result.push_back (CONTAINER_VERSION);
+  result.push_back ((uint8_t)packets.size ());
+
+  for (const auto &packet : packets)
+    {
+      uint16_t length = htons ((uint16_t)packet->payload.size ());
+      uint8_t *length_bytes = (uint8_t *)&length;
+      result.insert (result.end (), length_bytes, length_bytes + 2);
+      result.insert (result.end (), packet->payload.begin (),
+                     packet->payload.end ());
+    }
+
+  return result;
+}
+
+/// Marks sender as able to receive containers
+inline std::vector<sp_queue_pkt>
+parseContainerPacket (const sp_queue_pkt &packet)
+{
+  const auto &payload = packet->payload;
+
+  if (payload.size () < CONTAINER_HEADER_LEN
+      || memcmp (payload.data (), COMM_PREFIX.data (), 4) != 0
+      || payload[4] != type::CommB)
+    {
+      LogPrint (eLogWarning, "Packet: Container: Bad header");
+      return {};
+    }
+
+  if (payload[5] != CONTAINER_VERSION)
+    {
+      LogPrint (eLogWarning, "Packet: Container: Unsupported version: ",
+                unsigned (payload[5]));
+      return {};
+    }
+
+  if (packet->destination)
+    destinations ().set_container_support (packet->destination->hash);
+
+  std::vector<sp_queue_pkt> result;
+  size_t count = payload[6];
+  size_t offset = CONTAINER_HEADER_LEN;
+
+  for (size_t i = 0; i < count; i++)
+    {
+      if (offset + 2 > payload.size ())
+        break;
+
+      uint16_t length;
+      std::memcpy (&length, payload.data () + offset, 2);
+      length = ntohs (length);
+      offset += 2;
+
+      if (offset + length > payload.size ())
+        {
+          LogPrint (eLogWarning, "Packet: Container: Packet is too long");
+          break;
+        }
+
+      /// Nested containers are not allowed
+      if (length > 4 && payload[offset + 4] != type::CommB)
+        {
+          std::vector<uint8_t> inner (payload.begin () + offset,
+                                      payload.begin () + offset + length);
+          result.push_back (std::make_shared<PacketForQueue> (
+              packet->destination, std::move (inner)));
+        }
+
+      offset += length;
+    }
 
-  return std::make_shared<CommunicationPacket> (data);
+  return result;
 }
 
 } // namespace pbote
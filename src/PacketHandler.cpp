@@ -6,8 +6,10 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <algorithm>
 #include <random>
 
+#include "ConfigParser.h"
 #include "DHTworker.h"
 #include "PacketHandler.h"
 #include "RelayWorker.h"
@@ -19,7 +21,8 @@ namespace packet
 
 RequestHandler packet_handler;
 
-IncomingRequest::IncomingRequest (RequestHandler &owner) : m_owner (owner)
+IncomingRequest::IncomingRequest (RequestHandler &owner)
+    : m_owner (owner), m_deferred (false)
 {
   // ToDo: re-make with std::function?
   i_handlers_[type::CommR] = &IncomingRequest::receiveRelayRequest;
@@ -37,22 +40,17 @@ IncomingRequest::IncomingRequest (RequestHandler &owner) : m_owner (owner)
 }
 
 bool
-IncomingRequest::handleNewPacket (const sp_queue_pkt &queuePacket)
+IncomingRequest::handleNewPacket (const sp_comm_pkt &packet)
 {
-  sp_comm_pkt packet = pbote::parseCommPacket (queuePacket);
-  if (!packet)
-    {
-      LogPrint (eLogWarning, "Packet: Can't parse packet");
-      return false;
-    }
+  m_deferred = false;
 
   /// First we need to check if ResponsePacket and CID in batches
   if (packet->type == type::CommN)
     {
+      /// Late and duplicated answers are dropped there too
       if (context.receive (packet))
         {
-          LogPrint (eLogDebug, "Packet: Pass packet ", packet->type,
-                    " to batch");
+          LogPrint (eLogDebug, "Packet: Response to our request handled");
           return true;
         }
     }
@@ -99,7 +97,7 @@ bool
 IncomingRequest::receiveResponsePkt (const sp_comm_pkt &packet)
 {
   LogPrint (eLogWarning, "Packet: Response: Unexpected Response received");
-  LogPrint (eLogWarning, "Packet: Response: Sender: ", packet->from);
+  LogPrint (eLogWarning, "Packet: Response: Sender: ", packet->from->base64);
 
   ResponsePacket response;
   bool parsed = response.from_comm_packet (*packet, true);
@@ -170,16 +168,12 @@ IncomingRequest::receivePeerListRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: PeerListRequest");
   if (packet->ver == 4)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::relay::RelayWorker::peerListRequestV4,
-                     &pbote::relay::relay_worker, packet));
+      pbote::relay::relay_worker.peerListRequestV4 (packet);
       return true;
     }
   else if (packet->ver == 5)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::relay::RelayWorker::peerListRequestV5,
-                     &pbote::relay::relay_worker, packet));
+      pbote::relay::relay_worker.peerListRequestV5 (packet);
       return true;
     }
   else
@@ -198,9 +192,9 @@ IncomingRequest::receiveRetrieveRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: RetrieveRequest");
   if (packet->ver >= 4 && packet->type == type::CommQ)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::kademlia::DHTworker::receiveRetrieveRequest,
-                     &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveRetrieveRequest);
+      m_deferred = true;
       return true;
     }
 
@@ -216,18 +210,18 @@ IncomingRequest::receiveDeletionQueryRequest (const sp_comm_pkt &packet)
   /// Y for mhatta
   if (packet->ver >= 4 && packet->type == type::CommY)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::kademlia::DHTworker::receiveDeletionQuery,
-                     &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveDeletionQuery);
+      m_deferred = true;
       return true;
     }
 
   /// L for str4d
   if (packet->ver >= 4 && packet->type == (uint8_t)'L')
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::kademlia::DHTworker::receiveDeletionQuery,
-                     &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveDeletionQuery);
+      m_deferred = true;
       return true;
     }
 
@@ -242,9 +236,9 @@ IncomingRequest::receiveStoreRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: StoreRequest");
   if (packet->ver >= 4 && packet->type == type::CommS)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::kademlia::DHTworker::receiveStoreRequest,
-                     &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveStoreRequest);
+      m_deferred = true;
       return true;
     }
 
@@ -259,9 +253,9 @@ IncomingRequest::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: EmailPacketDeleteRequest");
   if (packet->ver >= 4 && packet->type == type::CommD)
     {
-      m_owner.get_IO_service ().post (std::bind (
-          &pbote::kademlia::DHTworker::receiveEmailPacketDeleteRequest,
-          &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveEmailPacketDeleteRequest);
+      m_deferred = true;
       return true;
     }
 
@@ -277,9 +271,9 @@ IncomingRequest::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: IndexPacketDeleteRequest");
   if (packet->ver >= 4 && packet->type == type::CommX)
     {
-      m_owner.get_IO_service ().post (std::bind (
-          &pbote::kademlia::DHTworker::receiveIndexPacketDeleteRequest,
-          &pbote::kademlia::DHT_worker, packet));
+      m_owner.post_storage (
+          packet, &pbote::kademlia::DHTworker::receiveIndexPacketDeleteRequest);
+      m_deferred = true;
       return true;
     }
 
@@ -295,9 +289,7 @@ IncomingRequest::receiveFindClosePeersRequest (const sp_comm_pkt &packet)
   LogPrint (eLogDebug, "Packet: FindClosePeersRequest");
   if (packet->ver >= 4 && packet->type == type::CommF)
     {
-      m_owner.get_IO_service ().post (
-          std::bind (&pbote::kademlia::DHTworker::receiveFindClosePeers,
-                     &pbote::kademlia::DHT_worker, packet));
+      pbote::kademlia::DHT_worker.receiveFindClosePeers (packet);
       return true;
     }
 
@@ -308,54 +300,63 @@ IncomingRequest::receiveFindClosePeersRequest (const sp_comm_pkt &packet)
 }
 
 RequestHandler::RequestHandler ()
-    : running (false), m_PHandlerThread (nullptr),
-      m_IO_service_thread (nullptr), m_recvQueue (nullptr),
-      m_sendQueue (nullptr), m_IO_work (get_IO_service ())
+    : running (false), m_recvQueue (nullptr), m_sendQueue (nullptr)
 {
 }
 
 RequestHandler::~RequestHandler ()
 {
   stop ();
-
-  if (m_PHandlerThread)
-    {
-      m_PHandlerThread->join ();
-      m_PHandlerThread = nullptr;
-    }
 }
 
 void
 RequestHandler::start ()
 {
+  if (running)
+    return;
+
   m_recvQueue = context.getRecvQueue ();
   m_sendQueue = context.getSendQueue ();
+  m_recvQueue->Open ();
   running = true;
 
-  if (m_PHandlerThread)
-    m_PHandlerThread = nullptr;
+  uint16_t threads = 0;
+  pbote::config::GetOption ("threads", threads);
+
+  if (threads == 0)
+    threads = std::max (std::thread::hardware_concurrency (), 1U);
+
+  m_storage_service.restart ();
+  m_storage_work.reset (
+      new boost::asio::io_service::work (m_storage_service));
+
+  for (uint16_t i = 0; i < threads; i++)
+    m_handler_threads.emplace_back ([this] { run (); });
 
-  if (m_IO_service_thread)
-    m_IO_service_thread = nullptr;
+  m_storage_thread = std::thread ([this] { run_storage_service (); });
 
-  m_PHandlerThread.reset (
-      new std::thread (std::bind (&RequestHandler::run, this)));
-  m_IO_service_thread.reset (
-      new std::thread (std::bind (&RequestHandler::run_IO_service, this)));
+  LogPrint (eLogInfo, "PacketHandler: Threads: ", threads);
 }
 
 void
 RequestHandler::stop ()
 {
+  if (!running)
+    return;
+
   running = false;
 
-  m_IO_service.stop ();
+  /// Handler threads sleep on empty queue until it's closed
+  m_recvQueue->Close ();
 
-  if (m_IO_service_thread)
-    {
-      m_IO_service_thread->join ();
-      m_IO_service_thread = nullptr;
-    }
+  for (auto &thread : m_handler_threads)
+    thread.join ();
+  m_handler_threads.clear ();
+
+  /// Storage requests already accepted are finished before stop
+  m_storage_work.reset ();
+  if (m_storage_thread.joinable ())
+    m_storage_thread.join ();
 
   m_recvQueue = nullptr;
   m_sendQueue = nullptr;
@@ -368,49 +369,157 @@ RequestHandler::run ()
 {
   LogPrint (eLogInfo, "PacketHandler: Started");
 
+  IncomingRequest handler (*this);
+  std::vector<sp_queue_pkt> packets;
+  packets.reserve (PACKET_HANDLER_BULK_SIZE);
+
   while (running)
     {
-      auto packet = m_recvQueue->GetNextWithTimeout (PACKET_RECEIVE_TIMEOUT);
-
-      if (!packet)
+      packets.clear ();
+      if (m_recvQueue->GetBulk (packets, PACKET_HANDLER_BULK_SIZE) == 0)
         continue;
 
-      LogPrint (eLogDebug, "PacketHandler: Got new packet");
+      LogPrint (eLogDebug, "PacketHandler: Got ", packets.size (),
+                " new packet(s)");
 
-      IncomingRequest handler (*this);
-      /// If successful, we move on to processing the next packet
-      if (handler.handleNewPacket (packet))
-        continue;
+      /// Responses are waited by our requests, so they go first
+      auto requests = std::stable_partition (
+          packets.begin (), packets.end (), [] (const sp_queue_pkt &packet)
+          {
+            return packet->payload.size () > 4
+                   && packet->payload[4] == type::CommN;
+          });
+
+      for (auto itr = packets.begin (); itr != requests; ++itr)
+        handle (handler, *itr);
+
+      for (auto itr = requests; itr != packets.end (); ++itr)
+        handle (handler, *itr);
+    }
+}
+
+void
+RequestHandler::handle (IncomingRequest &handler,
+                        const sp_queue_pkt &queue_packet)
+{
+  /// Parsing takes payload from queue packet, so keep sender
+  sp_destination sender = queue_packet->destination;
+
+  /// Type is checked before parsing, so flood costs us as little as possible
+  uint8_t packet_type = 0;
+  if (queue_packet->payload.size () > 4)
+    packet_type = queue_packet->payload[4];
+
+  /// Every packet from container is checked as a separate one
+  if (packet_type == type::CommB)
+    {
+      for (const auto &inner : pbote::parseContainerPacket (queue_packet))
+        handle (handler, inner);
+      return;
+    }
 
-      LogPrint (eLogWarning, "PacketHandler: Parsing failed, skipped");
+  /// Only answers to our requests pass without charge
+  bool solicited = false;
+  if (packet_type == type::CommN
+      && queue_packet->payload.size () >= COMM_DATA_LEN)
+    solicited = context.expects (cid_key (queue_packet->payload.data () + 6));
 
-      pbote::ResponsePacket response;
-      response.status = pbote::StatusCode::INVALID_PACKET;
-      response.length = 0;
-      auto data = response.toByte ();
+  switch (m_admission.admit (sender, packet_type, solicited))
+    {
+    case Admission::accepted:
+      break;
+    case Admission::rejected:
+      LogPrint (eLogDebug, "PacketHandler: Request rejected, type: ",
+                packet_type, ", sender: ", sender->short_name ());
+      busy (queue_packet);
+      return;
+    case Admission::dropped:
+      return;
+    }
 
-      m_sendQueue->Put (std::make_shared<PacketForQueue> (
-          packet->destination, data.data (), data.size ()));
+  sp_comm_pkt packet = pbote::parseCommPacket (queue_packet);
+  if (!packet)
+    {
+      LogPrint (eLogWarning, "PacketHandler: Can't parse packet");
+      m_admission.release (packet_type);
+      if (packet_type != type::CommN)
+        invalid (sender);
+      return;
     }
+
+  /// If successful, we move on to processing the next packet
+  bool handled = handler.handleNewPacket (packet);
+  if (!handler.deferred ())
+    m_admission.release (packet_type);
+
+  if (handled)
+    return;
+
+  LogPrint (eLogWarning, "PacketHandler: Parsing failed, skipped");
+
+  /// Responses are never answered, they can be spoofed to reflect traffic
+  if (packet_type != type::CommN)
+    invalid (sender);
 }
 
 void
-RequestHandler::run_IO_service ()
+RequestHandler::post_storage (const sp_comm_pkt &packet,
+                              void (kademlia::DHTworker::*handler) (
+                                  const sp_comm_pkt &))
 {
-  while (running)
+  m_storage_service.post ([this, packet, handler] ()
     {
-      std::this_thread::sleep_for (std::chrono::seconds (2));
+      (pbote::kademlia::DHT_worker.*handler) (packet);
+      m_admission.release (packet->type);
+    });
+}
 
+void
+RequestHandler::invalid (const sp_destination &destination)
+{
+  if (!destination)
+    return;
+
+  pbote::ResponsePacket response;
+  response.status = pbote::StatusCode::INVALID_PACKET;
+  response.length = 0;
+  auto data = response.toByte ();
+
+  m_sendQueue->Put (std::make_shared<PacketForQueue> (
+      destination, data.data (), data.size ()));
+}
+
+void
+RequestHandler::busy (const sp_queue_pkt &queue_packet)
+{
+  /// Sender can match response to request only by CID
+  pbote::ResponsePacket response;
+  if (queue_packet->payload.size () >= COMM_DATA_LEN)
+    memcpy (response.cid, queue_packet->payload.data () + 6, 32);
+
+  response.status = pbote::StatusCode::GENERAL_ERROR;
+  response.length = 0;
+  auto data = response.toByte ();
+
+  m_sendQueue->Put (std::make_shared<PacketForQueue> (
+      queue_packet->destination, data.data (), data.size ()));
+}
+
+void
+RequestHandler::run_storage_service ()
+{
+  /// Runs until work guard is released on stop
+  while (true)
+    {
       try
         {
-          size_t executed = m_IO_service.run ();
-          if (executed > 0)
-            LogPrint (eLogDebug,
-                      "PacketHandler: IO service round results: ", executed);
+          m_storage_service.run ();
+          return;
         }
       catch (std::exception &ex)
         {
-          LogPrint (eLogError, "PacketHandler: IO service runtime exception: ",
+          LogPrint (eLogError,
+                    "PacketHandler: Storage service runtime exception: ",
                     ex.what ());
         }
     }
@@ -9,6 +9,7 @@
 #ifndef PACKET_HANDLER_H__
 #define PACKET_HANDLER_H__
 
+#include <atomic>
 #include <boost/asio.hpp>
 #include <cstdint>
 #include <functional>
@@ -19,17 +20,24 @@
 #include <string>
 #include <thread>
 #include <tuple>
+#include <vector>
 
+#include "AdmissionControl.h"
 #include "Logging.h"
 #include "Packet.h"
 
 namespace pbote
 {
+namespace kademlia
+{
+class DHTworker;
+} // namespace kademlia
+
 namespace packet
 {
 
-/// Timeout in msec
-#define PACKET_RECEIVE_TIMEOUT 500
+/// Max. number of packets taken from receive queue at once
+#define PACKET_HANDLER_BULK_SIZE 32
 
 class IncomingRequest;
 class RequestHandler;
@@ -44,7 +52,9 @@ class IncomingRequest
 public:
   IncomingRequest (RequestHandler& owner);
 
-  bool handleNewPacket (const sp_queue_pkt &packet);
+  bool handleNewPacket (const sp_comm_pkt &packet);
+  /// Packet was passed to other thread and isn't handled yet
+  bool deferred () const { return m_deferred; }
 
 private:
   bool receiveRelayRequest (const sp_comm_pkt &packet);
@@ -62,6 +72,7 @@ private:
 
   incomingPacketHandler i_handlers_[256];
   RequestHandler& m_owner;
+  bool m_deferred;
 };
 
 class RequestHandler
@@ -73,10 +84,16 @@ public:
   void start ();
   void stop ();
 
-  boost::asio::io_service&
-  get_IO_service ()
+  /// Lane for requests which read or write local storage,
+  /// cheap requests are handled right on receiving threads
+  void post_storage (const sp_comm_pkt &packet,
+                     void (kademlia::DHTworker::*handler) (
+                         const sp_comm_pkt &));
+
+  const AdmissionControl &
+  admission () const
   {
-    return m_IO_service;
+    return m_admission;
   }
 
   bool
@@ -87,14 +104,21 @@ public:
 
 private:
   void run ();
-  void run_IO_service ();
-
-  bool running;
-  std::unique_ptr<std::thread> m_PHandlerThread, m_IO_service_thread;
+  void run_storage_service ();
+  void handle (IncomingRequest &handler, const sp_queue_pkt &queue_packet);
+  void invalid (const sp_destination &destination);
+  void busy (const sp_queue_pkt &queue_packet);
+
+  std::atomic<bool> running;
+  std::vector<std::thread> m_handler_threads;
+  /// DHT storage is not safe for parallel writes, so all requests
+  /// to it are served by one thread
+  std::thread m_storage_thread;
   queue_type m_recvQueue, m_sendQueue;
 
-  boost::asio::io_service m_IO_service;
-  boost::asio::io_service::work m_IO_work;
+  boost::asio::io_service m_storage_service;
+  std::unique_ptr<boost::asio::io_service::work> m_storage_work;
+  AdmissionControl m_admission;
 };
 
 extern RequestHandler packet_handler;
@@ -10,12 +10,21 @@
 #ifndef PBOTED_SRC_QUEUE_H__
 #define PBOTED_SRC_QUEUE_H__
 
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <cstdint>
 #include <cstring>
+#include <ctime>
 #include <functional>
+#include <linux/futex.h>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <sys/syscall.h>
 #include <thread>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
@@ -37,7 +46,7 @@ class Queue {
       std::unique_lock<std::mutex> l(m_QueueMutex);
       for (const auto &it : vec)
         m_Queue.push(std::move(it));
-      m_NonEmpty.notify_one();
+      m_NonEmpty.notify_all();
     }
   }
 
@@ -112,6 +121,316 @@ class Queue {
   std::condition_variable m_NonEmpty;
 };
 
+/// Default capacity of RingQueue, must be power of 2
+#define RING_QUEUE_CAPACITY 4096
+
+/**
+ * Bounded lock-free MPMC queue.
+ *
+ * Every cell has a sequence number which tells whether cell is free for
+ * producer or ready for consumer at given position, so producers and
+ * consumers only race on head/tail counters. Bulk operations claim a run of
+ * cells with one CAS. Blocked threads sleep on futex and are woken only
+ * when there is something to do, or when queue is closed.
+ */
+template<typename Element>
+class RingQueue {
+ public:
+  explicit RingQueue(size_t capacity = RING_QUEUE_CAPACITY)
+      : m_Mask(RoundUp(capacity) - 1),
+        m_Cells(new Cell[m_Mask + 1]),
+        m_Head(0), m_Tail(0), m_HighWatermark(0),
+        m_PutEpoch(0), m_GetEpoch(0), m_Closed(false),
+        m_WaitingConsumers(0), m_WaitingProducers(0) {
+    for (size_t i = 0; i <= m_Mask; i++)
+      m_Cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  RingQueue(const RingQueue &) = delete;
+  RingQueue &operator=(const RingQueue &) = delete;
+
+  /// Wait while queue is full, false if queue was closed
+  bool Put(Element e) {
+    while (!TryPut(e)) {
+      if (IsClosed())
+        return false;
+      WaitFor(m_GetEpoch, m_WaitingProducers, [this] { return HasFree(); });
+    }
+    return true;
+  }
+
+  template<template<typename, typename...> class Container, typename... R>
+  bool Put(const Container<Element, R...> &vec) {
+    auto it = vec.begin();
+    while (it != vec.end()) {
+      if (PutBulk(it, vec.end()) > 0)
+        continue;
+      if (IsClosed())
+        return false;
+      WaitFor(m_GetEpoch, m_WaitingProducers, [this] { return HasFree(); });
+    }
+    return true;
+  }
+
+  bool TryPut(Element &e) {
+    size_t pos = m_Tail.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+      cell = &m_Cells[pos & m_Mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (m_Tail.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = m_Tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = std::move(e);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    Published(pos + 1);
+    return true;
+  }
+
+  /// Wait until element is available, nullptr if queue was closed
+  Element GetNext() {
+    Element el = Get();
+    if (!el && WaitFor(m_PutEpoch, m_WaitingConsumers,
+                       [this] { return HasReady(); }))
+      el = Get();
+    return el;
+  }
+
+  /// Take up to max elements at once, wait if queue is empty
+  size_t GetBulk(std::vector<Element> &out, size_t max) {
+    size_t count = TakeBulk(out, max);
+    if (count == 0 && WaitFor(m_PutEpoch, m_WaitingConsumers,
+                              [this] { return HasReady(); }))
+      count = TakeBulk(out, max);
+    return count;
+  }
+
+  /// Same, but wait no longer than timeout, zero timeout doesn't wait
+  size_t GetBulk(std::vector<Element> &out, size_t max,
+                 std::chrono::milliseconds timeout) {
+    size_t count = TakeBulk(out, max);
+    if (count > 0 || timeout.count() <= 0)
+      return count;
+
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+    if (WaitFor(m_PutEpoch, m_WaitingConsumers,
+                [this] { return HasReady(); }, &ts))
+      count = TakeBulk(out, max);
+    return count;
+  }
+
+  Element Get() {
+    size_t pos = m_Head.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+      cell = &m_Cells[pos & m_Mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (m_Head.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return nullptr;
+      } else {
+        pos = m_Head.load(std::memory_order_relaxed);
+      }
+    }
+
+    Element el = std::move(cell->data);
+    cell->data = nullptr;
+    cell->seq.store(pos + m_Mask + 1, std::memory_order_release);
+    Consumed();
+    return el;
+  }
+
+  bool IsEmpty() const { return GetSize() == 0; }
+  bool IsFull() const { return GetSize() > m_Mask; }
+
+  /// Approximate number of elements, exact when queue is idle
+  size_t GetSize() const {
+    size_t head = m_Head.load(std::memory_order_acquire);
+    size_t tail = m_Tail.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t GetCapacity() const { return m_Mask + 1; }
+  size_t GetHighWatermark() const {
+    return m_HighWatermark.load(std::memory_order_relaxed);
+  }
+
+  /// Release blocked threads and don't block anymore, used on shutdown
+  void Close() {
+    m_Closed.store(true);
+    m_PutEpoch.fetch_add(1);
+    m_GetEpoch.fetch_add(1);
+    FutexWake(m_PutEpoch);
+    FutexWake(m_GetEpoch);
+  }
+
+  void Open() { m_Closed.store(false); }
+  bool IsClosed() const { return m_Closed.load(); }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    Element data;
+  };
+
+  bool HasReady() const {
+    size_t pos = m_Head.load(std::memory_order_acquire);
+    return m_Cells[pos & m_Mask].seq.load(std::memory_order_acquire) ==
+        pos + 1;
+  }
+
+  bool HasFree() const {
+    size_t pos = m_Tail.load(std::memory_order_acquire);
+    return m_Cells[pos & m_Mask].seq.load(std::memory_order_acquire) == pos;
+  }
+
+  static size_t RoundUp(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    return size;
+  }
+
+  /// Claim run of free cells with one CAS
+  template<typename Iterator>
+  size_t PutBulk(Iterator &it, const Iterator &end) {
+    size_t pos = m_Tail.load(std::memory_order_relaxed);
+    size_t count;
+    for (;;) {
+      count = 0;
+      for (auto next = it; next != end; ++next, count++) {
+        size_t seq = m_Cells[(pos + count) & m_Mask].seq.load(
+            std::memory_order_acquire);
+        if (seq != pos + count)
+          break;
+      }
+      if (count == 0) {
+        size_t seq = m_Cells[pos & m_Mask].seq.load(std::memory_order_acquire);
+        /// Queue is full
+        if ((intptr_t)seq - (intptr_t)pos < 0)
+          return 0;
+        pos = m_Tail.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (m_Tail.compare_exchange_weak(pos, pos + count,
+                                       std::memory_order_relaxed))
+        break;
+    }
+
+    for (size_t i = 0; i < count; i++, ++it) {
+      Cell &cell = m_Cells[(pos + i) & m_Mask];
+      cell.data = *it;
+      cell.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    Published(pos + count);
+    return count;
+  }
+
+  /// Claim run of ready cells with one CAS
+  size_t TakeBulk(std::vector<Element> &out, size_t max) {
+    size_t pos = m_Head.load(std::memory_order_relaxed);
+    size_t count;
+    for (;;) {
+      count = 0;
+      while (count < max) {
+        size_t seq = m_Cells[(pos + count) & m_Mask].seq.load(
+            std::memory_order_acquire);
+        if (seq != pos + count + 1)
+          break;
+        count++;
+      }
+      if (count == 0) {
+        size_t seq = m_Cells[pos & m_Mask].seq.load(std::memory_order_acquire);
+        /// Queue is empty
+        if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+          return 0;
+        pos = m_Head.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (m_Head.compare_exchange_weak(pos, pos + count,
+                                       std::memory_order_relaxed))
+        break;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      Cell &cell = m_Cells[(pos + i) & m_Mask];
+      out.push_back(std::move(cell.data));
+      cell.data = nullptr;
+      cell.seq.store(pos + i + m_Mask + 1, std::memory_order_release);
+    }
+    Consumed();
+    return count;
+  }
+
+  void Published(size_t tail) {
+    size_t depth = tail - m_Head.load(std::memory_order_relaxed);
+    size_t high = m_HighWatermark.load(std::memory_order_relaxed);
+    while (depth > high && depth <= m_Mask + 1 &&
+           !m_HighWatermark.compare_exchange_weak(high, depth,
+                                                  std::memory_order_relaxed)) {
+    }
+
+    m_PutEpoch.fetch_add(1);
+    if (m_WaitingConsumers.load() > 0)
+      FutexWake(m_PutEpoch);
+  }
+
+  void Consumed() {
+    m_GetEpoch.fetch_add(1);
+    if (m_WaitingProducers.load() > 0)
+      FutexWake(m_GetEpoch);
+  }
+
+  /// Sleep until epoch changes, false if still not ready
+  template<typename Ready>
+  bool WaitFor(std::atomic<uint32_t> &epoch, std::atomic<int> &waiting,
+               Ready ready, const struct timespec *timeout = nullptr) {
+    waiting.fetch_add(1);
+    uint32_t current = epoch.load();
+    bool result = ready();
+    if (!result && !IsClosed()) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch),
+              FUTEX_WAIT_PRIVATE, current, timeout, nullptr, 0);
+      result = ready();
+    }
+    waiting.fetch_sub(1);
+    return result;
+  }
+
+  static void FutexWake(std::atomic<uint32_t> &epoch) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch),
+            FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+ private:
+  const size_t m_Mask;
+  std::unique_ptr<Cell[]> m_Cells;
+  /// Counters are kept apart to avoid false sharing
+  alignas(64) std::atomic<size_t> m_Head;
+  alignas(64) std::atomic<size_t> m_Tail;
+  alignas(64) std::atomic<size_t> m_HighWatermark;
+  alignas(64) std::atomic<uint32_t> m_PutEpoch;
+  alignas(64) std::atomic<uint32_t> m_GetEpoch;
+  std::atomic<bool> m_Closed;
+  std::atomic<int> m_WaitingConsumers;
+  std::atomic<int> m_WaitingProducers;
+};
+
 } // namespace util
 } // namespace pbote
 
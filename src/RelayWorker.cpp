@@ -80,6 +80,14 @@ RelayWorker::addPeer (const std::string &peer)
   return false;
 }
 
+bool
+RelayWorker::addPeer (const sp_destination &destination)
+{
+  auto identity
+      = std::make_shared<i2p::data::IdentityEx> (destination->identity);
+  return addPeer (identity, PEER_MIN_REACHABILITY);
+}
+
 bool
 RelayWorker::addPeer (const sp_i2p_ident &identity, int samples)
 {
@@ -353,7 +361,7 @@ void
 RelayWorker::peerListRequestV4 (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "Relay: peerListRequestV4: request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
   if (addPeer (packet->from))
     {
       LogPrint (eLogDebug,
@@ -387,7 +395,7 @@ void
 RelayWorker::peerListRequestV5 (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "Relay: peerListRequestV5: Request from: ",
-            packet->from.substr (0, 15), "...");
+            packet->from->base64.substr (0, 15), "...");
 
   if (addPeer (packet->from))
     {
@@ -484,9 +492,9 @@ RelayWorker::check_peers ()
 
       auto packet = peerListRequestPacket ();
       auto bytes = packet.toByte ();
-      PacketForQueue q_packet (peer->ToBase64 (), bytes.data (), bytes.size ());
-      std::vector<uint8_t> vcid (std::begin (packet.cid), std::end (packet.cid));
-      batch->addPacket (vcid, q_packet);
+      PacketForQueue q_packet (destinations ().intern (*peer), bytes.data (),
+                               bytes.size ());
+      batch->addPacket (cid_key (packet.cid), q_packet);
     }
 
   LogPrint (eLogDebug, "Relay: Batch size: ", batch->packetCount ());
@@ -531,7 +539,7 @@ RelayWorker::check_peers ()
       /// Increment peer metric back, if we have valid Response Packet
       for (const auto &m_peer : m_peers_)
         {
-          if (m_peer.second->ToBase64 () == response->from)
+          if (m_peer.second->GetIdentHash () == response->from->hash)
             {
               LogPrint (eLogDebug, "Relay: Got response, mark reachable");
               m_peer.second->reachable (true);
@@ -162,6 +162,7 @@ public:
 
   bool addPeer (const uint8_t *buf, int len);
   bool addPeer (const std::string &peer);
+  bool addPeer (const sp_destination &destination);
   bool addPeer (const sp_i2p_ident &identity, int samples);
   void addPeers (const std::vector<sp_peer> &peers);
   void addPeers (const PeerListPacketV4 &peer_list);
@@ -0,0 +1,418 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+
+#include "RoutingTable.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+RoutingTable::RoutingTable ()
+    : m_size (0)
+{
+  auto empty_bucket = std::make_shared<const Bucket> ();
+  auto snap = std::make_shared<Snapshot> ();
+  snap->fill (empty_bucket);
+  m_snapshot = snap;
+}
+
+void
+RoutingTable::set_local (const HashKey &local)
+{
+  std::unique_lock<std::mutex> l (m_write_mutex);
+
+  if (m_local == local)
+    return;
+
+  /// Bucket indexes depend on local hash, so re-distribute known nodes
+  auto nodes = all ();
+  auto empty_bucket = std::make_shared<const Bucket> ();
+  auto snap = std::make_shared<Snapshot> ();
+  snap->fill (empty_bucket);
+  std::atomic_store (&m_snapshot, sp_snapshot (snap));
+  m_size = 0;
+  m_local = local;
+
+  l.unlock ();
+
+  for (const auto &node : nodes)
+    add (node);
+}
+
+bool
+RoutingTable::add (const sp_node &node)
+{
+  const HashKey &hash = node->hash ();
+  size_t index = bucket_index (hash);
+
+  /// Local hash
+  if (index >= BIT_SIZE)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_write_mutex);
+  auto snap = snapshot ();
+  const auto &current = (*snap)[index];
+
+  auto same_hash = [&hash] (const sp_node &n)
+  {
+    return n->hash () == hash;
+  };
+
+  if (std::any_of (current->nodes.begin (), current->nodes.end (), same_hash)
+      || std::any_of (current->replacements.begin (),
+                      current->replacements.end (), same_hash))
+    return false;
+
+  auto bucket = std::make_shared<Bucket> (*current);
+
+  if (bucket->nodes.size () < KADEMLIA_BUCKET_SIZE)
+    {
+      bucket->nodes.push_back (node);
+      m_size++;
+      publish (index, bucket);
+      return true;
+    }
+
+  /// Bucket is full, locked node gives up its place to the new one
+  auto locked_itr = std::find_if (bucket->nodes.begin (), bucket->nodes.end (),
+                                  [] (const sp_node &n) { return n->locked (); });
+  if (locked_itr != bucket->nodes.end ())
+    {
+      bucket->replacements.insert (bucket->replacements.begin (), *locked_itr);
+      *locked_itr = node;
+    }
+  else
+    bucket->replacements.push_back (node);
+
+  m_size++;
+
+  /// The oldest spare node is dropped first
+  if (bucket->replacements.size () > KADEMLIA_REPLACEMENT_CACHE_SIZE)
+    {
+      bucket->replacements.erase (bucket->replacements.begin ());
+      m_size--;
+    }
+
+  publish (index, bucket);
+  return true;
+}
+
+bool
+RoutingTable::remove (const HashKey &hash)
+{
+  size_t index = bucket_index (hash);
+  if (index >= BIT_SIZE)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_write_mutex);
+  auto bucket = std::make_shared<Bucket> (*(*snapshot ())[index]);
+
+  auto same_hash = [&hash] (const sp_node &n)
+  {
+    return n->hash () == hash;
+  };
+
+  auto node_itr = std::find_if (bucket->nodes.begin (), bucket->nodes.end (),
+                                same_hash);
+  if (node_itr != bucket->nodes.end ())
+    {
+      bucket->nodes.erase (node_itr);
+
+      /// Fill the gap with the newest spare node
+      if (!bucket->replacements.empty ())
+        {
+          bucket->nodes.push_back (bucket->replacements.back ());
+          bucket->replacements.pop_back ();
+        }
+    }
+  else
+    {
+      auto repl_itr = std::find_if (bucket->replacements.begin (),
+                                    bucket->replacements.end (), same_hash);
+      if (repl_itr == bucket->replacements.end ())
+        return false;
+
+      bucket->replacements.erase (repl_itr);
+    }
+
+  m_size--;
+  publish (index, bucket);
+  return true;
+}
+
+sp_node
+RoutingTable::find (const HashKey &hash) const
+{
+  size_t index = bucket_index (hash);
+  if (index >= BIT_SIZE)
+    return nullptr;
+
+  auto snap = snapshot ();
+  const auto &bucket = (*snap)[index];
+
+  for (const auto &node : bucket->nodes)
+    if (node->hash () == hash)
+      return node;
+
+  for (const auto &node : bucket->replacements)
+    if (node->hash () == hash)
+      return node;
+
+  return nullptr;
+}
+
+std::vector<sp_node>
+RoutingTable::closest (const HashKey &key, size_t num, bool to_us) const
+{
+  struct sortable_node
+  {
+    sp_node node;
+    i2p::data::XORMetric metric;
+    long latency;
+
+    bool
+    operator< (const sortable_node &other) const
+    {
+      return metric < other.metric;
+    };
+  };
+
+  if (num == 0)
+    return {};
+
+  auto snap = snapshot ();
+  std::vector<sortable_node> candidates;
+
+  i2p::data::XORMetric our_metric;
+  if (to_us)
+    our_metric = key ^ m_local;
+
+  auto collect = [&] (size_t index)
+  {
+    for (const auto &node : (*snap)[index]->nodes)
+      {
+        if (node->locked ())
+          continue;
+
+        /// Distance - XOR result for two hashes.
+        /// Will be than larger, the more they differ.
+        /// We are interested in the minimum difference (distance).
+        i2p::data::XORMetric metric = key ^ node->hash ();
+
+        if (to_us && our_metric < metric)
+          continue;
+
+        candidates.push_back ({ node, metric, node->latency () });
+      }
+  };
+
+  /// Nodes from the bucket of the key are the closest ones,
+  /// all buckets after it share the next distance, and every bucket
+  /// before it is farther than the previous one.
+  /// So we stop as soon as we have enough nodes from whole buckets.
+  size_t key_index = bucket_index (key);
+  if (key_index < BIT_SIZE)
+    {
+      collect (key_index);
+
+      if (candidates.size () < num)
+        for (size_t i = key_index + 1; i < BIT_SIZE; i++)
+          collect (i);
+    }
+
+  for (size_t i = std::min (key_index, (size_t)BIT_SIZE);
+       i-- > 0 && candidates.size () < num;)
+    collect (i);
+
+  size_t result_size = std::min (num, candidates.size ());
+  /// Set of nodes is chosen by distance only
+  std::partial_sort (candidates.begin (), candidates.begin () + result_size,
+                     candidates.end ());
+
+  /// Within it faster nodes go first, so they are queried earlier
+  std::stable_sort (candidates.begin (), candidates.begin () + result_size,
+                    [] (const sortable_node &a, const sortable_node &b)
+                    { return a.latency < b.latency; });
+
+  std::vector<sp_node> result;
+  result.reserve (result_size);
+  for (size_t i = 0; i < result_size; i++)
+    result.push_back (candidates[i].node);
+
+  return result;
+}
+
+std::vector<sp_node>
+RoutingTable::all () const
+{
+  auto snap = snapshot ();
+  std::vector<sp_node> result;
+  result.reserve (m_size);
+
+  for (const auto &bucket : *snap)
+    {
+      result.insert (result.end (), bucket->nodes.begin (),
+                     bucket->nodes.end ());
+      result.insert (result.end (), bucket->replacements.begin (),
+                     bucket->replacements.end ());
+    }
+
+  return result;
+}
+
+std::vector<sp_node>
+RoutingTable::unlocked () const
+{
+  auto snap = snapshot ();
+  std::vector<sp_node> result;
+
+  for (const auto &bucket : *snap)
+    {
+      for (const auto &node : bucket->nodes)
+        if (!node->locked ())
+          result.push_back (node);
+
+      for (const auto &node : bucket->replacements)
+        if (!node->locked ())
+          result.push_back (node);
+    }
+
+  return result;
+}
+
+size_t
+RoutingTable::remove_silent (long max_silence)
+{
+  std::unique_lock<std::mutex> l (m_write_mutex);
+  auto snap = snapshot ();
+  long sec_now = context.ts_now ();
+  size_t removed = 0;
+
+  auto silent = [max_silence, sec_now] (const sp_node &n)
+  {
+    return (sec_now - n->lastseen ()) > max_silence && n->locked ();
+  };
+
+  for (size_t i = 0; i < BIT_SIZE; i++)
+    {
+      const auto &current = (*snap)[i];
+      if (std::none_of (current->nodes.begin (), current->nodes.end (), silent)
+          && std::none_of (current->replacements.begin (),
+                           current->replacements.end (), silent))
+        continue;
+
+      auto bucket = std::make_shared<Bucket> (*current);
+      size_t before = bucket->nodes.size () + bucket->replacements.size ();
+
+      bucket->nodes.erase (std::remove_if (bucket->nodes.begin (),
+                                           bucket->nodes.end (), silent),
+                           bucket->nodes.end ());
+      bucket->replacements.erase (
+          std::remove_if (bucket->replacements.begin (),
+                          bucket->replacements.end (), silent),
+          bucket->replacements.end ());
+
+      while (bucket->nodes.size () < KADEMLIA_BUCKET_SIZE
+             && !bucket->replacements.empty ())
+        {
+          bucket->nodes.push_back (bucket->replacements.back ());
+          bucket->replacements.pop_back ();
+        }
+
+      size_t bucket_removed
+          = before - bucket->nodes.size () - bucket->replacements.size ();
+      removed += bucket_removed;
+      m_size -= bucket_removed;
+
+      publish (i, bucket);
+    }
+
+  return removed;
+}
+
+size_t
+RoutingTable::maintain ()
+{
+  std::unique_lock<std::mutex> l (m_write_mutex);
+  auto snap = snapshot ();
+  size_t swapped = 0;
+
+  for (size_t i = 0; i < BIT_SIZE; i++)
+    {
+      const auto &current = (*snap)[i];
+      if (current->replacements.empty ())
+        continue;
+
+      std::shared_ptr<Bucket> bucket;
+
+      for (size_t n = 0; n < current->nodes.size (); n++)
+        {
+          if (!current->nodes[n]->locked ())
+            continue;
+
+          if (!bucket)
+            bucket = std::make_shared<Bucket> (*current);
+
+          /// Newest unlocked spare node takes the place of the locked one
+          auto repl_itr = std::find_if (bucket->replacements.rbegin (),
+                                        bucket->replacements.rend (),
+                                        [] (const sp_node &r)
+                                        { return !r->locked (); });
+          if (repl_itr == bucket->replacements.rend ())
+            break;
+
+          std::swap (bucket->nodes[n], *repl_itr);
+          swapped++;
+        }
+
+      if (bucket)
+        publish (i, bucket);
+    }
+
+  return swapped;
+}
+
+size_t
+RoutingTable::bucket_index (const HashKey &hash) const
+{
+  /// Length of the common prefix of node hash and local hash
+  const uint8_t *local = m_local.data ();
+  const uint8_t *remote = hash.data ();
+
+  for (size_t i = 0; i < 32; i++)
+    {
+      uint8_t diff = local[i] ^ remote[i];
+      if (diff == 0)
+        continue;
+
+      size_t bit = 0;
+      while (!(diff & 0x80))
+        {
+          diff <<= 1;
+          bit++;
+        }
+
+      return i * 8 + bit;
+    }
+
+  return BIT_SIZE;
+}
+
+void
+RoutingTable::publish (size_t index, const std::shared_ptr<Bucket> &bucket)
+{
+  auto snap = std::make_shared<Snapshot> (*snapshot ());
+  (*snap)[index] = bucket;
+  std::atomic_store (&m_snapshot, sp_snapshot (snap));
+}
+
+} // kademlia
+} // pbote
@@ -0,0 +1,240 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTE_SRC_ROUTING_TABLE_H_
+#define PBOTE_SRC_ROUTING_TABLE_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BoteContext.h"
+#include "DestinationRegistry.h"
+
+// libi2pd
+#include "Identity.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+#define BIT_SIZE 256
+
+/// Max. number of active nodes in one k-bucket
+#define KADEMLIA_BUCKET_SIZE 20
+
+/// Max. number of spare nodes kept for one k-bucket
+#define KADEMLIA_REPLACEMENT_CACHE_SIZE 20
+
+/// Retransmission timeouts for requests to node, in milliseconds
+#define NODE_INITIAL_RTO 10000
+#define NODE_MIN_RTO 3000
+#define NODE_MAX_RTO 30000
+
+/// Node keeps only interned destination, its hash and Base64 come from it
+struct Node
+{
+  /// Interned form of node destination, used for sending packets
+  sp_destination destination;
+
+  /// Liveness and RTT fields are updated by response handlers while
+  /// readers of routing table snapshot check them, so all are atomic.
+  /// Relaxed ordering is enough, they are independent hints.
+  long first_seen;
+  std::atomic<long> last_seen { 0 };
+  std::atomic<int> consecutive_timeouts { 0 };
+  std::atomic<long> locked_until { 0 };
+  /// Smoothed round-trip time and its variation, in milliseconds
+  std::atomic<long> srtt { 0 };
+  std::atomic<long> rttvar { 0 };
+
+  Node (const sp_destination &new_destination)
+      : destination (new_destination), first_seen (0)
+  {
+  }
+
+  const i2p::data::IdentHash &
+  hash () const
+  {
+    return destination->hash;
+  }
+
+  const std::string &
+  base64 () const
+  {
+    return destination->base64;
+  }
+
+  std::string
+  short_name ()
+  {
+    return destination->short_name ();
+  }
+
+  void
+  noResponse ()
+  {
+    int timeouts
+        = consecutive_timeouts.fetch_add (1, std::memory_order_relaxed) + 1;
+
+    const auto current_time = std::chrono::system_clock::now ();
+    const auto lock_time
+        = current_time + std::chrono::minutes (timeouts * 10);
+    const auto lock_epoch = lock_time.time_since_epoch ();
+
+    locked_until.store (
+        std::chrono::duration_cast<std::chrono::seconds> (lock_epoch).count (),
+        std::memory_order_relaxed);
+  }
+
+  void
+  gotResponse ()
+  {
+    last_seen.store (context.ts_now (), std::memory_order_relaxed);
+
+    consecutive_timeouts.store (0, std::memory_order_relaxed);
+    locked_until.store (0, std::memory_order_relaxed);
+  }
+
+  bool
+  locked () const
+  {
+    return context.ts_now () < locked_until.load (std::memory_order_relaxed);
+  }
+
+  long
+  lastseen () const
+  {
+    return last_seen.load (std::memory_order_relaxed);
+  }
+
+  void
+  lastseen (long ts)
+  {
+    last_seen.store (ts, std::memory_order_relaxed);
+  }
+
+  /// RTT estimation as in RFC 6298
+  /// Concurrent samples may overwrite each other, that only loses one of them
+  void
+  rtt_sample (long rtt_ms)
+  {
+    long old_srtt = srtt.load (std::memory_order_relaxed);
+    if (old_srtt == 0)
+      {
+        rttvar.store (rtt_ms / 2, std::memory_order_relaxed);
+        srtt.store (rtt_ms, std::memory_order_relaxed);
+        return;
+      }
+
+    long old_rttvar = rttvar.load (std::memory_order_relaxed);
+    rttvar.store ((3 * old_rttvar + std::labs (old_srtt - rtt_ms)) / 4,
+                  std::memory_order_relaxed);
+    srtt.store ((7 * old_srtt + rtt_ms) / 8, std::memory_order_relaxed);
+  }
+
+  /// Expected response time, used to prefer faster nodes
+  long
+  latency () const
+  {
+    long current_srtt = srtt.load (std::memory_order_relaxed);
+    return current_srtt > 0 ? current_srtt : NODE_INITIAL_RTO;
+  }
+
+  /// Time to wait for response before request retransmission
+  long
+  rto (int attempt) const
+  {
+    long current_srtt = srtt.load (std::memory_order_relaxed);
+    long timeout = NODE_INITIAL_RTO;
+    if (current_srtt > 0)
+      timeout = std::max (current_srtt
+                              + 4 * rttvar.load (std::memory_order_relaxed),
+                          (long)NODE_MIN_RTO);
+
+    /// Exponential backoff for every next attempt
+    for (int i = 1; i < attempt && timeout < NODE_MAX_RTO; i++)
+      timeout *= 2;
+
+    return std::min (timeout, (long)NODE_MAX_RTO);
+  }
+
+};
+
+using sp_node = std::shared_ptr<Node>;
+using HashKey = i2p::data::Tag<32>;
+
+/**
+ * @brief Kademlia routing table
+ *
+ * Nodes are kept in BIT_SIZE buckets indexed by the length of the common
+ * prefix of the node hash and the local hash. Every bucket holds up to
+ * KADEMLIA_BUCKET_SIZE active nodes and a replacement cache of spare ones.
+ *
+ * Readers never take a lock: they work with an immutable snapshot which
+ * writers replace atomically after copying only the changed bucket.
+ */
+class RoutingTable
+{
+ public:
+  struct Bucket
+  {
+    std::vector<sp_node> nodes;
+    std::vector<sp_node> replacements;
+  };
+
+  using sp_bucket = std::shared_ptr<const Bucket>;
+  using Snapshot = std::array<sp_bucket, BIT_SIZE>;
+  using sp_snapshot = std::shared_ptr<const Snapshot>;
+
+  RoutingTable ();
+
+  void set_local (const HashKey &local);
+
+  bool add (const sp_node &node);
+  bool remove (const HashKey &hash);
+  sp_node find (const HashKey &hash) const;
+
+  std::vector<sp_node> closest (const HashKey &key, size_t num,
+                                bool to_us) const;
+
+  std::vector<sp_node> all () const;
+  std::vector<sp_node> unlocked () const;
+  size_t size () const { return m_size; }
+
+  size_t remove_silent (long max_silence);
+  size_t maintain ();
+
+ private:
+  size_t bucket_index (const HashKey &hash) const;
+
+  sp_snapshot
+  snapshot () const
+  {
+    return std::atomic_load (&m_snapshot);
+  }
+
+  void publish (size_t index, const std::shared_ptr<Bucket> &bucket);
+
+  HashKey m_local;
+  std::mutex m_write_mutex;
+  sp_snapshot m_snapshot;
+  std::atomic<size_t> m_size;
+};
+
+} // kademlia
+} // pbote
+
+#endif // PBOTE_SRC_ROUTING_TABLE_H_
@@ -0,0 +1,764 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "FileSystem.h"
+#include "Logging.h"
+#include "SegmentStore.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+SegmentStore::segment::~segment ()
+{
+  if (fd >= 0)
+    ::close (fd);
+}
+
+SegmentStore::SegmentStore (const std::string &path)
+  : m_path (path)
+{
+}
+
+bool
+SegmentStore::open ()
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  try
+    {
+      if (!boost::filesystem::exists (m_path))
+        boost::filesystem::create_directories (m_path);
+    }
+  catch (const std::exception &e)
+    {
+      LogPrint (eLogError, "SegmentStore: open: Can't create ", m_path, ": ",
+                e.what ());
+      return false;
+    }
+
+  std::vector<std::string> paths;
+  pbote::fs::ReadDir (m_path, paths);
+
+  std::vector<uint32_t> ids;
+  for (const auto &path : paths)
+    {
+      auto filename = path.substr (path.find_last_of ("/\\") + 1);
+      size_t ext_pos = filename.size () - strlen (SEGMENT_FILE_EXTENSION);
+
+      if (filename.size () <= strlen (SEGMENT_FILE_EXTENSION)
+          || filename.compare (ext_pos, std::string::npos,
+                               SEGMENT_FILE_EXTENSION) != 0)
+        continue;
+
+      try
+        {
+          ids.push_back ((uint32_t)std::stoul (filename.substr (0, ext_pos)));
+        }
+      catch (const std::exception &)
+        {
+          LogPrint (eLogWarning, "SegmentStore: open: Skip file ", path);
+        }
+    }
+
+  std::sort (ids.begin (), ids.end ());
+
+  /// Later records override earlier ones, so order matters
+  for (size_t i = 0; i < ids.size (); i++)
+    {
+      auto seg = open_segment (ids[i]);
+      if (!seg)
+        return false;
+
+      m_segments[seg->id] = seg;
+      scan_unlocked (seg, i + 1 == ids.size ());
+    }
+
+  if (m_segments.empty () || m_segments.rbegin ()->second->size
+                                 >= SEGMENT_MAX_SIZE)
+    {
+      uint32_t id = m_segments.empty () ? 1 : m_segments.rbegin ()->first + 1;
+      auto seg = open_segment (id);
+      if (!seg)
+        return false;
+
+      m_segments[id] = seg;
+    }
+
+  m_active = m_segments.rbegin ()->second;
+
+  LogPrint (eLogInfo, "SegmentStore: open: ", m_path, ": segments: ",
+            m_segments.size (), ", packets: ",
+            m_index[SEGMENT_RECORD_PACKET].size (), ", deletions: ",
+            m_index[SEGMENT_RECORD_DELETION].size ());
+
+  return true;
+}
+
+bool
+SegmentStore::put (uint8_t kind, const i2p::data::Tag<32> &key,
+                   const std::vector<uint8_t> &data)
+{
+  if (kind >= SEGMENT_RECORD_KINDS || data.size () > SEGMENT_RECORD_MAX_SIZE)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  location loc{};
+  if (!append_unlocked (kind, key, data.data (), (uint32_t)data.size (), loc))
+    return false;
+
+  forget_key_unlocked (kind, key);
+  m_index[kind].emplace (key, loc);
+  m_active->live += SEGMENT_RECORD_HEADER_LEN + loc.length;
+
+  return true;
+}
+
+bool
+SegmentStore::append (uint8_t kind, const i2p::data::Tag<32> &key,
+                      const std::vector<uint8_t> &data)
+{
+  if (kind >= SEGMENT_RECORD_KINDS || data.size () > SEGMENT_RECORD_MAX_SIZE)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  /// The first part is written as put, so data removed before can't be
+  /// taken as its beginning when tombstone is compacted away
+  bool exists = m_index[kind].find (key) != m_index[kind].end ();
+  uint8_t flags = exists ? (kind | SEGMENT_FLAG_APPEND) : kind;
+
+  location loc{};
+  if (!append_unlocked (flags, key, data.data (), (uint32_t)data.size (), loc))
+    return false;
+
+  if (exists)
+    m_appended[kind][key].push_back (loc);
+  else
+    m_index[kind].emplace (key, loc);
+
+  m_active->live += SEGMENT_RECORD_HEADER_LEN + loc.length;
+
+  return true;
+}
+
+size_t
+SegmentStore::length (uint8_t kind, const i2p::data::Tag<32> &key) const
+{
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return 0;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  auto itr = m_index[kind].find (key);
+  if (itr == m_index[kind].end ())
+    return 0;
+
+  size_t result = itr->second.length;
+
+  auto appended = m_appended[kind].find (key);
+  if (appended != m_appended[kind].end ())
+    for (const auto &loc : appended->second)
+      result += loc.length;
+
+  return result;
+}
+
+std::vector<uint8_t>
+SegmentStore::get (uint8_t kind, const i2p::data::Tag<32> &key) const
+{
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return {};
+
+  std::vector<std::pair<sp_segment, location> > parts;
+  size_t total = 0;
+
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+
+    auto itr = m_index[kind].find (key);
+    if (itr == m_index[kind].end ())
+      return {};
+
+    std::vector<location> locations{ itr->second };
+    auto appended = m_appended[kind].find (key);
+    if (appended != m_appended[kind].end ())
+      locations.insert (locations.end (), appended->second.begin (),
+                        appended->second.end ());
+
+    for (const auto &loc : locations)
+      {
+        auto seg_itr = m_segments.find (loc.segment);
+        if (seg_itr == m_segments.end ())
+          return {};
+
+        /// Segment stays open while we read, even if it's compacted
+        parts.emplace_back (seg_itr->second, loc);
+        total += loc.length;
+      }
+  }
+
+  std::vector<uint8_t> data (total);
+  size_t offset = 0;
+
+  for (const auto &part : parts)
+    {
+      if (!read_location (part.first, part.second, data.data () + offset))
+        return {};
+
+      offset += part.second.length;
+    }
+
+  return data;
+}
+
+bool
+SegmentStore::remove (uint8_t kind, const i2p::data::Tag<32> &key)
+{
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  auto itr = m_index[kind].find (key);
+  if (itr == m_index[kind].end ())
+    return false;
+
+  location loc{};
+  if (!append_unlocked (kind | SEGMENT_FLAG_TOMBSTONE, key, nullptr, 0, loc))
+    return false;
+
+  forget_key_unlocked (kind, key);
+
+  return true;
+}
+
+bool
+SegmentStore::exists (uint8_t kind, const i2p::data::Tag<32> &key) const
+{
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return false;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_index[kind].find (key) != m_index[kind].end ();
+}
+
+std::vector<i2p::data::Tag<32> >
+SegmentStore::keys (uint8_t kind) const
+{
+  std::vector<i2p::data::Tag<32> > result;
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return result;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  result.reserve (m_index[kind].size ());
+  for (const auto &entry : m_index[kind])
+    result.push_back (entry.first);
+
+  return result;
+}
+
+size_t
+SegmentStore::count (uint8_t kind) const
+{
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return 0;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_index[kind].size ();
+}
+
+size_t
+SegmentStore::size () const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  size_t result = 0;
+  for (const auto &seg : m_segments)
+    result += seg.second->size;
+
+  return result;
+}
+
+size_t
+SegmentStore::live () const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  size_t result = 0;
+  for (const auto &seg : m_segments)
+    result += seg.second->live;
+
+  return result;
+}
+
+bool
+SegmentStore::compact ()
+{
+  std::unique_lock<std::mutex> compact_lock (m_compact_mutex, std::try_to_lock);
+  if (!compact_lock.owns_lock ())
+    return false;
+
+  sp_segment victim;
+  bool oldest = false;
+  uint32_t first_written = 0;
+
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+
+    /// Segment with the least share of live data goes first
+    for (const auto &entry : m_segments)
+      {
+        const auto &seg = entry.second;
+        if (seg == m_active
+            || (uint64_t)seg->live * 100
+                   >= (uint64_t)seg->size * SEGMENT_COMPACT_LIVE_PERCENT)
+          continue;
+
+        if (!victim || (uint64_t)seg->live * victim->size
+                           < (uint64_t)victim->live * seg->size)
+          victim = seg;
+      }
+
+    if (!victim)
+      return false;
+
+    oldest = victim->id == m_segments.begin ()->first;
+    first_written = m_active->id;
+  }
+
+  /// Sealed segment is not changed, so it's read without lock
+  std::vector<uint8_t> buf (victim->size);
+  if (pread (victim->fd, buf.data (), buf.size (), 0) != (ssize_t)buf.size ())
+    {
+      LogPrint (eLogError, "SegmentStore: compact: Can't read segment ",
+                victim->id);
+      return false;
+    }
+
+  size_t moved = 0, dropped = 0;
+  uint32_t offset = 0;
+  uint8_t flags;
+  i2p::data::Tag<32> key;
+  uint32_t length;
+
+  while (read_record (buf, offset, flags, key, length))
+    {
+      uint32_t record_offset = offset;
+      offset += SEGMENT_RECORD_HEADER_LEN + length;
+      uint8_t kind = flags & SEGMENT_KIND_MASK;
+
+      if (kind >= SEGMENT_RECORD_KINDS)
+        continue;
+
+      std::unique_lock<std::mutex> l (m_mutex);
+      auto itr = m_index[kind].find (key);
+
+      if (flags & SEGMENT_FLAG_TOMBSTONE)
+        {
+          /// Tombstone is needed while older segment can have the record,
+          /// and only if key was not stored again
+          if (oldest || itr != m_index[kind].end ())
+            {
+              dropped++;
+              continue;
+            }
+
+          location loc{};
+          if (!append_unlocked (flags, key, nullptr, 0, loc))
+            return false;
+
+          moved++;
+          continue;
+        }
+
+      if (itr == m_index[kind].end ())
+        {
+          dropped++;
+          continue;
+        }
+
+      /// Appended parts can't be moved one by one, scan after restart
+      /// would see them in other order
+      auto appended = m_appended[kind].find (key);
+      if (appended != m_appended[kind].end ())
+        {
+          bool live = itr->second.segment == victim->id
+                      && itr->second.offset == record_offset;
+          for (const auto &loc : appended->second)
+            live = live || (loc.segment == victim->id
+                            && loc.offset == record_offset);
+
+          if (!live)
+            {
+              dropped++;
+              continue;
+            }
+
+          if (!rewrite_unlocked (kind, key))
+            return false;
+
+          moved++;
+          continue;
+        }
+
+      if (itr->second.segment != victim->id
+          || itr->second.offset != record_offset)
+        {
+          dropped++;
+          continue;
+        }
+
+      location loc{};
+      if (!append_unlocked (kind, key,
+                            buf.data () + record_offset
+                                + SEGMENT_RECORD_HEADER_LEN,
+                            length, loc))
+        return false;
+
+      forget_unlocked (itr->second);
+      itr->second = loc;
+      m_active->live += SEGMENT_RECORD_HEADER_LEN + length;
+      moved++;
+    }
+
+  /// Without it crash right after removal could lose moved records
+  if (!sync (first_written))
+    return false;
+
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    m_segments.erase (victim->id);
+  }
+
+  if (!pbote::fs::Remove (segment_path (victim->id)))
+    LogPrint (eLogWarning, "SegmentStore: compact: Can't remove segment ",
+              victim->id);
+
+  LogPrint (eLogDebug, "SegmentStore: compact: ", m_path, ": segment ",
+            victim->id, " removed, records moved: ", moved, ", dropped: ",
+            dropped);
+
+  return true;
+}
+
+SegmentStore::sp_segment
+SegmentStore::open_segment (uint32_t id)
+{
+  auto path = segment_path (id);
+
+  int fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    {
+      LogPrint (eLogError, "SegmentStore: Can't open segment ", path, ": ",
+                strerror (errno));
+      return nullptr;
+    }
+
+  auto seg = std::make_shared<segment> (id, fd);
+
+  off_t size = lseek (fd, 0, SEEK_END);
+  seg->size = size > 0 ? (uint32_t)size : 0;
+
+  return seg;
+}
+
+std::string
+SegmentStore::segment_path (uint32_t id) const
+{
+  char filename[32];
+  snprintf (filename, sizeof (filename), "%08u%s", id, SEGMENT_FILE_EXTENSION);
+  return m_path + pbote::fs::dirSep + filename;
+}
+
+void
+SegmentStore::scan_unlocked (const sp_segment &seg, bool last)
+{
+  std::vector<uint8_t> buf (seg->size);
+  if (pread (seg->fd, buf.data (), buf.size (), 0) != (ssize_t)buf.size ())
+    {
+      LogPrint (eLogError, "SegmentStore: Can't read segment ", seg->id);
+      seg->size = 0;
+      return;
+    }
+
+  uint32_t offset = 0;
+  uint8_t flags;
+  i2p::data::Tag<32> key;
+  uint32_t length;
+
+  while (read_record (buf, offset, flags, key, length))
+    {
+      apply_unlocked (seg, offset, flags, key, length);
+      offset += SEGMENT_RECORD_HEADER_LEN + length;
+    }
+
+  if (offset == buf.size ())
+    return;
+
+  /// Tail of last segment could be lost on crash, new records go after
+  /// the last valid one
+  LogPrint (last ? eLogWarning : eLogError, "SegmentStore: Segment ", seg->id,
+            " is broken at ", offset, ", lost bytes: ", buf.size () - offset);
+
+  if (last && ftruncate (seg->fd, offset) != 0)
+    LogPrint (eLogError, "SegmentStore: Can't truncate segment ", seg->id);
+
+  seg->size = offset;
+}
+
+void
+SegmentStore::apply_unlocked (const sp_segment &seg, uint32_t offset,
+                              uint8_t flags, const i2p::data::Tag<32> &key,
+                              uint32_t length)
+{
+  uint8_t kind = flags & SEGMENT_KIND_MASK;
+  if (kind >= SEGMENT_RECORD_KINDS)
+    return;
+
+  location loc{ seg->id, offset, length };
+
+  if ((flags & SEGMENT_FLAG_APPEND) && !(flags & SEGMENT_FLAG_TOMBSTONE)
+      && m_index[kind].find (key) != m_index[kind].end ())
+    {
+      m_appended[kind][key].push_back (loc);
+      seg->live += SEGMENT_RECORD_HEADER_LEN + length;
+      return;
+    }
+
+  forget_key_unlocked (kind, key);
+
+  if (flags & SEGMENT_FLAG_TOMBSTONE)
+    return;
+
+  m_index[kind].emplace (key, loc);
+  seg->live += SEGMENT_RECORD_HEADER_LEN + length;
+}
+
+bool
+SegmentStore::append_unlocked (uint8_t flags, const i2p::data::Tag<32> &key,
+                               const uint8_t *data, uint32_t length,
+                               location &result)
+{
+  uint32_t record_size = SEGMENT_RECORD_HEADER_LEN + length;
+
+  if (m_active->size > 0 && m_active->size + record_size > SEGMENT_MAX_SIZE)
+    {
+      auto seg = open_segment (m_active->id + 1);
+      if (!seg)
+        return false;
+
+      m_segments[seg->id] = seg;
+      m_active = seg;
+    }
+
+  std::vector<uint8_t> record (record_size);
+  record[4] = flags;
+  memcpy (record.data () + 5, key.data (), 32);
+  uint32_t be_length = htobe32 (length);
+  memcpy (record.data () + 37, &be_length, 4);
+  if (length > 0)
+    memcpy (record.data () + SEGMENT_RECORD_HEADER_LEN, data, length);
+
+  uint32_t crc = crc32 (0, record.data () + 4, record_size - 4);
+  uint32_t be_crc = htobe32 (crc);
+  memcpy (record.data (), &be_crc, 4);
+
+  size_t done = 0;
+  while (done < record_size)
+    {
+      ssize_t written = pwrite (m_active->fd, record.data () + done,
+                                record_size - done, m_active->size + done);
+      if (written <= 0)
+        {
+          LogPrint (eLogError, "SegmentStore: Can't write segment ",
+                    m_active->id, ": ", strerror (errno));
+
+          /// Partial record would break the segment
+          if (ftruncate (m_active->fd, m_active->size) != 0)
+            LogPrint (eLogError, "SegmentStore: Can't truncate segment ",
+                      m_active->id);
+          return false;
+        }
+
+      done += written;
+    }
+
+  result = location{ m_active->id, m_active->size, length };
+  m_active->size += record_size;
+
+  return true;
+}
+
+void
+SegmentStore::forget_unlocked (const location &loc)
+{
+  auto itr = m_segments.find (loc.segment);
+  if (itr != m_segments.end ())
+    itr->second->live -= SEGMENT_RECORD_HEADER_LEN + loc.length;
+}
+
+void
+SegmentStore::forget_key_unlocked (uint8_t kind,
+                                   const i2p::data::Tag<32> &key)
+{
+  auto itr = m_index[kind].find (key);
+  if (itr == m_index[kind].end ())
+    return;
+
+  forget_unlocked (itr->second);
+  m_index[kind].erase (itr);
+
+  auto appended = m_appended[kind].find (key);
+  if (appended == m_appended[kind].end ())
+    return;
+
+  for (const auto &loc : appended->second)
+    forget_unlocked (loc);
+  m_appended[kind].erase (appended);
+}
+
+bool
+SegmentStore::rewrite_unlocked (uint8_t kind, const i2p::data::Tag<32> &key)
+{
+  std::vector<location> locations{ m_index[kind][key] };
+  const auto &appended = m_appended[kind][key];
+  locations.insert (locations.end (), appended.begin (), appended.end ());
+
+  size_t total = 0;
+  for (const auto &loc : locations)
+    total += loc.length;
+
+  std::vector<uint8_t> data (total);
+  size_t offset = 0;
+
+  for (const auto &loc : locations)
+    {
+      auto seg_itr = m_segments.find (loc.segment);
+      if (seg_itr == m_segments.end ()
+          || !read_location (seg_itr->second, loc, data.data () + offset))
+        return false;
+
+      offset += loc.length;
+    }
+
+  location loc{};
+  if (!append_unlocked (kind, key, data.data (), (uint32_t)data.size (), loc))
+    return false;
+
+  forget_key_unlocked (kind, key);
+  m_index[kind].emplace (key, loc);
+  m_active->live += SEGMENT_RECORD_HEADER_LEN + loc.length;
+
+  return true;
+}
+
+bool
+SegmentStore::read_location (const sp_segment &seg, const location &loc,
+                             uint8_t *buf)
+{
+  size_t done = 0;
+
+  while (done < loc.length)
+    {
+      ssize_t got = pread (seg->fd, buf + done, loc.length - done,
+                           loc.offset + SEGMENT_RECORD_HEADER_LEN + done);
+      if (got <= 0)
+        {
+          LogPrint (eLogError, "SegmentStore: Can't read segment ", seg->id,
+                    ": ", strerror (errno));
+          return false;
+        }
+
+      done += got;
+    }
+
+  return true;
+}
+
+bool
+SegmentStore::sync (uint32_t first_id)
+{
+  std::vector<sp_segment> written;
+
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    for (auto itr = m_segments.lower_bound (first_id);
+         itr != m_segments.end (); ++itr)
+      written.push_back (itr->second);
+  }
+
+  for (const auto &seg : written)
+    {
+      if (fdatasync (seg->fd) != 0)
+        {
+          LogPrint (eLogError, "SegmentStore: Can't sync segment ", seg->id,
+                    ": ", strerror (errno));
+          return false;
+        }
+    }
+
+  /// New segment files must be in directory too
+  int dir_fd = ::open (m_path.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    return false;
+
+  bool synced = fsync (dir_fd) == 0;
+  ::close (dir_fd);
+
+  if (!synced)
+    LogPrint (eLogError, "SegmentStore: Can't sync directory ", m_path);
+
+  return synced;
+}
+
+bool
+SegmentStore::read_record (const std::vector<uint8_t> &buf, uint32_t offset,
+                           uint8_t &flags, i2p::data::Tag<32> &key,
+                           uint32_t &length)
+{
+  if (buf.size () < SEGMENT_RECORD_HEADER_LEN
+      || offset > buf.size () - SEGMENT_RECORD_HEADER_LEN)
+    return false;
+
+  const uint8_t *record = buf.data () + offset;
+
+  uint32_t be_length;
+  memcpy (&be_length, record + 37, 4);
+  length = be32toh (be_length);
+
+  if (length > SEGMENT_RECORD_MAX_SIZE
+      || length > buf.size () - offset - SEGMENT_RECORD_HEADER_LEN)
+    return false;
+
+  uint32_t be_crc;
+  memcpy (&be_crc, record, 4);
+  if (be32toh (be_crc)
+      != crc32 (0, record + 4, SEGMENT_RECORD_HEADER_LEN - 4 + length))
+    return false;
+
+  flags = record[4];
+  key = i2p::data::Tag<32> (record + 5);
+
+  return true;
+}
+
+} // namespace kademlia
+} // namespace pbote
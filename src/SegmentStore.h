@@ -0,0 +1,158 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_SEGMENT_STORE_H_
+#define PBOTED_SRC_SEGMENT_STORE_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// libi2pd
+#include "Tag.h"
+
+namespace pbote
+{
+namespace kademlia
+{
+
+#define SEGMENT_FILE_EXTENSION ".seg"
+/// New segment is started when current one reaches this size
+#define SEGMENT_MAX_SIZE (16 * 1024 * 1024)
+/// Segment with less live data is rewritten by compaction
+#define SEGMENT_COMPACT_LIVE_PERCENT 50
+/// crc[4] + flags[1] + key[32] + length[4] = 41
+#define SEGMENT_RECORD_HEADER_LEN 41
+/// Longer record is treated as corrupted
+#define SEGMENT_RECORD_MAX_SIZE (4 * 1024 * 1024)
+
+/// Kinds of records, stored in lower bits of flags
+#define SEGMENT_RECORD_PACKET 0
+#define SEGMENT_RECORD_DELETION 1
+#define SEGMENT_RECORD_ENTRIES_LOG 2
+#define SEGMENT_RECORD_DELETION_LOG 3
+#define SEGMENT_RECORD_KINDS 4
+/// Record removes key
+#define SEGMENT_FLAG_TOMBSTONE 0x80
+/// Record data is added to the end of data stored under key
+#define SEGMENT_FLAG_APPEND 0x40
+#define SEGMENT_KIND_MASK 0x3f
+
+/**
+ * @brief Append-only store of packets in segment files
+ *
+ * Every put or remove appends a record to the active segment, removal is
+ * a record without data (tombstone). Location of the latest record of
+ * every key is kept in memory and rebuilt by scanning segments on open.
+ * Records are checked with CRC, broken tail of last segment is cut.
+ *
+ * Append writes only the new data, get returns all appended parts after
+ * the last put. Logs of entries are stored this way.
+ *
+ * Compaction copies live records of a sealed segment with much garbage
+ * to the active one and removes it, key with appended parts is written
+ * as one record. Copies are synced to disk before the old segment is
+ * removed, so they survive a crash.
+ */
+class SegmentStore
+{
+ public:
+  explicit SegmentStore (const std::string &path);
+  ~SegmentStore () = default;
+
+  bool open ();
+
+  bool put (uint8_t kind, const i2p::data::Tag<32> &key,
+            const std::vector<uint8_t> &data);
+  std::vector<uint8_t> get (uint8_t kind,
+                            const i2p::data::Tag<32> &key) const;
+  bool remove (uint8_t kind, const i2p::data::Tag<32> &key);
+  bool exists (uint8_t kind, const i2p::data::Tag<32> &key) const;
+  /// Add data to the end of stored one, cost doesn't depend on stored size
+  bool append (uint8_t kind, const i2p::data::Tag<32> &key,
+               const std::vector<uint8_t> &data);
+  /// Bytes stored under key, appended parts included
+  size_t length (uint8_t kind, const i2p::data::Tag<32> &key) const;
+
+  std::vector<i2p::data::Tag<32> > keys (uint8_t kind) const;
+  size_t count (uint8_t kind) const;
+  /// Bytes in all segment files, garbage included
+  size_t size () const;
+  /// Bytes of records which are still in index
+  size_t live () const;
+
+  /// Rewrite one segment, false if there is nothing to compact
+  bool compact ();
+
+ private:
+  struct location
+  {
+    uint32_t segment;
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  struct segment
+  {
+    segment (uint32_t id, int fd) : id (id), fd (fd), size (0), live (0) {}
+    ~segment ();
+
+    uint32_t id;
+    int fd;
+    uint32_t size;
+    /// Bytes of records which are still in index
+    uint32_t live;
+  };
+
+  using sp_segment = std::shared_ptr<segment>;
+
+  sp_segment open_segment (uint32_t id);
+  std::string segment_path (uint32_t id) const;
+  void scan_unlocked (const sp_segment &seg, bool last);
+  void apply_unlocked (const sp_segment &seg, uint32_t offset, uint8_t flags,
+                       const i2p::data::Tag<32> &key, uint32_t length);
+  bool append_unlocked (uint8_t flags, const i2p::data::Tag<32> &key,
+                        const uint8_t *data, uint32_t length,
+                        location &result);
+  void forget_unlocked (const location &loc);
+  void forget_key_unlocked (uint8_t kind, const i2p::data::Tag<32> &key);
+  /// Write key with appended parts as one record
+  bool rewrite_unlocked (uint8_t kind, const i2p::data::Tag<32> &key);
+  static bool read_location (const sp_segment &seg, const location &loc,
+                             uint8_t *buf);
+  /// Flush segments starting with given one and directory to disk
+  bool sync (uint32_t first_id);
+
+  static bool read_record (const std::vector<uint8_t> &buf, uint32_t offset,
+                           uint8_t &flags, i2p::data::Tag<32> &key,
+                           uint32_t &length);
+
+  std::string m_path;
+
+  mutable std::mutex m_mutex;
+  std::array<std::unordered_map<i2p::data::Tag<32>, location>,
+             SEGMENT_RECORD_KINDS> m_index;
+  /// Parts appended after record in index, in order of writing
+  std::array<std::unordered_map<i2p::data::Tag<32>, std::vector<location> >,
+             SEGMENT_RECORD_KINDS> m_appended;
+  std::map<uint32_t, sp_segment> m_segments;
+  sp_segment m_active;
+
+  /// Only one compaction at a time
+  std::mutex m_compact_mutex;
+};
+
+} // namespace kademlia
+} // namespace pbote
+
+#endif // PBOTED_SRC_SEGMENT_STORE_H_
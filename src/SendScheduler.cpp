@@ -0,0 +1,186 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "SendScheduler.h"
+
+namespace pbote
+{
+namespace network
+{
+
+SendScheduler::SendScheduler ()
+    : m_rate (SEND_RATE), m_peer_rate (SEND_PEER_RATE), m_tokens (SEND_BURST),
+      m_updated (clock::now ()), m_pruned (),
+      m_paced (false), m_size (0), m_dropped (0)
+{
+}
+
+void
+SendScheduler::set_rates (size_t rate, size_t peer_rate)
+{
+  m_rate = (double)std::max (rate, (size_t)1);
+  m_peer_rate = (double)std::max (peer_rate, (size_t)1);
+}
+
+void
+SendScheduler::push (sp_queue_pkt packet)
+{
+  if (!packet || !packet->destination)
+    return;
+
+  m_queues[classify (packet)].push_back (std::move (packet));
+  m_size++;
+
+  if (m_size <= SEND_BACKLOG_SIZE)
+    return;
+
+  /// Requests are retransmitted on timeout, so they can be lost
+  for (int c = SEND_CLASSES - 1; c >= 0; c--)
+    {
+      if (m_queues[c].empty ())
+        continue;
+
+      m_queues[c].pop_front ();
+      m_size--;
+      m_dropped++;
+      break;
+    }
+}
+
+size_t
+SendScheduler::pop (std::vector<sp_queue_pkt> &out, size_t max)
+{
+  auto now = clock::now ();
+  double elapsed = std::chrono::duration<double> (now - m_updated).count ();
+  m_tokens = std::min ((double)SEND_BURST, m_tokens + elapsed * m_rate);
+  m_updated = now;
+  m_paced = false;
+
+  size_t count = 0;
+
+  for (size_t c = 0; c < SEND_CLASSES; c++)
+    {
+      auto &queue = m_queues[c];
+      size_t checked = 0;
+
+      for (auto itr = queue.begin ();
+           itr != queue.end () && checked < SEND_SCAN_LIMIT;)
+        {
+          if (count >= max || m_tokens < 1)
+            return count;
+
+          if (c != SEND_RESPONSE && !take_peer (*itr, now))
+            {
+              /// Destination has to wait, others may go, so datagrams
+              /// queued behind burst to one peer are still reached
+              m_paced = true;
+              ++itr;
+              continue;
+            }
+
+          checked++;
+
+          out.push_back (std::move (*itr));
+          itr = queue.erase (itr);
+          m_size--;
+          m_tokens -= 1;
+          count++;
+        }
+    }
+
+  if (m_peers.size () > SEND_PEERS_PRUNE
+      && now - m_pruned > std::chrono::seconds (1))
+    prune (now);
+
+  return count;
+}
+
+std::chrono::milliseconds
+SendScheduler::delay () const
+{
+  if (m_size == 0)
+    return std::chrono::milliseconds (0);
+
+  /// Next global token
+  long wait_ms = 0;
+  if (m_tokens < 1)
+    wait_ms = (long)((1 - m_tokens) * 1000 / m_rate) + 1;
+
+  /// Next token of paced destination
+  if (m_paced)
+    wait_ms = std::max (wait_ms, (long)std::ceil (1000 / m_peer_rate));
+
+  return std::chrono::milliseconds (wait_ms);
+}
+
+send_class
+SendScheduler::classify (const sp_queue_pkt &packet)
+{
+  if (packet->payload.size () <= 4)
+    return SEND_BULK;
+
+  switch (packet->payload[4])
+    {
+    case type::CommN:
+      return SEND_RESPONSE;
+    case type::CommF:
+    case type::CommA:
+    case type::CommQ:
+    case type::CommY:
+      return SEND_LOOKUP;
+    default:
+      return SEND_BULK;
+    }
+}
+
+bool
+SendScheduler::take_peer (const sp_queue_pkt &packet,
+                          const clock::time_point &now)
+{
+  const auto &hash = packet->destination->hash;
+
+  auto itr = m_peers.find (hash);
+  if (itr == m_peers.end ())
+    itr = m_peers.emplace (hash, peer_tokens { SEND_PEER_BURST, now }).first;
+
+  auto &peer = itr->second;
+  double elapsed = std::chrono::duration<double> (now - peer.updated).count ();
+  peer.tokens = std::min ((double)SEND_PEER_BURST,
+                         peer.tokens + elapsed * m_peer_rate);
+  peer.updated = now;
+
+  if (peer.tokens < 1)
+    return false;
+
+  peer.tokens -= 1;
+  return true;
+}
+
+void
+SendScheduler::prune (const clock::time_point &now)
+{
+  m_pruned = now;
+
+  /// Bucket is full again after this time, so it can be forgotten
+  auto refill
+      = std::chrono::seconds ((long)(SEND_PEER_BURST / m_peer_rate) + 1);
+
+  for (auto itr = m_peers.begin (); itr != m_peers.end ();)
+    {
+      if (now - itr->second.updated > refill)
+        itr = m_peers.erase (itr);
+      else
+        ++itr;
+    }
+}
+
+} // namespace network
+} // namespace pbote
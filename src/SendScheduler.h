@@ -0,0 +1,106 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_SEND_SCHEDULER_H_
+#define PBOTED_SRC_SEND_SCHEDULER_H_
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "Packet.h"
+
+namespace pbote
+{
+namespace network
+{
+
+/// Datagrams per second passed to I2P router, default of sendrate option
+#define SEND_RATE 400
+/// Datagrams which can be passed at once after idle time
+#define SEND_BURST 64
+/// Datagrams per second to one destination, default of sendpeerrate option
+#define SEND_PEER_RATE 20
+#define SEND_PEER_BURST 10
+/// Max. number of waiting datagrams, the oldest of lowest class are dropped
+#define SEND_BACKLOG_SIZE 8192
+/// Max. number of waiting datagrams checked in one class per round,
+/// datagrams of paced destinations are skipped without counting
+#define SEND_SCAN_LIMIT 256
+/// Number of destinations after which idle ones are forgotten
+#define SEND_PEERS_PRUNE 4096
+
+enum send_class
+{
+  /// Responses on requests of other nodes
+  SEND_RESPONSE = 0,
+  /// Find close peers, retrieve and other short requests
+  SEND_LOOKUP,
+  /// Store, delete and relay requests
+  SEND_BULK,
+  SEND_CLASSES
+};
+
+/**
+ * @brief Orders outgoing datagrams by priority class and paces them
+ *
+ * Higher class is always sent first. Whole flow is limited by global
+ * token bucket and requests to every destination by its own one, so the
+ * router is not flooded and burst of requests to one node is spread.
+ * Responses are only limited globally.
+ *
+ * Used only from sender thread, so it has no locks.
+ */
+class SendScheduler
+{
+ public:
+  SendScheduler ();
+
+  /// Rates in datagrams per second, zero is taken as one
+  void set_rates (size_t rate, size_t peer_rate);
+  void push (sp_queue_pkt packet);
+  /// Take up to max datagrams allowed to send now
+  size_t pop (std::vector<sp_queue_pkt> &out, size_t max);
+  /// Time until waiting datagram can be sent
+  std::chrono::milliseconds delay () const;
+
+  bool empty () const { return m_size == 0; }
+  size_t size () const { return m_size; }
+  size_t dropped () const { return m_dropped; }
+
+  static send_class classify (const sp_queue_pkt &packet);
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  struct peer_tokens
+  {
+    double tokens;
+    clock::time_point updated;
+  };
+
+  bool take_peer (const sp_queue_pkt &packet, const clock::time_point &now);
+  void prune (const clock::time_point &now);
+
+  std::array<std::deque<sp_queue_pkt>, SEND_CLASSES> m_queues;
+  std::unordered_map<i2p::data::IdentHash, peer_tokens> m_peers;
+  double m_rate, m_peer_rate;
+  double m_tokens;
+  clock::time_point m_updated, m_pruned;
+  /// Waiting datagrams exist, but their destinations are paced
+  bool m_paced;
+  size_t m_size;
+  size_t m_dropped;
+};
+
+} // namespace network
+} // namespace pbote
+
+#endif // PBOTED_SRC_SEND_SCHEDULER_H_
@@ -0,0 +1,749 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "Logging.h"
+#include "StreamTransport.h"
+#include "i2psam.h"
+
+namespace pbote
+{
+namespace network
+{
+
+StreamConnection::StreamConnection (sp_destination destination, int fd,
+                                    bool incoming)
+  : destination (std::move (destination)), fd (fd), incoming (incoming),
+    established (false), connecting (false), closed (false), last_used (context.ts_now ()),
+    created (context.ts_now ())
+{
+}
+
+StreamConnection::~StreamConnection ()
+{
+  if (fd >= 0)
+    ::close (fd);
+}
+
+StreamTransport::StreamTransport (const std::string &sam_host,
+                                  uint16_t sam_port)
+  : running_ (false), m_sam_host (sam_host), m_sam_port (sam_port),
+    m_accept_thread (nullptr), m_recv_thread (nullptr), m_accept_fd (-1),
+    m_recvQueue (nullptr), m_sendQueue (nullptr)
+{
+  m_wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+StreamTransport::~StreamTransport ()
+{
+  stop ();
+
+  if (m_wakeup_fd >= 0)
+    ::close (m_wakeup_fd);
+}
+
+void
+StreamTransport::start (const std::string &session_id)
+{
+  m_session_id = session_id;
+  m_stream_queue.Open ();
+
+  running_ = true;
+
+  m_recv_thread = new std::thread ([this] { run_recv (); });
+  m_accept_thread = new std::thread ([this] { run_accept (); });
+
+  for (size_t i = 0; i < STREAM_SEND_THREADS; i++)
+    m_send_threads.push_back (new std::thread ([this] { run_send (); }));
+
+  LogPrint (eLogInfo, "Network: StreamTransport: Started");
+}
+
+void
+StreamTransport::stop ()
+{
+  if (!running_)
+    return;
+
+  running_ = false;
+
+  /// Wake up all blocked threads
+  m_stream_queue.Close ();
+
+  int accept_fd = m_accept_fd;
+  if (accept_fd >= 0)
+    ::shutdown (accept_fd, SHUT_RDWR);
+
+  {
+    std::unique_lock<std::mutex> l (m_streams_mutex);
+    for (const auto &stream : m_streams)
+      close_unlocked (stream);
+    for (auto itr = m_pool.begin (); itr != m_pool.end ();)
+      {
+        auto stream = (itr++)->second;
+        close_unlocked (stream);
+      }
+  }
+
+  wakeup ();
+
+  for (auto thread : m_send_threads)
+    {
+      thread->join ();
+      delete thread;
+    }
+  m_send_threads.clear ();
+
+  if (m_accept_thread)
+    {
+      m_accept_thread->join ();
+      delete m_accept_thread;
+      m_accept_thread = nullptr;
+    }
+
+  if (m_recv_thread)
+    {
+      m_recv_thread->join ();
+      delete m_recv_thread;
+      m_recv_thread = nullptr;
+    }
+
+  std::unique_lock<std::mutex> l (m_streams_mutex);
+  m_streams.clear ();
+  m_pool.clear ();
+
+  LogPrint (eLogInfo, "Network: StreamTransport: Stopped");
+}
+
+bool
+StreamTransport::send (const sp_queue_pkt &packet)
+{
+  if (!running_ || !packet->destination)
+    return false;
+
+  size_t size = packet->payload.size ();
+  if (size < STREAM_PAYLOAD_THRESHOLD || size > STREAM_PACKET_MAX_SIZE)
+    return false;
+
+  if (packet->destination->stream_blocked_until > context.ts_now ())
+    return false;
+
+  sp_queue_pkt stream_packet = packet;
+  return m_stream_queue.TryPut (stream_packet);
+}
+
+size_t
+StreamTransport::connections () const
+{
+  std::unique_lock<std::mutex> l (m_streams_mutex);
+  return m_streams.size ();
+}
+
+void
+StreamTransport::run_accept ()
+{
+  LogPrint (eLogInfo, "Network: StreamTransport: Accepting streams");
+
+  while (running_)
+    {
+      auto stream = accept ();
+      if (!stream)
+        continue;
+
+      {
+        std::unique_lock<std::mutex> l (m_streams_mutex);
+        if (m_streams.size () >= STREAM_MAX_CONNECTIONS)
+          {
+            LogPrint (eLogWarning, "Network: StreamTransport: Too many ",
+                      "streams, closed: ", stream->destination->short_name ());
+            continue;
+          }
+      }
+
+      struct timeval timeout = { STREAM_WRITE_TIMEOUT, 0 };
+      setsockopt (stream->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                  sizeof (timeout));
+
+      if (!write_hello (stream->fd))
+        continue;
+
+      LogPrint (eLogDebug, "Network: StreamTransport: Incoming stream from ",
+                stream->destination->short_name ());
+
+      /// Stream goes to pool after hello of peer
+      add_stream (stream);
+    }
+}
+
+void
+StreamTransport::run_send ()
+{
+  while (running_)
+    {
+      auto packet = m_stream_queue.GetNext ();
+      if (packet)
+        send_packet (packet);
+    }
+}
+
+void
+StreamTransport::run_recv ()
+{
+  while (running_)
+    {
+      std::vector<sp_stream> streams;
+      {
+        std::unique_lock<std::mutex> l (m_streams_mutex);
+        streams = m_streams;
+      }
+
+      std::vector<struct pollfd> fds (streams.size () + 1);
+      fds[0].fd = m_wakeup_fd;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+
+      for (size_t i = 0; i < streams.size (); i++)
+        {
+          fds[i + 1].fd = streams[i]->fd;
+          fds[i + 1].events = POLLIN;
+          fds[i + 1].revents = 0;
+        }
+
+      int ready = poll (fds.data (), fds.size (), STREAM_POLL_INTERVAL);
+      if (ready < 0 && errno != EINTR)
+        LogPrint (eLogError, "Network: StreamTransport: Poll error: ",
+                  strerror (errno));
+
+      if (fds[0].revents & POLLIN)
+        {
+          uint64_t value;
+          if (::read (m_wakeup_fd, &value, sizeof (value)) < 0)
+            value = 0;
+        }
+
+      for (size_t i = 0; i < streams.size (); i++)
+        {
+          if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+          if (!receive (streams[i]))
+            close_stream (streams[i]);
+        }
+
+      check_timeouts ();
+    }
+}
+
+void
+StreamTransport::send_packet (const sp_queue_pkt &packet)
+{
+  const auto &destination = packet->destination;
+  auto stream = pool_stream (destination);
+
+  if (!stream->established && !stream->closed)
+    {
+      /// Connect can take a minute, other packets to the peer don't wait
+      /// for it and go as datagrams
+      bool expected = false;
+      if (!stream->connecting.compare_exchange_strong (expected, true))
+        {
+          if (m_sendQueue)
+            m_sendQueue->Put (packet);
+          return;
+        }
+
+      open_stream (stream);
+    }
+
+  std::unique_lock<std::mutex> l (stream->write_mutex);
+
+  /// Stream could be closed while we were waiting for it
+  if (stream->closed)
+    {
+      l.unlock ();
+      fallback (packet);
+      return;
+    }
+
+  uint32_t length = htonl ((uint32_t)packet->payload.size ());
+  if (!write_all (stream->fd, (uint8_t *)&length, sizeof (length), MSG_MORE)
+      || !write_all (stream->fd, packet->payload.data (),
+                     packet->payload.size (), 0))
+    {
+      LogPrint (eLogWarning, "Network: StreamTransport: Write failed: ",
+                destination->short_name (), ": ", strerror (errno));
+      destination->stream_blocked_until
+          = context.ts_now () + STREAM_RETRY_INTERVAL;
+      close_stream (stream);
+      l.unlock ();
+      fallback (packet);
+      return;
+    }
+
+  stream->last_used = context.ts_now ();
+  context.add_sent_byte_count (packet->payload.size () + sizeof (length));
+
+  LogPrint (eLogDebug, "Network: StreamTransport: Packet sent, dest: ",
+            destination->short_name (), ", size: ", packet->payload.size ());
+}
+
+void
+StreamTransport::open_stream (const sp_stream &stream)
+{
+  const auto &destination = stream->destination;
+
+  if (connect (stream) && !stream->closed)
+    {
+      LogPrint (eLogDebug, "Network: StreamTransport: Stream opened to ",
+                destination->short_name ());
+      add_stream (stream);
+    }
+  else
+    {
+      LogPrint (eLogDebug, "Network: StreamTransport: Peer doesn't ",
+                "take streams: ", destination->short_name ());
+      destination->stream_blocked_until
+          = context.ts_now () + STREAM_RETRY_INTERVAL;
+      close_stream (stream);
+    }
+
+  stream->connecting = false;
+}
+
+bool
+StreamTransport::connect (const sp_stream &stream)
+{
+  SAM::I2pSocket socket (m_sam_host, m_sam_port);
+  if (!socket.isOk ())
+    {
+      LogPrint (eLogError, "Network: StreamTransport: Can't connect to SAM");
+      return false;
+    }
+
+  socket.write (SAM::Message::streamConnect (m_session_id,
+                                             stream->destination->base64));
+
+  /// Rest of exchange is done on raw socket, SAM answer and
+  /// data of peer can come in one segment
+  int fd = socket.release ();
+  if (fd < 0)
+    return false;
+
+  stream->fd = fd;
+
+  /// Stream could be closed before descriptor was set
+  if (stream->closed)
+    return false;
+
+  std::string answer;
+  if (!read_line (fd, answer, STREAM_CONNECT_TIMEOUT * 1000))
+    return false;
+
+  if (SAM::Message::checkAnswer (answer) != SAM::Message::OK)
+    {
+      LogPrint (eLogDebug, "Network: StreamTransport: Connect failed: ",
+                answer);
+      return false;
+    }
+
+  struct timeval timeout = { STREAM_WRITE_TIMEOUT, 0 };
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+
+  if (!write_hello (fd))
+    return false;
+
+  uint8_t hello[STREAM_HELLO_LEN];
+  if (!read_all (fd, hello, STREAM_HELLO_LEN, STREAM_HELLO_TIMEOUT * 1000)
+      || !check_hello (hello))
+    return false;
+
+  stream->established = true;
+  return true;
+}
+
+sp_stream
+StreamTransport::accept ()
+{
+  SAM::I2pSocket socket (m_sam_host, m_sam_port);
+  if (!socket.isOk ())
+    {
+      LogPrint (eLogError, "Network: StreamTransport: Can't connect to SAM");
+      std::this_thread::sleep_for (std::chrono::seconds (10));
+      return nullptr;
+    }
+
+  socket.write (SAM::Message::streamAccept (m_session_id));
+
+  int fd = socket.release ();
+  if (fd < 0)
+    return nullptr;
+
+  /// Either stop sees descriptor and shuts it down, or we see stop
+  m_accept_fd = fd;
+  if (!running_)
+    {
+      m_accept_fd = -1;
+      ::close (fd);
+      return nullptr;
+    }
+
+  std::string answer, peer;
+  bool accepted = read_line (fd, answer, STREAM_CONNECT_TIMEOUT * 1000);
+
+  if (accepted && SAM::Message::checkAnswer (answer) != SAM::Message::OK)
+    {
+      LogPrint (eLogError, "Network: StreamTransport: Accept failed: ",
+                answer);
+      m_accept_fd = -1;
+      ::close (fd);
+      std::this_thread::sleep_for (std::chrono::seconds (10));
+      return nullptr;
+    }
+
+  /// Blocks until peer connects
+  accepted = accepted && wait_readable (fd)
+             && read_line (fd, peer, STREAM_CONNECT_TIMEOUT * 1000);
+  m_accept_fd = -1;
+
+  if (!accepted)
+    {
+      ::close (fd);
+      return nullptr;
+    }
+
+  /// SAM 3.2 adds ports after destination
+  peer = peer.substr (0, peer.find (' '));
+
+  auto destination = destinations ().intern (peer);
+  if (!destination)
+    {
+      LogPrint (eLogWarning, "Network: StreamTransport: Bad destination");
+      ::close (fd);
+      return nullptr;
+    }
+
+  return std::make_shared<StreamConnection> (destination, fd, true);
+}
+
+sp_stream
+StreamTransport::pool_stream (const sp_destination &destination)
+{
+  std::unique_lock<std::mutex> l (m_streams_mutex);
+
+  auto itr = m_pool.find (destination->hash);
+  if (itr != m_pool.end () && !itr->second->closed)
+    return itr->second;
+
+  /// Placeholder is connected by the first thread which takes it
+  auto stream = std::make_shared<StreamConnection> (destination, -1, false);
+  pool_unlocked (stream);
+  return stream;
+}
+
+void
+StreamTransport::add_stream (const sp_stream &stream)
+{
+  {
+    std::unique_lock<std::mutex> l (m_streams_mutex);
+    m_streams.push_back (stream);
+  }
+
+  wakeup ();
+}
+
+void
+StreamTransport::pool_unlocked (const sp_stream &stream)
+{
+  if (m_pool.size () >= STREAM_POOL_SIZE
+      && m_pool.find (stream->destination->hash) == m_pool.end ())
+    {
+      /// Least recently used stream gives place to new one
+      auto lru = std::min_element (
+          m_pool.begin (), m_pool.end (),
+          [] (const std::pair<const i2p::data::IdentHash, sp_stream> &a,
+              const std::pair<const i2p::data::IdentHash, sp_stream> &b) {
+            return a.second->last_used < b.second->last_used;
+          });
+
+      auto evicted = lru->second;
+      close_unlocked (evicted);
+    }
+
+  m_pool[stream->destination->hash] = stream;
+}
+
+void
+StreamTransport::close_stream (const sp_stream &stream)
+{
+  {
+    std::unique_lock<std::mutex> l (m_streams_mutex);
+    close_unlocked (stream);
+  }
+
+  wakeup ();
+}
+
+void
+StreamTransport::close_unlocked (const sp_stream &stream)
+{
+  stream->closed = true;
+
+  /// Descriptor is closed with the last reference, so it can't be reused
+  /// while other thread works with it
+  int fd = stream->fd;
+  if (fd >= 0)
+    ::shutdown (fd, SHUT_RDWR);
+
+  auto itr = m_pool.find (stream->destination->hash);
+  if (itr != m_pool.end () && itr->second == stream)
+    m_pool.erase (itr);
+}
+
+bool
+StreamTransport::receive (const sp_stream &stream)
+{
+  if (stream->closed)
+    return false;
+
+  uint8_t chunk[STREAM_READ_SIZE];
+  ssize_t received = ::recv (stream->fd, chunk, sizeof (chunk), MSG_DONTWAIT);
+
+  if (received == 0)
+    return false;
+
+  if (received < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+  context.add_recv_byte_count (received);
+  stream->last_used = context.ts_now ();
+
+  auto &buffer = stream->buffer;
+  buffer.insert (buffer.end (), chunk, chunk + received);
+
+  size_t offset = 0;
+
+  if (!stream->established)
+    {
+      if (buffer.size () < STREAM_HELLO_LEN)
+        return true;
+
+      if (!check_hello (buffer.data ()))
+        {
+          LogPrint (eLogWarning, "Network: StreamTransport: Bad hello from ",
+                    stream->destination->short_name ());
+          return false;
+        }
+
+      offset = STREAM_HELLO_LEN;
+      stream->established = true;
+
+      /// Incoming stream is used for our packets too
+      std::unique_lock<std::mutex> l (m_streams_mutex);
+      auto itr = m_pool.find (stream->destination->hash);
+      if (itr == m_pool.end () && !stream->closed)
+        pool_unlocked (stream);
+    }
+
+  std::vector<sp_queue_pkt> packets;
+
+  while (buffer.size () - offset >= sizeof (uint32_t))
+    {
+      uint32_t length;
+      memcpy (&length, buffer.data () + offset, sizeof (length));
+      length = ntohl (length);
+
+      if (length == 0 || length > STREAM_PACKET_MAX_SIZE)
+        {
+          LogPrint (eLogWarning, "Network: StreamTransport: Bad packet ",
+                    "length: ", length, ", from: ",
+                    stream->destination->short_name ());
+          return false;
+        }
+
+      if (buffer.size () - offset - sizeof (length) < length)
+        break;
+
+      auto begin = buffer.begin () + offset + sizeof (length);
+      std::vector<uint8_t> payload (begin, begin + length);
+
+      LogPrint (eLogDebug, "Network: StreamTransport: Packet received, dest: ",
+                stream->destination->short_name (), ", size: ", length);
+
+      packets.push_back (std::make_shared<PacketForQueue> (
+          stream->destination, std::move (payload)));
+
+      offset += sizeof (length) + length;
+    }
+
+  buffer.erase (buffer.begin (), buffer.begin () + offset);
+
+  if (!packets.empty ())
+    m_recvQueue->Put (packets);
+
+  return true;
+}
+
+void
+StreamTransport::check_timeouts ()
+{
+  int32_t now = context.ts_now ();
+
+  {
+    std::unique_lock<std::mutex> l (m_streams_mutex);
+
+    for (const auto &stream : m_streams)
+      {
+        if (!stream->established && now - stream->created > STREAM_HELLO_TIMEOUT)
+          close_unlocked (stream);
+        else if (now - stream->last_used > STREAM_IDLE_TIMEOUT)
+          close_unlocked (stream);
+      }
+
+    m_streams.erase (std::remove_if (m_streams.begin (), m_streams.end (),
+                                     [] (const sp_stream &stream) {
+                                       return (bool)stream->closed;
+                                     }),
+                     m_streams.end ());
+  }
+}
+
+void
+StreamTransport::fallback (const sp_queue_pkt &packet)
+{
+  /// Blocked peer gets packet as datagram, otherwise new stream is opened
+  if (send (packet))
+    return;
+
+  if (m_sendQueue)
+    m_sendQueue->Put (packet);
+}
+
+void
+StreamTransport::wakeup ()
+{
+  uint64_t value = 1;
+  if (::write (m_wakeup_fd, &value, sizeof (value)) < 0)
+    LogPrint (eLogDebug, "Network: StreamTransport: Wakeup skipped");
+}
+
+bool
+StreamTransport::wait_readable (int fd)
+{
+  /// Stop is checked every poll interval
+  while (running_)
+    {
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int ready = poll (&pfd, 1, STREAM_POLL_INTERVAL);
+
+      if (ready > 0)
+        return true;
+
+      if (ready < 0 && errno != EINTR)
+        return false;
+    }
+
+  return false;
+}
+
+bool
+StreamTransport::read_line (int fd, std::string &line, int timeout_ms)
+{
+  line.clear ();
+
+  /// Read by byte, so nothing after line is taken from socket
+  while (line.size () < SAM_LINE_MAX_SIZE)
+    {
+      uint8_t c;
+      if (!read_all (fd, &c, 1, timeout_ms))
+        return false;
+
+      if (c == '\n')
+        return true;
+
+      line.push_back ((char)c);
+    }
+
+  return false;
+}
+
+bool
+StreamTransport::read_all (int fd, uint8_t *buf, size_t len, int timeout_ms)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      if (timeout_ms >= 0)
+        {
+          struct pollfd pfd = { fd, POLLIN, 0 };
+          if (poll (&pfd, 1, timeout_ms) < 1)
+            return false;
+        }
+
+      ssize_t received = ::recv (fd, buf + done, len - done, 0);
+      if (received < 0 && errno == EINTR)
+        continue;
+
+      if (received < 1)
+        return false;
+
+      done += received;
+    }
+
+  return true;
+}
+
+bool
+StreamTransport::write_all (int fd, const uint8_t *buf, size_t len, int flags)
+{
+  size_t done = 0;
+
+  while (done < len)
+    {
+      ssize_t sent = ::send (fd, buf + done, len - done, flags | MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR)
+        continue;
+
+      if (sent < 1)
+        return false;
+
+      done += sent;
+    }
+
+  return true;
+}
+
+bool
+StreamTransport::write_hello (int fd)
+{
+  uint8_t hello[STREAM_HELLO_LEN];
+  memcpy (hello, STREAM_HELLO_PREFIX.data (), STREAM_HELLO_PREFIX.size ());
+  hello[STREAM_HELLO_LEN - 1] = STREAM_VERSION;
+
+  return write_all (fd, hello, STREAM_HELLO_LEN, 0);
+}
+
+bool
+StreamTransport::check_hello (const uint8_t *buf)
+{
+  /// Newer versions are expected to understand this one
+  return memcmp (buf, STREAM_HELLO_PREFIX.data (),
+                 STREAM_HELLO_PREFIX.size ()) == 0
+         && buf[STREAM_HELLO_LEN - 1] >= STREAM_VERSION;
+}
+
+} // namespace network
+} // namespace pbote
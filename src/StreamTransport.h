@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_STREAM_TRANSPORT_H_
+#define PBOTED_SRC_STREAM_TRANSPORT_H_
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "BoteContext.h"
+#include "Queue.h"
+
+namespace pbote
+{
+namespace network
+{
+
+/// Packets from this size are sent through stream, datagrams of several
+/// tunnel messages are lost much more often
+#define STREAM_PAYLOAD_THRESHOLD 4096
+/// Max. size of one packet in stream
+#define STREAM_PACKET_MAX_SIZE 65536
+/// Bytes taken from stream socket at once
+#define STREAM_READ_SIZE 32768
+/// prefix[3] + ver[1], sent by both sides before packets
+#define STREAM_HELLO_LEN 4
+#define STREAM_VERSION 1
+/// Max. number of streams to peers kept open for sending
+#define STREAM_POOL_SIZE 32
+/// Max. number of all open streams, incoming included
+#define STREAM_MAX_CONNECTIONS 64
+/// Number of threads which connect to peers and write packets
+#define STREAM_SEND_THREADS 4
+/// Seconds without traffic after which stream is closed
+#define STREAM_IDLE_TIMEOUT 300
+/// Seconds to wait for SAM answer on STREAM CONNECT
+#define STREAM_CONNECT_TIMEOUT 60
+/// Seconds to wait for hello of peer after stream is opened
+#define STREAM_HELLO_TIMEOUT 10
+/// Seconds to wait for blocked write
+#define STREAM_WRITE_TIMEOUT 30
+/// Seconds before peer, which failed to take stream, is tried again
+#define STREAM_RETRY_INTERVAL 600
+/// Interval in msec for checking timeouts of streams
+#define STREAM_POLL_INTERVAL 1000
+/// Max. length of SAM answer and peer destination line
+#define SAM_LINE_MAX_SIZE 4096
+
+const std::array<std::uint8_t, 3> STREAM_HELLO_PREFIX{ 0x50, 0x42, 0x53 };
+
+struct StreamConnection
+{
+  StreamConnection (sp_destination destination, int fd, bool incoming);
+  ~StreamConnection ();
+
+  sp_destination destination;
+  std::atomic<int> fd;
+  bool incoming;
+  /// Hello of peer is received
+  std::atomic<bool> established;
+  /// Some thread opens stream, packets go as datagrams meanwhile
+  std::atomic<bool> connecting;
+  std::atomic<bool> closed;
+  std::atomic<int32_t> last_used;
+  int32_t created;
+
+  /// Writes of packets are serialized
+  std::mutex write_mutex;
+  /// Received bytes of unfinished packet, used by receiver thread only
+  std::vector<uint8_t> buffer;
+};
+
+using sp_stream = std::shared_ptr<StreamConnection>;
+
+/**
+ * @brief SAM streams for large packets
+ *
+ * Streams are opened with STREAM CONNECT and STREAM ACCEPT on our datagram
+ * session, so peers see the same destination. Stream is kept open and
+ * reused in both directions for all large packets to the peer.
+ * Packets are sent with 4 bytes length before each.
+ *
+ * Peer without stream support never sends hello, then it's not tried
+ * again for STREAM_RETRY_INTERVAL and packets go as datagrams.
+ */
+class StreamTransport
+{
+public:
+  StreamTransport (const std::string &sam_host, uint16_t sam_port);
+  ~StreamTransport ();
+
+  void start (const std::string &session_id);
+  void stop ();
+
+  void
+  setQueues (const queue_type &recvQueue, const queue_type &sendQueue)
+  {
+    m_recvQueue = recvQueue;
+    m_sendQueue = sendQueue;
+  };
+
+  /// False if packet should go as datagram
+  bool send (const sp_queue_pkt &packet);
+
+  size_t connections () const;
+
+  bool
+  running () const
+  {
+    return running_;
+  };
+
+private:
+  void run_accept ();
+  void run_send ();
+  void run_recv ();
+
+  void send_packet (const sp_queue_pkt &packet);
+  void open_stream (const sp_stream &stream);
+  bool connect (const sp_stream &stream);
+  sp_stream accept ();
+  sp_stream pool_stream (const sp_destination &destination);
+  void add_stream (const sp_stream &stream);
+  void pool_unlocked (const sp_stream &stream);
+  void close_stream (const sp_stream &stream);
+  void close_unlocked (const sp_stream &stream);
+  bool receive (const sp_stream &stream);
+  void check_timeouts ();
+  void fallback (const sp_queue_pkt &packet);
+  void wakeup ();
+
+  bool wait_readable (int fd);
+  static bool read_line (int fd, std::string &line, int timeout_ms);
+  static bool read_all (int fd, uint8_t *buf, size_t len, int timeout_ms);
+  static bool write_all (int fd, const uint8_t *buf, size_t len, int flags);
+  static bool write_hello (int fd);
+  static bool check_hello (const uint8_t *buf);
+
+  std::atomic<bool> running_;
+  std::string m_sam_host;
+  uint16_t m_sam_port;
+  std::string m_session_id;
+
+  std::thread *m_accept_thread;
+  std::thread *m_recv_thread;
+  std::vector<std::thread *> m_send_threads;
+  std::atomic<int> m_accept_fd;
+  int m_wakeup_fd;
+
+  /// Streams for sending by destination
+  mutable std::mutex m_streams_mutex;
+  std::unordered_map<i2p::data::IdentHash, sp_stream> m_pool;
+  /// All open streams, read by receiver thread
+  std::vector<sp_stream> m_streams;
+
+  util::RingQueue<sp_queue_pkt> m_stream_queue;
+  queue_type m_recvQueue;
+  queue_type m_sendQueue;
+};
+
+} // namespace network
+} // namespace pbote
+
+#endif // PBOTED_SRC_STREAM_TRANSPORT_H_
@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cassert>
+#include <random>
+#include <vector>
+
+#include "Packet.h"
+
+using namespace pbote;
+
+static sp_destination
+random_destination (std::mt19937 &rng)
+{
+  uint8_t buf[387] = { 0 };
+  for (size_t i = 0; i < 384; i++)
+    buf[i] = (uint8_t)rng ();
+
+  auto destination = destinations ().intern (buf, sizeof (buf));
+  assert (destination);
+
+  return destination;
+}
+
+/// Communication packet with given type and size
+static sp_queue_pkt
+make_packet (const sp_destination &from, uint8_t packet_type, size_t size,
+             uint8_t value)
+{
+  std::vector<uint8_t> buf (COMM_PREFIX.begin (), COMM_PREFIX.end ());
+  buf.push_back (packet_type);
+  buf.resize (std::max (size, buf.size ()), value);
+  return std::make_shared<PacketForQueue> (from, std::move (buf));
+}
+
+static sp_queue_pkt
+wrap (const sp_destination &from, std::vector<uint8_t> &&buf)
+{
+  return std::make_shared<PacketForQueue> (from, std::move (buf));
+}
+
+/// Packets come out as they went in and sender is marked
+static void
+test_round_trip ()
+{
+  std::mt19937 rng (1);
+  auto from = random_destination (rng);
+
+  std::vector<sp_queue_pkt> packets;
+  for (size_t i = 0; i < 20; i++)
+    packets.push_back (make_packet (from, type::CommN, 5 + i * 97,
+                                    (uint8_t)i));
+
+  bool announce = false;
+  assert (!destinations ().container_support (from->hash, announce));
+
+  auto container = makeContainerPacket (packets);
+  assert (container[6] == packets.size ());
+
+  auto result = parseContainerPacket (wrap (from, std::move (container)));
+  assert (result.size () == packets.size ());
+  for (size_t i = 0; i < result.size (); i++)
+    {
+      assert (result[i]->destination == from);
+      assert (result[i]->payload == packets[i]->payload);
+    }
+
+  assert (destinations ().container_support (from->hash, announce));
+
+  /// Empty container is an announce only
+  auto other = random_destination (rng);
+  auto empty = makeContainerPacket ({});
+  assert (empty.size () == CONTAINER_HEADER_LEN);
+  assert (parseContainerPacket (wrap (other, std::move (empty))).empty ());
+  assert (destinations ().container_support (other->hash, announce));
+}
+
+/// Bad header or version gives nothing and doesn't mark sender
+static void
+test_bad_header ()
+{
+  std::mt19937 rng (2);
+  auto from = random_destination (rng);
+  std::vector<sp_queue_pkt> packets{ make_packet (from, type::CommN, 50, 1) };
+  auto container = makeContainerPacket (packets);
+
+  for (size_t len = 0; len < CONTAINER_HEADER_LEN; len++)
+    {
+      std::vector<uint8_t> cut (container.begin (), container.begin () + len);
+      assert (parseContainerPacket (wrap (from, std::move (cut))).empty ());
+    }
+
+  auto bad_prefix = container;
+  bad_prefix[0] ^= 0xff;
+  assert (parseContainerPacket (wrap (from, std::move (bad_prefix))).empty ());
+
+  auto bad_type = container;
+  bad_type[4] = type::CommN;
+  assert (parseContainerPacket (wrap (from, std::move (bad_type))).empty ());
+
+  auto bad_version = container;
+  bad_version[5] = CONTAINER_VERSION + 1;
+  assert (parseContainerPacket (wrap (from, std::move (bad_version))).empty ());
+
+  bool announce = false;
+  assert (!destinations ().container_support (from->hash, announce));
+}
+
+/// Lengths and count which point past the end keep packets read before
+static void
+test_malformed_lengths ()
+{
+  std::mt19937 rng (3);
+  auto from = random_destination (rng);
+
+  std::vector<sp_queue_pkt> packets;
+  for (size_t i = 0; i < 3; i++)
+    packets.push_back (make_packet (from, type::CommN, 100, (uint8_t)i));
+
+  auto container = makeContainerPacket (packets);
+  size_t packet_len = 2 + 100;
+
+  /// Every cut inside the packets
+  for (size_t len = CONTAINER_HEADER_LEN; len < container.size (); len++)
+    {
+      std::vector<uint8_t> cut (container.begin (), container.begin () + len);
+      auto result = parseContainerPacket (wrap (from, std::move (cut)));
+      assert (result.size () == (len - CONTAINER_HEADER_LEN) / packet_len);
+      for (size_t i = 0; i < result.size (); i++)
+        assert (result[i]->payload == packets[i]->payload);
+    }
+
+  /// Count is larger than number of packets
+  auto big_count = container;
+  big_count[6] = CONTAINER_MAX_COUNT;
+  assert (parseContainerPacket (wrap (from, std::move (big_count))).size ()
+          == packets.size ());
+
+  /// Count is smaller, the rest is ignored
+  auto small_count = container;
+  small_count[6] = 1;
+  assert (parseContainerPacket (wrap (from, std::move (small_count))).size ()
+          == 1);
+
+  /// Length of second packet points past the end
+  auto long_length = container;
+  long_length[CONTAINER_HEADER_LEN + packet_len] = 0xff;
+  long_length[CONTAINER_HEADER_LEN + packet_len + 1] = 0xff;
+  auto result = parseContainerPacket (wrap (from, std::move (long_length)));
+  assert (result.size () == 1);
+  assert (result[0]->payload == packets[0]->payload);
+
+  /// Zero and too short lengths are skipped
+  auto zero_length = container;
+  zero_length[CONTAINER_HEADER_LEN] = 0;
+  zero_length[CONTAINER_HEADER_LEN + 1] = 0;
+  assert (parseContainerPacket (wrap (from, std::move (zero_length))).empty ());
+
+  /// Random garbage after header never reads past the end
+  for (int i = 0; i < 10000; i++)
+    {
+      std::vector<uint8_t> garbage (container.begin (),
+                                    container.begin () + CONTAINER_HEADER_LEN);
+      garbage[6] = (uint8_t)rng ();
+      garbage.resize (CONTAINER_HEADER_LEN + rng () % 64);
+      for (size_t j = CONTAINER_HEADER_LEN; j < garbage.size (); j++)
+        garbage[j] = (uint8_t)(rng () % 8);
+
+      size_t size = garbage.size ();
+      for (const auto &packet :
+           parseContainerPacket (wrap (from, std::move (garbage))))
+        assert (packet->payload.size () < size);
+    }
+}
+
+/// Containers inside container are dropped, other packets are kept
+static void
+test_nested ()
+{
+  std::mt19937 rng (4);
+  auto from = random_destination (rng);
+
+  std::vector<sp_queue_pkt> inner{ make_packet (from, type::CommN, 30, 1) };
+  auto nested = wrap (from, makeContainerPacket (inner));
+
+  std::vector<sp_queue_pkt> packets{ make_packet (from, type::CommN, 40, 2),
+                                     nested,
+                                     make_packet (from, type::CommN, 50, 3) };
+
+  auto container = makeContainerPacket (packets);
+  auto result = parseContainerPacket (wrap (from, std::move (container)));
+  assert (result.size () == 2);
+  assert (result[0]->payload == packets[0]->payload);
+  assert (result[1]->payload == packets[2]->payload);
+}
+
+int
+main ()
+{
+  test_round_trip ();
+  test_bad_header ();
+  test_malformed_lengths ();
+  test_nested ();
+
+  return 0;
+}
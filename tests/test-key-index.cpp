@@ -0,0 +1,144 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cassert>
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "KeyIndex.h"
+
+using pbote::kademlia::KeyIndex;
+using key_type = i2p::data::Tag<32>;
+
+static key_type
+random_key (std::mt19937_64 &rng)
+{
+  uint8_t buf[32];
+  for (size_t i = 0; i < sizeof (buf); i += 8)
+    {
+      uint64_t value = rng ();
+      memcpy (buf + i, &value, 8);
+    }
+
+  return key_type (buf);
+}
+
+/// Random inserts and erases against std::set, erase shifts keys back
+/// and every key must still be found after it
+static void
+test_random_operations ()
+{
+  std::mt19937_64 rng (1);
+  KeyIndex index;
+  std::set<key_type> reference;
+
+  std::vector<key_type> keys;
+  for (int i = 0; i < 5000; i++)
+    keys.push_back (random_key (rng));
+
+  for (int i = 0; i < 200000; i++)
+    {
+      const auto &key = keys[rng () % keys.size ()];
+      switch (rng () % 3)
+        {
+        case 0:
+          assert (index.insert (key) == reference.insert (key).second);
+          break;
+        case 1:
+          assert (index.erase (key) == (reference.erase (key) > 0));
+          break;
+        default:
+          assert (index.contains (key) == (reference.count (key) > 0));
+          break;
+        }
+
+      assert (index.size () == reference.size ());
+    }
+
+  for (const auto &key : keys)
+    assert (index.contains (key) == (reference.count (key) > 0));
+
+  auto stored = index.keys ();
+  assert (std::set<key_type> (stored.begin (), stored.end ()) == reference);
+}
+
+/// Table is filled above its initial capacity and emptied back, every
+/// erase moves keys of the probe cluster
+static void
+test_backward_shift ()
+{
+  std::mt19937_64 rng (2);
+  KeyIndex index;
+
+  std::vector<key_type> keys;
+  for (int i = 0; i < 3 * KEY_INDEX_MIN_CAPACITY; i++)
+    {
+      keys.push_back (random_key (rng));
+      assert (index.insert (keys.back ()));
+    }
+
+  for (size_t i = 0; i < keys.size (); i += 2)
+    assert (index.erase (keys[i]));
+
+  for (size_t i = 0; i < keys.size (); i++)
+    assert (index.contains (keys[i]) == (i % 2 == 1));
+
+  for (size_t i = 1; i < keys.size (); i += 2)
+    assert (index.erase (keys[i]));
+
+  assert (index.size () == 0);
+  for (const auto &key : keys)
+    assert (!index.contains (key));
+}
+
+/// Many erases rebuild Bloom filter, it must not lose remaining keys
+static void
+test_bloom_rebuild ()
+{
+  std::mt19937_64 rng (3);
+  KeyIndex index;
+
+  std::vector<key_type> keys;
+  for (int i = 0; i < 8 * KEY_INDEX_MIN_CAPACITY; i++)
+    {
+      keys.push_back (random_key (rng));
+      index.insert (keys.back ());
+    }
+
+  /// Stale keys outnumber live ones, so filter is rebuilt at least once
+  size_t kept = KEY_INDEX_MIN_CAPACITY / 2;
+  for (size_t i = kept; i < keys.size (); i++)
+    assert (index.erase (keys[i]));
+
+  assert (index.size () == kept);
+  for (size_t i = 0; i < keys.size (); i++)
+    assert (index.contains (keys[i]) == (i < kept));
+
+  /// Erased keys can come back
+  for (size_t i = kept; i < keys.size (); i++)
+    assert (index.insert (keys[i]));
+
+  for (const auto &key : keys)
+    assert (index.contains (key));
+
+  index.clear ();
+  assert (index.size () == 0 && index.keys ().empty ());
+  assert (!index.contains (keys.front ()));
+}
+
+int
+main ()
+{
+  test_random_operations ();
+  test_backward_shift ();
+  test_bloom_rebuild ();
+
+  return 0;
+}
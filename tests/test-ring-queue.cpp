@@ -0,0 +1,148 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cassert>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Queue.h"
+
+using pbote::util::RingQueue;
+using element = std::shared_ptr<size_t>;
+
+/// Single thread goes around small ring many times, elements keep order
+/// and full ring doesn't take more
+static void
+test_wraparound ()
+{
+  RingQueue<element> queue (8);
+  assert (queue.GetCapacity () == 8);
+
+  size_t next_put = 0, next_get = 0;
+
+  for (int round = 0; round < 1000; round++)
+    {
+      /// Uneven steps, so head and tail cross the end at every position
+      size_t puts = 1 + round % 8;
+      for (size_t i = 0; i < puts; i++)
+        {
+          auto value = std::make_shared<size_t> (next_put);
+          if (!queue.TryPut (value))
+            {
+              assert (queue.IsFull ());
+              break;
+            }
+          next_put++;
+        }
+
+      size_t gets = 1 + (round * 3) % 8;
+      for (size_t i = 0; i < gets; i++)
+        {
+          auto value = queue.Get ();
+          if (!value)
+            {
+              assert (next_get == next_put);
+              break;
+            }
+          assert (*value == next_get++);
+        }
+
+      assert (queue.GetSize () == next_put - next_get);
+    }
+
+  while (auto value = queue.Get ())
+    assert (*value == next_get++);
+
+  assert (next_get == next_put);
+  assert (queue.IsEmpty ());
+}
+
+/// Bulk put and get claim runs of cells across the end of ring
+static void
+test_bulk_wraparound ()
+{
+  RingQueue<element> queue (16);
+  size_t next_put = 0, next_get = 0;
+
+  for (int round = 0; round < 500; round++)
+    {
+      std::vector<element> batch;
+      for (int i = 0; i < 5 + round % 7; i++)
+        batch.push_back (std::make_shared<size_t> (next_put++));
+
+      assert (queue.Put (batch));
+
+      std::vector<element> out;
+      size_t taken = queue.GetBulk (out, 3 + round % 11,
+                                    std::chrono::milliseconds (0));
+      assert (taken == out.size ());
+      for (const auto &value : out)
+        assert (*value == next_get++);
+
+      /// Next batch must fit, Put would block this thread forever
+      while (queue.GetSize () > 4)
+        assert (*queue.Get () == next_get++);
+    }
+
+  std::vector<element> rest;
+  queue.GetBulk (rest, queue.GetCapacity (), std::chrono::milliseconds (0));
+  for (const auto &value : rest)
+    assert (*value == next_get++);
+
+  assert (next_get == next_put);
+}
+
+/// Producers block on full ring and consumers on empty one, nothing is
+/// lost or taken twice
+static void
+test_threads ()
+{
+  const size_t producers = 4, per_producer = 50000;
+  RingQueue<element> queue (64);
+
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++)
+    threads.emplace_back ([&queue, p, per_producer] {
+      for (size_t i = 0; i < per_producer; i++)
+        assert (queue.Put (std::make_shared<size_t> (p * per_producer + i)));
+    });
+
+  std::vector<uint8_t> seen (producers * per_producer, 0);
+  std::vector<size_t> last (producers, 0);
+  for (size_t i = 0; i < seen.size (); i++)
+    {
+      auto value = queue.GetNext ();
+      assert (value && *value < seen.size () && !seen[*value]);
+      seen[*value] = 1;
+
+      /// Elements of one producer keep their order
+      size_t producer = *value / per_producer;
+      assert (*value + 1 > last[producer]);
+      last[producer] = *value + 1;
+    }
+
+  for (auto &thread : threads)
+    thread.join ();
+
+  assert (queue.IsEmpty ());
+
+  /// Closed queue doesn't block
+  queue.Close ();
+  assert (!queue.GetNext ());
+}
+
+int
+main ()
+{
+  test_wraparound ();
+  test_bulk_wraparound ();
+  test_threads ();
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "RoutingTable.h"
+
+using namespace pbote::kademlia;
+
+#define TEST_NODES 2000
+#define TEST_RESULT_SIZE KADEMLIA_BUCKET_SIZE
+
+/// Random identity bytes are enough for node hash
+static sp_node
+random_node (std::mt19937 &rng)
+{
+  uint8_t buf[387] = { 0 };
+  for (size_t i = 0; i < 384; i++)
+    buf[i] = (uint8_t)rng ();
+
+  auto destination = pbote::destinations ().intern (buf, sizeof (buf));
+  assert (destination);
+
+  return std::make_shared<Node> (destination);
+}
+
+static size_t
+common_prefix (const HashKey &a, const HashKey &b)
+{
+  for (size_t bit = 0; bit < BIT_SIZE; bit++)
+    {
+      uint8_t mask = 0x80 >> (bit % 8);
+      if ((a.data ()[bit / 8] & mask) != (b.data ()[bit / 8] & mask))
+        return bit;
+    }
+
+  return BIT_SIZE;
+}
+
+static HashKey
+flip_bit (const HashKey &hash, size_t bit)
+{
+  HashKey result = hash;
+  uint8_t *bytes = const_cast<uint8_t *> (result.data ());
+  bytes[bit / 8] ^= 0x80 >> (bit % 8);
+  return result;
+}
+
+/// Result must be the nodes closest by XOR among all usable ones,
+/// wherever they are in buckets, and must be ordered by latency
+static void
+check_closest (const RoutingTable &table, const HashKey &key, bool to_us,
+               const HashKey &local, const std::vector<sp_node> &usable)
+{
+  auto result = table.closest (key, TEST_RESULT_SIZE, to_us);
+
+  std::vector<sp_node> reference;
+  for (const auto &node : usable)
+    if (!to_us || !((key ^ local) < (key ^ node->hash ())))
+      reference.push_back (node);
+
+  std::sort (reference.begin (), reference.end (),
+             [&key] (const sp_node &a, const sp_node &b)
+             { return (key ^ a->hash ()) < (key ^ b->hash ()); });
+
+  size_t expected_size = std::min ((size_t)TEST_RESULT_SIZE,
+                                   reference.size ());
+  assert (result.size () == expected_size);
+
+  std::set<sp_node> got (result.begin (), result.end ());
+  std::set<sp_node> expected (reference.begin (),
+                              reference.begin () + expected_size);
+  assert (got == expected);
+
+  for (size_t i = 1; i < result.size (); i++)
+    assert (result[i - 1]->latency () <= result[i]->latency ());
+}
+
+static void
+test_closest ()
+{
+  std::mt19937 rng (1);
+
+  RoutingTable table;
+  HashKey local = random_node (rng)->hash ();
+  table.set_local (local);
+
+  /// Buckets are not overfilled, so all nodes are active, none spare
+  std::vector<size_t> bucket_sizes (BIT_SIZE, 0);
+  std::vector<sp_node> nodes;
+  for (int i = 0; i < TEST_NODES; i++)
+    {
+      auto node = random_node (rng);
+      size_t bucket = common_prefix (local, node->hash ());
+      if (bucket_sizes[bucket] >= KADEMLIA_BUCKET_SIZE)
+        continue;
+
+      if (i % 3 == 0)
+        node->rtt_sample (100 + rng () % 1000);
+
+      assert (table.add (node));
+      bucket_sizes[bucket]++;
+      nodes.push_back (node);
+    }
+
+  assert (table.size () == nodes.size ());
+
+  /// Locked nodes are never returned
+  for (size_t i = 0; i < nodes.size (); i += 10)
+    nodes[i]->noResponse ();
+
+  std::vector<sp_node> usable;
+  for (const auto &node : nodes)
+    if (!node->locked ())
+      usable.push_back (node);
+
+  /// Keys near local hash have few nodes in their bucket, so result is
+  /// taken from buckets on both sides of it
+  for (size_t bit = 0; bit < 16; bit++)
+    {
+      check_closest (table, flip_bit (local, bit), false, local, usable);
+      check_closest (table, flip_bit (local, bit), true, local, usable);
+    }
+
+  for (int i = 0; i < 200; i++)
+    {
+      HashKey key = random_node (rng)->hash ();
+      check_closest (table, key, false, local, usable);
+      check_closest (table, key, true, local, usable);
+    }
+
+  /// Key of usable node gives this node first
+  for (size_t i = 0; i < usable.size (); i += 7)
+    {
+      auto result = table.closest (usable[i]->hash (), 1, false);
+      assert (result.size () == 1 && result[0] == usable[i]);
+    }
+
+  assert (table.closest (local, 0, false).empty ());
+}
+
+int
+main ()
+{
+  test_closest ();
+
+  return 0;
+}
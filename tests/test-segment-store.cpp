@@ -0,0 +1,246 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <boost/filesystem.hpp>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "SegmentStore.h"
+
+using pbote::kademlia::SegmentStore;
+using key_type = i2p::data::Tag<32>;
+
+/// Records of this size fill a segment quickly
+#define FILLER_SIZE (1024 * 1024)
+
+static key_type
+make_key (uint32_t n)
+{
+  uint8_t buf[32] = { 0 };
+  memcpy (buf, &n, sizeof (n));
+  return key_type (buf);
+}
+
+static std::vector<uint8_t>
+make_data (size_t size, uint8_t value)
+{
+  return std::vector<uint8_t> (size, value);
+}
+
+static std::string
+make_dir ()
+{
+  auto path = boost::filesystem::temp_directory_path ()
+              / boost::filesystem::unique_path ("pboted-test-%%%%-%%%%");
+  return path.string ();
+}
+
+static std::string
+segment_path (const std::string &dir, uint32_t id)
+{
+  char filename[32];
+  snprintf (filename, sizeof (filename), "%08u%s", id, SEGMENT_FILE_EXTENSION);
+  return (boost::filesystem::path (dir) / filename).string ();
+}
+
+/// Tail of last segment is cut at the last valid record
+static void
+test_truncated_tail ()
+{
+  auto dir = make_dir ();
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (store.put (SEGMENT_RECORD_PACKET, make_key (1), make_data (100, 1)));
+    assert (store.put (SEGMENT_RECORD_PACKET, make_key (2), make_data (200, 2)));
+  }
+
+  /// Second record is half written
+  auto path = segment_path (dir, 1);
+  auto size = boost::filesystem::file_size (path);
+  boost::filesystem::resize_file (path, size - 100);
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (store.get (SEGMENT_RECORD_PACKET, make_key (1))
+            == make_data (100, 1));
+    assert (!store.exists (SEGMENT_RECORD_PACKET, make_key (2)));
+    assert (store.count (SEGMENT_RECORD_PACKET) == 1);
+
+    /// New records go after the last valid one
+    assert (boost::filesystem::file_size (path) == store.size ());
+    assert (store.put (SEGMENT_RECORD_PACKET, make_key (3), make_data (50, 3)));
+  }
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (store.get (SEGMENT_RECORD_PACKET, make_key (1))
+            == make_data (100, 1));
+    assert (store.get (SEGMENT_RECORD_PACKET, make_key (3))
+            == make_data (50, 3));
+    assert (store.count (SEGMENT_RECORD_PACKET) == 2);
+  }
+
+  boost::filesystem::remove_all (dir);
+}
+
+/// Segment is sealed with live fillers which keep it from compaction
+static void
+fill_segment (SegmentStore &store, uint32_t first_key)
+{
+  size_t fillers = SEGMENT_MAX_SIZE / FILLER_SIZE;
+  for (uint32_t i = 0; i < fillers; i++)
+    assert (store.put (SEGMENT_RECORD_PACKET, make_key (first_key + i),
+                       make_data (FILLER_SIZE, 0xff)));
+}
+
+/// Tombstone is kept while older segment has removed record, and is
+/// dropped with the oldest segment
+static void
+test_tombstone_compaction ()
+{
+  auto dir = make_dir ();
+  const auto removed_key = make_key (1);
+  const auto garbage_key = make_key (2);
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+
+    /// Segment 1: record which is removed later
+    assert (store.put (SEGMENT_RECORD_PACKET, removed_key, make_data (10, 1)));
+    fill_segment (store, 1000);
+
+    /// Segment 2: tombstone and garbage
+    assert (store.remove (SEGMENT_RECORD_PACKET, removed_key));
+    for (int i = 0; i < 20; i++)
+      assert (store.put (SEGMENT_RECORD_PACKET, garbage_key,
+                         make_data (FILLER_SIZE, (uint8_t)i)));
+
+    size_t before = store.size ();
+    assert (store.compact ());
+    assert (store.size () < before);
+    assert (!boost::filesystem::exists (segment_path (dir, 2)));
+    assert (boost::filesystem::exists (segment_path (dir, 1)));
+    assert (!store.exists (SEGMENT_RECORD_PACKET, removed_key));
+  }
+
+  /// Without moved tombstone the record would come back from segment 1
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (!store.exists (SEGMENT_RECORD_PACKET, removed_key));
+    assert (store.get (SEGMENT_RECORD_PACKET, garbage_key)
+            == make_data (FILLER_SIZE, 19));
+    assert (store.count (SEGMENT_RECORD_PACKET)
+            == SEGMENT_MAX_SIZE / FILLER_SIZE + 1);
+
+    /// Oldest segment becomes garbage, then its tombstones aren't needed
+    size_t fillers = SEGMENT_MAX_SIZE / FILLER_SIZE;
+    for (uint32_t i = 0; i < fillers; i++)
+      assert (store.remove (SEGMENT_RECORD_PACKET, make_key (1000 + i)));
+    fill_segment (store, 2000);
+
+    while (store.compact ())
+      ;
+
+    assert (!boost::filesystem::exists (segment_path (dir, 1)));
+    assert (store.live () <= store.size ());
+  }
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (!store.exists (SEGMENT_RECORD_PACKET, removed_key));
+    assert (!store.exists (SEGMENT_RECORD_PACKET, make_key (1000)));
+    assert (store.exists (SEGMENT_RECORD_PACKET, make_key (2000)));
+    assert (store.get (SEGMENT_RECORD_PACKET, garbage_key)
+            == make_data (FILLER_SIZE, 19));
+  }
+
+  boost::filesystem::remove_all (dir);
+}
+
+/// Appended parts are returned in order, also after compaction and
+/// restart
+static void
+test_append ()
+{
+  auto dir = make_dir ();
+  const auto key = make_key (1);
+  const uint8_t kind = SEGMENT_RECORD_ENTRIES_LOG;
+
+  std::vector<uint8_t> expected;
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+
+    for (uint8_t i = 0; i < 5; i++)
+      {
+        auto part = make_data (10, i);
+        assert (store.append (kind, key, part));
+        expected.insert (expected.end (), part.begin (), part.end ());
+      }
+
+    assert (store.get (kind, key) == expected);
+    assert (store.length (kind, key) == expected.size ());
+
+    /// Parts are spread over segments, the first one is compacted
+    fill_segment (store, 1000);
+    for (uint8_t i = 5; i < 10; i++)
+      {
+        auto part = make_data (10, i);
+        assert (store.append (kind, key, part));
+        expected.insert (expected.end (), part.begin (), part.end ());
+      }
+
+    size_t fillers = SEGMENT_MAX_SIZE / FILLER_SIZE;
+    for (uint32_t i = 0; i < fillers; i++)
+      assert (store.remove (SEGMENT_RECORD_PACKET, make_key (1000 + i)));
+    fill_segment (store, 2000);
+
+    assert (store.compact ());
+    assert (!boost::filesystem::exists (segment_path (dir, 1)));
+    assert (store.get (kind, key) == expected);
+  }
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (store.get (kind, key) == expected);
+
+    /// Removed data doesn't become the beginning of new one
+    assert (store.remove (kind, key));
+    assert (store.append (kind, key, make_data (3, 7)));
+    assert (store.get (kind, key) == make_data (3, 7));
+  }
+
+  {
+    SegmentStore store (dir);
+    assert (store.open ());
+    assert (store.get (kind, key) == make_data (3, 7));
+  }
+
+  boost::filesystem::remove_all (dir);
+}
+
+int
+main ()
+{
+  test_truncated_tail ();
+  test_tombstone_compaction ();
+  test_append ();
+
+  return 0;
+}